@@ -0,0 +1,89 @@
+// Microbenchmark of string storage: the legacy global Buffer against per-thread arenas.
+
+#include <assert.h>
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#include "Buffer.hpp"
+
+// Buffer as it was before per-thread arenas: a global list of 1 MB blocks.
+class LegacyBuffer
+{
+public:
+    __attribute__((noinline)) static const char* Store( const char* str, size_t size )
+    {
+        static LegacyBuffer buf;
+        auto ret = buf.Alloc( size+1 );
+        memcpy( ret, str, size );
+        ret[size] = '\0';
+        return ret;
+    }
+
+private:
+    enum { BufSize = 1024*1024 };
+
+    LegacyBuffer() : m_current( nullptr ), m_left( 0 ) {}
+
+    char* Alloc( size_t size )
+    {
+        if( size > m_left )
+        {
+            assert( size <= BufSize );
+            m_current = new char[BufSize];
+            m_left = BufSize;
+            m_buffers.emplace_back( m_current );
+        }
+        const auto ret = m_current;
+        m_current += size;
+        m_left -= size;
+        return ret;
+    }
+
+    std::vector<char*> m_buffers;
+    char* m_current;
+    size_t m_left;
+};
+
+enum { Count = 512 * 1024 };
+enum { Rounds = 5 };
+
+static const char Sha[] = "0123456789abcdef0123456789abcdef01234567";
+
+// Best of several rounds, as timing of fresh memory is noisy.
+template<typename Fn>
+static void Run( const char* name, int threads, Fn fn )
+{
+    double best = 0;
+    for( int r=0; r<Rounds; r++ )
+    {
+        const auto t0 = std::chrono::high_resolution_clock::now();
+        std::vector<std::thread> workers;
+        for( int i=0; i<threads; i++ )
+        {
+            workers.emplace_back( [fn, threads] { for( int j=0; j<Count/threads; j++ ) fn(); } );
+        }
+        for( auto& v : workers ) v.join();
+        const auto t1 = std::chrono::high_resolution_clock::now();
+        const auto ns = double( std::chrono::duration_cast<std::chrono::nanoseconds>( t1 - t0 ).count() ) / Count;
+        if( r == 0 || ns < best ) best = ns;
+    }
+    printf( "%-24s %2d threads %8.2f ns/store\n", name, threads, best );
+}
+
+int main()
+{
+    // Legacy Buffer is not thread safe, it can only be measured on one thread.
+    Run( "legacy Buffer::Store", 1, [] { LegacyBuffer::Store( Sha, 40 ); } );
+    Run( "Buffer::Store", 1, [] { Buffer::Store( Sha, 40 ); } );
+    const auto threads = std::max( 2u, std::thread::hardware_concurrency() );
+    Run( "Buffer::Store", threads, [] { Buffer::Store( Sha, 40 ); } );
+    Run( "Arena scope", 1, [] {
+        ArenaScope scope( Buffer::Local() );
+        Buffer::Store( Sha, 40 );
+    } );
+    printf( "Used %zu bytes, reserved %zu bytes\n", Buffer::Used(), Buffer::Reserved() );
+    return 0;
+}
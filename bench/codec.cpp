@@ -0,0 +1,122 @@
+// Microbenchmark of hash and placeholder conversions: the previous sprintf/atoi based functions against Codec.
+
+#include <chrono>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "Codec.hpp"
+
+enum { Count = 1024 * 1024 };
+enum { Rounds = 5 };
+
+static const char Magic[] = "#$# git-fat ";
+
+// Functions as they were before Codec.
+static const char* LegacySha1ToHex( const unsigned char sha1[20] )
+{
+    static char ret[41] = {};
+    for( int i=0; i<20; i++ )
+    {
+        sprintf( ret+i*2, "%02x", sha1[i] );
+    }
+    return ret;
+}
+
+static inline int LegacyHexVal( char c )
+{
+    if( c >= '0' && c <= '9' ) return c - '0';
+    if( c >= 'a' && c <= 'f' ) return c - 'a' + 10;
+    if( c >= 'A' && c <= 'F' ) return c - 'A' + 10;
+    return -1;
+}
+
+static bool LegacyHexToSha1( const char* hex, unsigned char* sha1 )
+{
+    for( int i=0; i<20; i++ )
+    {
+        const auto hi = LegacyHexVal( hex[i*2] );
+        const auto lo = LegacyHexVal( hex[i*2+1] );
+        if( hi < 0 || lo < 0 ) return false;
+        sha1[i] = ( hi << 4 ) | lo;
+    }
+    return true;
+}
+
+static const char* LegacyEncode( const char* sha1, size_t size )
+{
+    static char ret[75];
+    sprintf( ret, "#$# git-fat %s %20zu\n", sha1, size );
+    return ret;
+}
+
+static bool LegacyDecode( const char* data, const char*& sha1, size_t& size )
+{
+    static char retbuf[41] = {};
+    if( memcmp( data, Magic, 12 ) != 0 ) return false;
+    memcpy( retbuf, data + 12, 40 );
+    sha1 = retbuf;
+    size = atoi( data + 12 + 41 );
+    return true;
+}
+
+static volatile uint64_t s_sink;
+
+template<typename Fn>
+static double Run( Fn fn )
+{
+    double best = 0;
+    for( int r=0; r<Rounds; r++ )
+    {
+        const auto t0 = std::chrono::high_resolution_clock::now();
+        for( size_t i=0; i<Count; i++ ) fn( i );
+        const auto t1 = std::chrono::high_resolution_clock::now();
+        const auto ns = double( std::chrono::duration_cast<std::chrono::nanoseconds>( t1 - t0 ).count() ) / Count;
+        if( r == 0 || ns < best ) best = ns;
+    }
+    return best;
+}
+
+static void Report( const char* name, double legacy, double codec )
+{
+    printf( "%-24s legacy %8.2f ns, codec %8.2f ns, %6.1fx\n", name, legacy, codec, legacy / codec );
+}
+
+int main()
+{
+    std::vector<uint8_t> bin( Count * 20 );
+    for( auto& v : bin ) v = rand();
+    std::vector<char> hex( Count * 41 );
+    Codec::HexEncodeBatch( bin.data(), 20, Count, hex.data() );
+    std::vector<const char*> hexPtr( Count );
+    for( size_t i=0; i<Count; i++ ) hexPtr[i] = hex.data() + i * 41;
+    std::vector<char> placeholders( Count * Codec::PlaceholderSize );
+    for( size_t i=0; i<Count; i++ ) Codec::EncodePlaceholder( hexPtr[i], i * 4099, placeholders.data() + i * Codec::PlaceholderSize );
+
+    char out[80];
+    uint8_t sha[20];
+
+    Report( "hex encode",
+        Run( [&]( size_t i ) { s_sink += LegacySha1ToHex( bin.data() + i * 20 )[7]; } ),
+        Run( [&]( size_t i ) { Codec::HexEncode( bin.data() + i * 20, out ); s_sink += out[7]; } ) );
+    Report( "hex decode",
+        Run( [&]( size_t i ) { LegacyHexToSha1( hexPtr[i], sha ); s_sink += sha[7]; } ),
+        Run( [&]( size_t i ) { Codec::HexDecode( hexPtr[i], sha ); s_sink += sha[7]; } ) );
+    Report( "placeholder encode",
+        Run( [&]( size_t i ) { s_sink += LegacyEncode( hexPtr[i], i )[60]; } ),
+        Run( [&]( size_t i ) { Codec::EncodePlaceholder( hexPtr[i], i, out ); s_sink += out[60]; } ) );
+    Report( "placeholder decode",
+        Run( [&]( size_t i ) { const char* s; size_t size; LegacyDecode( placeholders.data() + i * Codec::PlaceholderSize, s, size ); s_sink += size; } ),
+        Run( [&]( size_t i ) { uint64_t size; Codec::DecodePlaceholder( placeholders.data() + i * Codec::PlaceholderSize, Codec::PlaceholderSize, out, size ); s_sink += size; } ) );
+
+    // Batch calls convert the whole array at once, the time is per entry.
+    std::vector<char> batchHex( Count * 41 );
+    std::vector<uint8_t> batchBin( Count * 20 );
+    const auto encodeBatch = Run( [&]( size_t i ) { if( i == 0 ) Codec::HexEncodeBatch( bin.data(), 20, Count, batchHex.data() ); } );
+    const auto decodeBatch = Run( [&]( size_t i ) { if( i == 0 ) s_sink += Codec::HexDecodeBatch( hexPtr.data(), Count, batchBin.data(), 20 ); } );
+    Report( "hex encode batch", Run( [&]( size_t i ) { memcpy( batchHex.data() + i * 41, LegacySha1ToHex( bin.data() + i * 20 ), 41 ); } ), encodeBatch );
+    Report( "hex decode batch", Run( [&]( size_t i ) { LegacyHexToSha1( hexPtr[i], batchBin.data() + i * 20 ); } ), decodeBatch );
+    return 0;
+}
@@ -0,0 +1,26 @@
+#!/bin/sh
+# Compares results of two benchmark runs.
+#
+#   compare.sh <before.tsv> <after.tsv>
+#
+# Prints time of each operation in both runs and the ratio after/before. Ratios below 1 are improvements.
+
+if [ $# -ne 2 ]; then
+    sed -n '2,6s/^# \{0,1\}//p' "$0"
+    exit 1
+fi
+
+awk -F '\t' '
+    /^#/ { next }
+    FNR == NR { before[$1] = $2; order[n++] = $1; next }
+    { after[$1] = $2 }
+    END {
+        printf "%-20s %10s %10s %8s\n", "operation", "before", "after", "ratio"
+        for( i = 0; i < n; i++ )
+        {
+            op = order[i]
+            if( !( op in after ) ) continue
+            ratio = before[op] > 0 ? sprintf( "%.2f", after[op] / before[op] ) : "-"
+            printf "%-20s %10d %10d %8s\n", op, before[op], after[op], ratio
+        }
+    }' "$1" "$2"
@@ -0,0 +1,123 @@
+#!/bin/sh
+# Generates a synthetic git-lard repository for benchmarking.
+#
+#   gen-repo.sh [options] <dir>
+#
+#   -n <files>       number of fat files (default 1000)
+#   -s <dist>        size distribution as size:weight pairs, sizes may use k, m, g suffixes (default 4k:50,256k:40,8m:10)
+#   -d <depth>       number of commits (default 10)
+#   -c <percent>     files modified by each commit after the first (default 10)
+#   -m <submodules>  number of submodules, each with files/10 fat files (default 0)
+#   -r <seed>        random seed (default 1)
+#
+# Creates <dir>/repo with its fat store remote in <dir>/remote, and submodules in <dir>/sub<i> with remotes in
+# <dir>/sub<i>-remote. Nothing is pushed from the main repository. git-lard must be in PATH as both git-lard and
+# git-fat. File contents depend only on the options, so repositories generated with equal options are identical.
+
+set -e
+
+FILES=1000
+SIZES=4k:50,256k:40,8m:10
+DEPTH=10
+CHANGE=10
+SUBMODULES=0
+SEED=1
+
+while getopts n:s:d:c:m:r: opt; do
+    case $opt in
+        n) FILES=$OPTARG ;;
+        s) SIZES=$OPTARG ;;
+        d) DEPTH=$OPTARG ;;
+        c) CHANGE=$OPTARG ;;
+        m) SUBMODULES=$OPTARG ;;
+        r) SEED=$OPTARG ;;
+        *) sed -n '2,16s/^# \{0,1\}//p' "$0"; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+if [ $# -ne 1 ]; then
+    sed -n '2,16s/^# \{0,1\}//p' "$0"
+    exit 1
+fi
+
+DIR=$1
+mkdir -p "$DIR"
+DIR=$(cd "$DIR" && pwd)
+
+export GIT_AUTHOR_NAME=bench GIT_AUTHOR_EMAIL=bench@localhost GIT_COMMITTER_NAME=bench GIT_COMMITTER_EMAIL=bench@localhost
+export GIT_AUTHOR_DATE="2000-01-01 00:00:00 +0000" GIT_COMMITTER_DATE="2000-01-01 00:00:00 +0000"
+
+# Prints "<path> <size>" for files of commit $2 of a repository with $1 files. The first commit lists all files, later
+# ones a random subset.
+ListFiles()
+{
+    awk -v files="$1" -v commit="$2" -v change="$CHANGE" -v seed="$SEED" -v dist="$SIZES" '
+        function parse( s,    n, u )
+        {
+            n = s + 0
+            u = tolower( substr( s, length( s ) ) )
+            if( u == "k" ) n *= 1024
+            else if( u == "m" ) n *= 1024 * 1024
+            else if( u == "g" ) n *= 1024 * 1024 * 1024
+            return n
+        }
+        BEGIN {
+            num = split( dist, parts, "," )
+            total = 0
+            for( i = 1; i <= num; i++ )
+            {
+                split( parts[i], kv, ":" )
+                size[i] = parse( kv[1] )
+                total += kv[2]
+                limit[i] = total
+            }
+            srand( seed * 1000003 + commit )
+            for( f = 0; f < files; f++ )
+            {
+                pick = rand()
+                if( commit > 0 && rand() * 100 >= change ) continue
+                w = pick * total
+                for( i = 1; i < num && w >= limit[i]; i++ ) {}
+                # Sizes vary by up to a half around the bucket size.
+                printf "d%03d/f%05d.bin %d\n", f / 100, f, int( size[i] * ( 0.5 + rand() ) )
+            }
+        }'
+}
+
+# Writes deterministic pseudo-random contents of file $1 in commit $2, of size $3.
+WriteFile()
+{
+    mkdir -p "$(dirname "$1")"
+    openssl enc -aes-128-ctr -nosalt -pbkdf2 -pass "pass:$SEED-$1-$2" < /dev/zero 2>/dev/null | head -c "$3" > "$1"
+}
+
+# Creates repository $1 with $2 fat files and fat store $3.
+CreateRepo()
+{
+    git init -q "$1"
+    cd "$1"
+    git lard init > /dev/null
+    printf '[rsync]\n\tremote = %s\n' "$3" > .gitfat
+    printf '*.bin filter=fat -crlf\n' > .gitattributes
+    mkdir -p "$3"
+    commit=0
+    while [ $commit -lt "$DEPTH" ]; do
+        ListFiles "$2" $commit | while read -r fn size; do
+            WriteFile "$fn" $commit "$size"
+        done
+        git add -A
+        git commit -q -m "Commit $commit"
+        commit=$((commit + 1))
+    done
+    cd - > /dev/null
+}
+
+CreateRepo "$DIR/repo" "$FILES" "$DIR/remote"
+
+i=0
+while [ $i -lt "$SUBMODULES" ]; do
+    CreateRepo "$DIR/sub$i" $((FILES / 10 + 1)) "$DIR/sub$i-remote"
+    (cd "$DIR/sub$i" && git lard push > /dev/null)
+    (cd "$DIR/repo" && git -c protocol.file.allow=always submodule add -q "$DIR/sub$i" "sub$i" && git commit -q -m "Add submodule sub$i")
+    i=$((i + 1))
+done
@@ -0,0 +1,120 @@
+#!/bin/sh
+# Times git-lard operations on a synthetic repository.
+#
+#   run.sh [-k] [-w <workdir>] <git-lard binary> [gen-repo.sh options]
+#
+#   -k               keep the work directory
+#   -w <workdir>     work directory (default: a new temporary directory)
+#
+# Results are printed to stdout as tab separated "<operation> <milliseconds>" lines, preceded by "#" comment lines
+# describing the run. Save them to files and use compare.sh to compare two builds.
+
+set -e
+
+KEEP=
+WORK=
+while getopts kw: opt; do
+    case $opt in
+        k) KEEP=1 ;;
+        w) WORK=$OPTARG ;;
+        *) sed -n '2,10s/^# \{0,1\}//p' "$0"; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+if [ $# -lt 1 ]; then
+    sed -n '2,10s/^# \{0,1\}//p' "$0"
+    exit 1
+fi
+
+BENCH=$(cd "$(dirname "$0")" && pwd)
+LARD=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+shift
+
+if [ -z "$WORK" ]; then
+    WORK=$(mktemp -d "${TMPDIR:-/tmp}/lard-bench.XXXXXX")
+else
+    mkdir -p "$WORK"
+    WORK=$(cd "$WORK" && pwd)
+fi
+if [ -z "$KEEP" ]; then
+    trap 'rm -rf "$WORK"' EXIT
+fi
+
+# Git configuration of the user must not affect results.
+mkdir -p "$WORK/bin" "$WORK/home"
+ln -sf "$LARD" "$WORK/bin/git-lard"
+ln -sf "$LARD" "$WORK/bin/git-fat"
+export PATH="$WORK/bin:$PATH"
+export HOME="$WORK/home"
+export GIT_CONFIG_NOSYSTEM=1
+git config --global protocol.file.allow always
+unset GIT_LARD_TRACE
+
+Now()
+{
+    date +%s%N
+}
+
+# Runs a command in directory $2 and prints its wall time as operation $1.
+Time()
+{
+    name=$1
+    dir=$2
+    shift 2
+    start=$(Now)
+    if ! (cd "$dir" && "$@") > "$WORK/last.log" 2>&1; then
+        echo "$name failed:" >&2
+        cat "$WORK/last.log" >&2
+        exit 1
+    fi
+    end=$(Now)
+    printf '%s\t%d\n' "$name" $(( (end - start) / 1000000 ))
+}
+
+RemoveFatFiles()
+{
+    (cd "$1" && git ls-files -z '*.bin' | xargs -0 rm -f)
+}
+
+echo "# git-lard $(cd "$BENCH" && git rev-parse --short HEAD 2>/dev/null || echo unknown) $LARD"
+echo "# options $*"
+echo "# $(uname -srm), $(git --version)"
+
+"$BENCH/gen-repo.sh" "$@" "$WORK/data" > /dev/null
+REPO=$WORK/data/repo
+CLONE=$WORK/data/clone
+echo "# files $(cd "$REPO" && git ls-files '*.bin' | wc -l), objects $(ls "$REPO/.git/fat/objects" | wc -l), bytes $(du -sk "$REPO/.git/fat/objects" | cut -f1)k"
+
+Time push "$REPO" git lard push
+Time status "$REPO" git lard status
+Time status-all "$REPO" git lard status --all
+Time verify "$REPO" git lard verify
+Time gc "$REPO" git lard gc
+
+# Every fat file is cleaned again when the index is rebuilt.
+rm -rf "$REPO/.git/index" "$REPO/.git/fat/clean"
+Time clean "$REPO" git add -A
+rm -f "$REPO/.git/index"
+Time clean-cached "$REPO" git add -A
+rm -rf "$REPO/.git/index" "$REPO/.git/fat/clean"
+(cd "$REPO" && git add .gitattributes .gitfat && if [ -f .gitmodules ]; then git add .gitmodules; fi)
+Time add "$REPO" sh -c 'git lard add d[0-9]*'
+# Submodules are added back to the index, which git warns about.
+(cd "$REPO" && git add -A 2>/dev/null)
+
+git clone -q "$REPO" "$CLONE"
+(cd "$CLONE" && git lard init > /dev/null)
+Time pull "$CLONE" git lard pull
+
+# Placeholders are checked out by disabling the smudge filter.
+RemoveFatFiles "$CLONE"
+(cd "$CLONE" && git -c filter.fat.smudge=cat checkout -- .)
+Time checkout "$CLONE" git lard checkout
+
+RemoveFatFiles "$CLONE"
+Time smudge "$CLONE" git checkout -- .
+
+if [ -f "$REPO/.gitmodules" ]; then
+    (cd "$CLONE" && git submodule -q update --init)
+    Time submodule-update "$CLONE" git lard submodule update --init
+fi
@@ -1,9 +1,20 @@
 SRCPATH = ../src
+BENCHPATH = ../bench
+TESTPATH = ../tests
 GITDIR = ../git
 XXHASHDIR = ../xxHash
 GITLIB = $(GITDIR)/libgit.a
 XDIFFLIB = $(GITDIR)/xdiff/lib.a
 
+# Shared library needs position independent code, also in libgit. Git builds its objects in place, so libgit is always
+# built with -fPIC, which lets the static and shared builds share it.
+GITFLAGS = $(OPTFLAGS) -fPIC
+
+ifdef PIC
+OPTFLAGS += -fPIC
+POSTFIX := $(POSTFIX)-pic
+endif
+
 INCLUDES = -I$(SRCPATH) -I$(SRCPATH)/.. $(shell pkg-config --cflags openssl)
 
 LIBS := $(GITLIB) $(XDIFFLIB) -lpthread $(shell pkg-config --libs openssl zlib)
@@ -23,6 +34,10 @@ CFLAGS += -DNO_GETTEXT
 endif
 
 TARGET = git-lard
+LIBTARGET = liblard.a
+SHAREDTARGET = liblard.so
+BENCHTARGETS = $(patsubst $(BENCHPATH)/%.cpp,bench-%,$(wildcard $(BENCHPATH)/*.cpp))
+TESTTARGETS = $(patsubst $(TESTPATH)/%.cpp,test-%,$(wildcard $(TESTPATH)/*.cpp))
 
 BUILDDIR = $(BUILD)$(POSTFIX)/.build/build
 
@@ -34,14 +49,34 @@ OBJS = $(TMPOBJS2:.c=.o)
 
 OBJS := $(patsubst %,$(BUILDDIR)/%,$(OBJS))
 
-$(TARGET): $(OBJS) $(GITLIB) $(XDIFFLIB)
-	$(CXX) $(OBJS) $(CXXFLAGS) $(LIBS) -o $(TARGET)
+TMPLIBOBJS = $(LIBSOURCES:.cpp=.o)
+LIBOBJS = $(TMPLIBOBJS:.c=.o)
+
+LIBOBJS := $(patsubst %,$(BUILDDIR)/%,$(LIBOBJS))
+
+$(TARGET): $(OBJS) $(LIBTARGET) $(GITLIB) $(XDIFFLIB)
+	$(CXX) $(OBJS) $(LIBTARGET) $(CXXFLAGS) $(LIBS) -o $(TARGET)
+
+$(LIBTARGET): $(LIBOBJS)
+	rm -f $@
+	$(AR) rcs $@ $(LIBOBJS)
+
+$(SHAREDTARGET): $(LIBOBJS) $(GITLIB) $(XDIFFLIB)
+	$(CXX) -shared $(LIBOBJS) $(CXXFLAGS) $(LIBS) -o $(SHAREDTARGET)
+
+# Microbenchmarks are single source files linked with the library.
+bench-%: $(BENCHPATH)/%.cpp $(LIBTARGET) $(GITLIB) $(XDIFFLIB)
+	$(CXX) $(INCLUDES) $(CXXFLAGS) $(DEFINES) $< $(LIBTARGET) $(LIBS) -o $@
+
+# Unit tests likewise, they use internal classes of the library.
+test-%: $(TESTPATH)/%.cpp $(TESTPATH)/Check.hpp $(LIBTARGET) $(GITLIB) $(XDIFFLIB)
+	$(CXX) $(INCLUDES) $(CXXFLAGS) $(DEFINES) $< $(LIBTARGET) $(LIBS) -o $@
 
 $(GITLIB):
-	+make -C $(GITDIR) libgit.a CFLAGS="$(OPTFLAGS)"
+	+make -C $(GITDIR) libgit.a CFLAGS="$(GITFLAGS)"
 
 $(XDIFFLIB):
-	+make -C $(GITDIR) xdiff/lib.a CFLAGS="$(OPTFLAGS)"
+	+make -C $(GITDIR) xdiff/lib.a CFLAGS="$(GITFLAGS)"
 
 $(BUILDDIR)/%.o: %.cpp
 	@mkdir -p $(@D)
@@ -66,13 +101,21 @@ $(BUILDDIR)/%.d: %.c
 	rm -f $@.$$$$
 
 ifneq "$(MAKECMDGOALS)" "clean"
--include $(OBJS:.o=.d)
+-include $(OBJS:.o=.d) $(LIBOBJS:.o=.d)
 endif
 
 clean:
 	rm -rf $(BUILD)$(POSTFIX)
-	rm -f $(TARGET)
+	rm -f $(TARGET) $(LIBTARGET) $(SHAREDTARGET) $(BENCHTARGETS) $(TESTTARGETS)
 	make -C $(GITDIR) clean
 
-.PHONY: clean all help
+lib: $(LIBTARGET)
+
+shared: $(SHAREDTARGET)
+
+microbench: $(BENCHTARGETS)
+
+tests: $(TARGET) $(TESTTARGETS)
+
+.PHONY: clean all help lib shared microbench tests
 .SUFFIXES:
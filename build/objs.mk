@@ -1,8 +1,21 @@
 SOURCES = \
+	$(SRCPATH)/git-lard.cpp
+
+LIBSOURCES = \
     $(XXHASHDIR)/xxhash.c \
-	$(SRCPATH)/git-lard.cpp \
+	$(SRCPATH)/AccessLog.cpp \
+	$(SRCPATH)/Arena.cpp \
     $(SRCPATH)/Buffer.cpp \
+	$(SRCPATH)/CleanCache.cpp \
+	$(SRCPATH)/Codec.cpp \
+	$(SRCPATH)/Daemon.cpp \
 	$(SRCPATH)/Debug.cpp \
+	$(SRCPATH)/FatPack.cpp \
 	$(SRCPATH)/Filesystem.cpp \
 	$(SRCPATH)/Lard.cpp \
-	$(SRCPATH)/glue.c
+	$(SRCPATH)/Manifest.cpp \
+	$(SRCPATH)/Progress.cpp \
+	$(SRCPATH)/Sparse.cpp \
+	$(SRCPATH)/Trace.cpp \
+	$(SRCPATH)/glue.c \
+	$(SRCPATH)/liblard.cpp
@@ -0,0 +1,78 @@
+#include <algorithm>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "AccessLog.hpp"
+#include "Debug.hpp"
+#include "FileMap.hpp"
+#include "Filesystem.hpp"
+#include "StringHelpers.hpp"
+
+AccessLog::AccessLog( const std::string& fn )
+    : m_fn( fn )
+{
+}
+
+AccessLog::~AccessLog()
+{
+    Flush();
+}
+
+void AccessLog::Touch( const char* sha1 )
+{
+    AccessRecord r;
+    if( !StringHelpers::HexToSha1( sha1, r.sha1 ) ) return;
+    r.time = (uint32_t)time( nullptr );
+    m_pending.emplace_back( r );
+}
+
+// Records are small enough for O_APPEND writes to not interleave between processes.
+void AccessLog::Flush()
+{
+    if( m_pending.empty() ) return;
+    int fd = open( m_fn.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0666 );
+    if( fd < 0 )
+    {
+        DBGPRINT( "Cannot open access log " << m_fn );
+        m_pending.clear();
+        return;
+    }
+    enum { Batch = 128 };
+    for( size_t i=0; i<m_pending.size(); i+=Batch )
+    {
+        const auto num = std::min<size_t>( Batch, m_pending.size() - i );
+        if( write( fd, m_pending.data() + i, num * sizeof( AccessRecord ) ) < 0 ) break;
+    }
+    close( fd );
+    m_pending.clear();
+}
+
+std::vector<AccessRecord> AccessLog::Read() const
+{
+    std::vector<AccessRecord> ret;
+    if( !Exists( m_fn ) ) return ret;
+    FileMap<char> f( m_fn.c_str(), true );
+    if( !f ) return ret;
+    const auto num = f.Size() / sizeof( AccessRecord );
+    ret.resize( num );
+    memcpy( ret.data(), f, num * sizeof( AccessRecord ) );
+    return ret;
+}
+
+bool AccessLog::Write( const std::vector<AccessRecord>& records )
+{
+    const auto tmp = m_fn + ".tmp";
+    FILE* f = fopen( tmp.c_str(), "wb" );
+    if( !f ) return false;
+    bool ok = records.empty() || fwrite( records.data(), sizeof( AccessRecord ), records.size(), f ) == records.size();
+    ok = fclose( f ) == 0 && ok;
+    if( !ok || rename( tmp.c_str(), m_fn.c_str() ) != 0 )
+    {
+        unlink( tmp.c_str() );
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,37 @@
+#ifndef __ACCESSLOG_HPP__
+#define __ACCESSLOG_HPP__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+struct AccessRecord
+{
+    uint8_t sha1[20];
+    uint32_t time;
+};
+
+static_assert( sizeof( AccessRecord ) == 24, "AccessRecord must be tightly packed" );
+
+// Append-only log of fat object accesses, used to find least recently used objects.
+class AccessLog
+{
+public:
+    AccessLog( const std::string& fn );
+    ~AccessLog();
+
+    AccessLog( const AccessLog& ) = delete;
+    AccessLog& operator=( const AccessLog& ) = delete;
+
+    void Touch( const char* sha1 );
+    void Flush();
+
+    std::vector<AccessRecord> Read() const;
+    bool Write( const std::vector<AccessRecord>& records );
+
+private:
+    std::string m_fn;
+    std::vector<AccessRecord> m_pending;
+};
+
+#endif
@@ -0,0 +1,97 @@
+#include "Arena.hpp"
+
+enum { BufSize = 1024*1024 };
+
+Arena::Arena()
+    : m_current( nullptr )
+    , m_spare( nullptr )
+    , m_left( 0 )
+    , m_used( 0 )
+    , m_reserved( 0 )
+{
+}
+
+Arena::~Arena()
+{
+    for( auto& v : m_blocks )
+    {
+        delete[] v.ptr;
+    }
+    delete[] m_spare;
+}
+
+// Keeps the first regular block, so that an arena reused in a loop does not hit the allocator.
+void Arena::Clear()
+{
+    size_t keep = 0;
+    while( keep < m_blocks.size() && m_blocks[keep].size != BufSize ) keep++;
+    for( size_t i=0; i<m_blocks.size(); i++ )
+    {
+        if( i != keep ) delete[] m_blocks[i].ptr;
+    }
+    if( keep < m_blocks.size() )
+    {
+        m_blocks[0] = m_blocks[keep];
+        m_blocks.resize( 1 );
+        m_current = m_blocks[0].ptr;
+        m_left = BufSize;
+        m_reserved = BufSize;
+    }
+    else
+    {
+        m_blocks.clear();
+        m_current = nullptr;
+        m_left = 0;
+        m_reserved = 0;
+    }
+    m_used = 0;
+    delete[] m_spare;
+    m_spare = nullptr;
+}
+
+// Blocks allocated after the marker are freed. The block current at the marker is older, so it is still alive. One
+// regular block is kept as a spare, so that a scope repeatedly crossing a block boundary does not hit the allocator.
+void Arena::Rewind( const Marker& marker )
+{
+    for( size_t i=marker.blocks; i<m_blocks.size(); i++ )
+    {
+        if( !m_spare && m_blocks[i].size == BufSize )
+        {
+            m_spare = m_blocks[i].ptr;
+            continue;
+        }
+        m_reserved -= m_blocks[i].size;
+        delete[] m_blocks[i].ptr;
+    }
+    m_blocks.resize( marker.blocks );
+    m_current = marker.current;
+    m_left = marker.left;
+    m_used = marker.used;
+}
+
+// Allocations larger than a quarter of a block get a block of their own, and the current block stays in use.
+char* Arena::AllocBlock( size_t size )
+{
+    if( size > BufSize / 4 )
+    {
+        const auto ptr = new char[size];
+        m_blocks.emplace_back( Block { ptr, size } );
+        m_reserved += size;
+        return ptr;
+    }
+    if( m_spare )
+    {
+        m_current = m_spare;
+        m_spare = nullptr;
+    }
+    else
+    {
+        m_current = new char[BufSize];
+        m_reserved += BufSize;
+    }
+    m_left = BufSize - size;
+    m_blocks.emplace_back( Block { m_current, BufSize } );
+    const auto ret = m_current;
+    m_current += size;
+    return ret;
+}
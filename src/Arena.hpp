@@ -0,0 +1,89 @@
+#ifndef __ARENA_HPP__
+#define __ARENA_HPP__
+
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+// Bump allocator for many short strings, released all at once or rewound to a marker. Not thread safe.
+class Arena
+{
+public:
+    // Allocation state which can be restored with Rewind().
+    struct Marker
+    {
+        size_t blocks;
+        char* current;
+        size_t left;
+        size_t used;
+    };
+
+    Arena();
+    ~Arena();
+
+    Arena( const Arena& ) = delete;
+    Arena( Arena&& ) = delete;
+    Arena& operator=( const Arena& ) = delete;
+    Arena& operator=( Arena&& ) = delete;
+
+    const char* Store( const char* str ) { return Store( str, strlen( str ) ); }
+    const char* Store( const char* str, size_t len )
+    {
+        auto ret = Alloc( len+1 );
+        memcpy( ret, str, len );
+        ret[len] = '\0';
+        return ret;
+    }
+
+    char* Alloc( size_t size )
+    {
+        m_used += size;
+        if( size > m_left ) return AllocBlock( size );
+        const auto ret = m_current;
+        m_current += size;
+        m_left -= size;
+        return ret;
+    }
+
+    void Clear();
+
+    Marker GetMarker() const { return Marker { m_blocks.size(), m_current, m_left, m_used }; }
+    void Rewind( const Marker& marker );
+
+    // Bytes handed out, and bytes allocated from the system.
+    size_t Used() const { return m_used; }
+    size_t Reserved() const { return m_reserved; }
+
+private:
+    char* AllocBlock( size_t size );
+
+    struct Block
+    {
+        char* ptr;
+        size_t size;
+    };
+
+    std::vector<Block> m_blocks;
+    char* m_current;
+    char* m_spare;
+    size_t m_left;
+    size_t m_used;
+    size_t m_reserved;
+};
+
+// Releases everything stored in an arena during its lifetime.
+class ArenaScope
+{
+public:
+    ArenaScope( Arena& arena ) : m_arena( arena ), m_marker( arena.GetMarker() ) {}
+    ~ArenaScope() { m_arena.Rewind( m_marker ); }
+
+    ArenaScope( const ArenaScope& ) = delete;
+    ArenaScope& operator=( const ArenaScope& ) = delete;
+
+private:
+    Arena& m_arena;
+    Arena::Marker m_marker;
+};
+
+#endif
@@ -1,61 +1,63 @@
-#include <assert.h>
-#include <stdlib.h>
-#include <string.h>
+#include <mutex>
+#include <vector>
+
 #include "Buffer.hpp"
 
-enum { BufSize = 1024*1024 };
+// Arenas are never destroyed, as strings may be referenced during static destruction.
+static std::mutex s_lock;
+static std::vector<Arena*>* s_arenas;
+static std::vector<Arena*>* s_unused;
 
-Buffer::Buffer()
-    : m_current( nullptr )
-    , m_left( 0 )
-{
-}
+thread_local Arena* Buffer::s_local = nullptr;
 
-Buffer::~Buffer()
+// Returns the arena of an exiting thread for reuse. Its strings are left in place.
+struct ArenaRelease
 {
-    for( auto& v : m_buffers )
+    ~ArenaRelease()
     {
-        delete[] v;
+        std::lock_guard<std::mutex> lg( s_lock );
+        if( !s_unused ) s_unused = new std::vector<Arena*>;
+        s_unused->emplace_back( Buffer::s_local );
+        Buffer::s_local = nullptr;
     }
-}
+};
 
-Buffer& Buffer::GetInstance()
+Arena& Buffer::Register()
 {
-    static Buffer buf;
-    return buf;
-}
+    thread_local ArenaRelease release;
+    (void)release;
 
-const char* Buffer::Store( const char* str )
-{
-    auto& buf = GetInstance();
-    const auto size = strlen( str ) + 1;
-    buf.CheckSize( size );
-    memcpy( buf.m_current, str, size );
-    const auto ret = buf.m_current;
-    buf.m_current += size;
-    buf.m_left -= size;
-    return ret;
+    std::lock_guard<std::mutex> lg( s_lock );
+    if( s_unused && !s_unused->empty() )
+    {
+        s_local = s_unused->back();
+        s_unused->pop_back();
+        return *s_local;
+    }
+    s_local = new Arena;
+    if( !s_arenas ) s_arenas = new std::vector<Arena*>;
+    s_arenas->emplace_back( s_local );
+    return *s_local;
 }
 
-const char* Buffer::Store( const char* str, size_t size )
+size_t Buffer::Used()
 {
-    auto& buf = GetInstance();
-    buf.CheckSize( size+1 );
-    memcpy( buf.m_current, str, size );
-    buf.m_current[size++] = '\0';
-    const auto ret = buf.m_current;
-    buf.m_current += size;
-    buf.m_left -= size;
+    std::lock_guard<std::mutex> lg( s_lock );
+    size_t ret = 0;
+    if( s_arenas )
+    {
+        for( auto& v : *s_arenas ) ret += v->Used();
+    }
     return ret;
 }
 
-void Buffer::CheckSize( size_t size )
+size_t Buffer::Reserved()
 {
-    if( size > m_left )
+    std::lock_guard<std::mutex> lg( s_lock );
+    size_t ret = 0;
+    if( s_arenas )
     {
-        assert( size <= BufSize );
-        m_current = new char[BufSize];
-        m_left = BufSize;
-        m_buffers.emplace_back( m_current );
+        for( auto& v : *s_arenas ) ret += v->Reserved();
     }
+    return ret;
 }
@@ -2,30 +2,33 @@
 #define __BUFFER_HPP__
 
 #include <stdlib.h>
-#include <vector>
 
+#include "Arena.hpp"
+
+// Global string storage, valid for the lifetime of the program. Each thread stores into its own arena, so Store is
+// thread safe and lock free. Arenas of finished threads are kept, strings stored by workers stay valid, and they are
+// handed over to threads started later. The number of arenas is the peak number of threads, not the total.
 class Buffer
 {
 public:
-    Buffer( const Buffer& ) = delete;
-    Buffer( Buffer&& ) = delete;
-    ~Buffer();
+    Buffer() = delete;
+
+    static const char* Store( const char* str ) { return Local().Store( str ); }
+    static const char* Store( const char* str, size_t len ) { return Local().Store( str, len ); }
 
-    Buffer& operator=( const Buffer& ) = delete;
-    Buffer& operator=( Buffer&& ) = delete;
+    // Arena of the calling thread, e.g. for an ArenaScope releasing temporary strings.
+    static Arena& Local() { return s_local ? *s_local : Register(); }
 
-    static const char* Store( const char* str );
-    static const char* Store( const char* str, size_t len );
+    // Totals of all threads. Only exact when no other thread is storing.
+    static size_t Used();
+    static size_t Reserved();
 
 private:
-    Buffer();
-    static Buffer& GetInstance();
+    friend struct ArenaRelease;
 
-    void CheckSize( size_t size );
+    static Arena& Register();
 
-    std::vector<char*> m_buffers;
-    char* m_current;
-    size_t m_left;
+    static thread_local Arena* s_local;
 };
 
 #endif
@@ -0,0 +1,178 @@
+#include <algorithm>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <unordered_set>
+#include <vector>
+
+#include "../xxHash/xxhash.h"
+
+#include "CleanCache.hpp"
+#include "Debug.hpp"
+#include "FileMap.hpp"
+#include "Filesystem.hpp"
+#include "StringHelpers.hpp"
+
+static const char CleanMagic[8] = { 'L', 'A', 'R', 'D', 'C', 'C', '0', '1' };
+
+// Appended records are searched linearly, the file is compacted when there are more of them.
+enum { MaxAppended = 1024 };
+
+namespace
+{
+struct CleanCacheHeader
+{
+    char magic[8];
+    uint64_t sorted;
+    uint8_t pad[32];
+};
+}
+
+static_assert( sizeof( CleanCacheHeader ) == sizeof( CleanCacheRecord ), "CleanCacheHeader must have record size" );
+
+static uint64_t HashPath( const char* path )
+{
+    return XXH64( path, strlen( path ), 0 );
+}
+
+static bool PathLess( const CleanCacheRecord& r1, const CleanCacheRecord& r2 )
+{
+    return r1.path < r2.path;
+}
+
+// Maps a cache file. Records past the sorted table were appended later, the last one of a path is the newest.
+static bool MapCache( const std::string& fn, FileMap<char>& map, const CleanCacheRecord*& records, size_t& num, size_t& sorted )
+{
+    if( !Exists( fn ) ) return false;
+    map = FileMap<char>( fn.c_str(), true );
+    if( !map || map.Size() < sizeof( CleanCacheHeader ) ) return false;
+    CleanCacheHeader hdr;
+    memcpy( &hdr, map, sizeof( hdr ) );
+    if( memcmp( hdr.magic, CleanMagic, sizeof( CleanMagic ) ) != 0 ) return false;
+    num = map.Size() / sizeof( CleanCacheRecord ) - 1;
+    if( hdr.sorted > num ) return false;
+    sorted = hdr.sorted;
+    records = (const CleanCacheRecord*)( (const char*)map + sizeof( hdr ) );
+    return true;
+}
+
+// Latest record of each path, sorted by path hash.
+static std::vector<CleanCacheRecord> ReadLatest( const CleanCacheRecord* records, size_t num )
+{
+    std::vector<CleanCacheRecord> ret;
+    std::unordered_set<uint64_t> seen;
+    for( size_t i=num; i>0; i-- )
+    {
+        if( seen.emplace( records[i-1].path ).second ) ret.emplace_back( records[i-1] );
+    }
+    std::sort( ret.begin(), ret.end(), PathLess );
+    return ret;
+}
+
+static bool WriteCache( const std::string& fn, const std::vector<CleanCacheRecord>& records )
+{
+    CleanCacheHeader hdr = {};
+    memcpy( hdr.magic, CleanMagic, sizeof( CleanMagic ) );
+    hdr.sorted = records.size();
+
+    char tmp[32];
+    sprintf( tmp, ".tmp-%d", getpid() );
+    const auto tmpFn = fn + tmp;
+    FILE* f = fopen( tmpFn.c_str(), "wb" );
+    if( !f ) return false;
+    bool ok = fwrite( &hdr, sizeof( hdr ), 1, f ) == 1;
+    ok = ok && ( records.empty() || fwrite( records.data(), sizeof( CleanCacheRecord ), records.size(), f ) == records.size() );
+    ok = fclose( f ) == 0 && ok;
+    if( !ok || rename( tmpFn.c_str(), fn.c_str() ) != 0 )
+    {
+        unlink( tmpFn.c_str() );
+        return false;
+    }
+    return true;
+}
+
+CleanCache::CleanCache( const std::string& fn )
+    : m_fn( fn )
+{
+}
+
+bool CleanCache::Find( const char* path, CleanCacheRecord& record ) const
+{
+    FileMap<char> map;
+    const CleanCacheRecord* records;
+    size_t num, sorted;
+    if( !MapCache( m_fn, map, records, num, sorted ) ) return false;
+
+    CleanCacheRecord key;
+    key.path = HashPath( path );
+    for( size_t i=num; i>sorted; i-- )
+    {
+        if( records[i-1].path == key.path )
+        {
+            record = records[i-1];
+            return true;
+        }
+    }
+    const auto it = std::lower_bound( records, records + sorted, key, PathLess );
+    if( it == records + sorted || it->path != key.path ) return false;
+    record = *it;
+    return true;
+}
+
+// Records are small enough for O_APPEND writes to not interleave between processes. Records appended while another
+// process compacts the file are lost, which only costs a later SHA-1 hash.
+void CleanCache::Store( const char* path, uint64_t size, uint64_t hash, const char* sha1 ) const
+{
+    CleanCacheRecord r = {};
+    if( !StringHelpers::HexToSha1( sha1, r.sha1 ) ) return;
+    r.path = HashPath( path );
+    r.size = size;
+    r.hash = hash;
+
+    std::vector<CleanCacheRecord> records;
+    {
+        FileMap<char> map;
+        const CleanCacheRecord* ptr;
+        size_t num, sorted;
+        const bool valid = MapCache( m_fn, map, ptr, num, sorted );
+        // A torn append would shift all later records.
+        if( valid && map.Size() % sizeof( CleanCacheRecord ) == 0 && num - sorted < MaxAppended )
+        {
+            map = FileMap<char>();
+            const auto fd = open( m_fn.c_str(), O_WRONLY | O_APPEND );
+            if( fd < 0 ) return;
+            if( write( fd, &r, sizeof( r ) ) != sizeof( r ) )
+            {
+                DBGPRINT( "Cannot append to clean cache " << m_fn );
+            }
+            close( fd );
+            return;
+        }
+        // Also replaces a file which is damaged or in another format.
+        if( valid ) records.assign( ptr, ptr + num );
+    }
+    DBGPRINT( "Compacting clean cache, " << records.size() << " records" );
+    records.emplace_back( r );
+    WriteCache( m_fn, ReadLatest( records.data(), records.size() ) );
+}
+
+size_t CleanCache::Compact( const std::function<bool(const char*)>& keep ) const
+{
+    FileMap<char> map;
+    const CleanCacheRecord* ptr;
+    size_t num, sorted;
+    if( !MapCache( m_fn, map, ptr, num, sorted ) ) return 0;
+
+    auto records = ReadLatest( ptr, num );
+    if( keep )
+    {
+        char hex[41];
+        records.erase( std::remove_if( records.begin(), records.end(), [&keep, &hex]( const CleanCacheRecord& r ) {
+            StringHelpers::Sha1ToHex( r.sha1, hex );
+            return !keep( hex );
+        } ), records.end() );
+    }
+    if( !WriteCache( m_fn, records ) ) return 0;
+    return num - records.size();
+}
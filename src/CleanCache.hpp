@@ -0,0 +1,39 @@
+#ifndef __CLEANCACHE_HPP__
+#define __CLEANCACHE_HPP__
+
+#include <functional>
+#include <stdint.h>
+#include <string>
+
+struct CleanCacheRecord
+{
+    uint64_t path;
+    uint64_t size;
+    uint64_t hash;
+    uint8_t sha1[20];
+    uint32_t pad;
+};
+
+static_assert( sizeof( CleanCacheRecord ) == 48, "CleanCacheRecord must be tightly packed" );
+
+// Fat objects of files cleaned before, keyed by path. Records hold the size and xxHash of the contents, so that data
+// piped to the clean filter again is recognized without hashing it with SHA-1. Git may pipe data which is not in the
+// worktree, so the contents are always checked. All records are in a single file: a table sorted by path hash,
+// followed by records appended since it was last compacted.
+class CleanCache
+{
+public:
+    CleanCache( const std::string& fn );
+
+    bool Find( const char* path, CleanCacheRecord& record ) const;
+    void Store( const char* path, uint64_t size, uint64_t hash, const char* sha1 ) const;
+
+    // Rewrites the file with the latest record of each path, dropping records whose object is rejected by keep.
+    // Returns the number of records dropped.
+    size_t Compact( const std::function<bool(const char*)>& keep ) const;
+
+private:
+    std::string m_fn;
+};
+
+#endif
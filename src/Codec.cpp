@@ -0,0 +1,229 @@
+#include <string.h>
+
+#if defined __SSE2__ || defined _M_X64
+#  include <emmintrin.h>
+#  define CODEC_SSE2
+#elif defined __ARM_NEON
+#  include <arm_neon.h>
+#  define CODEC_NEON
+#endif
+
+#include "Codec.hpp"
+
+static const char Magic[] = "#$# git-fat ";
+enum { MagicLen = 12 };
+
+#if defined CODEC_SSE2
+
+// 16 bytes to 32 hex digits. Nibbles are interleaved high first, then mapped to '0'-'9' and 'a'-'f'.
+static inline void Encode16( const uint8_t* bin, char* hex )
+{
+    const auto v = _mm_loadu_si128( (const __m128i*)bin );
+    const auto mask = _mm_set1_epi8( 0xF );
+    const auto hi = _mm_and_si128( _mm_srli_epi16( v, 4 ), mask );
+    const auto lo = _mm_and_si128( v, mask );
+    auto a = _mm_unpacklo_epi8( hi, lo );
+    auto b = _mm_unpackhi_epi8( hi, lo );
+    const auto nine = _mm_set1_epi8( 9 );
+    const auto zero = _mm_set1_epi8( '0' );
+    const auto gap = _mm_set1_epi8( 'a' - '0' - 10 );
+    a = _mm_add_epi8( _mm_add_epi8( a, zero ), _mm_and_si128( _mm_cmpgt_epi8( a, nine ), gap ) );
+    b = _mm_add_epi8( _mm_add_epi8( b, zero ), _mm_and_si128( _mm_cmpgt_epi8( b, nine ), gap ) );
+    _mm_storeu_si128( (__m128i*)hex, a );
+    _mm_storeu_si128( (__m128i*)( hex + 16 ), b );
+}
+
+// 16 hex digits to nibble values in 16 bit lanes, high nibble in the low byte. Clears ok if any digit is invalid.
+static inline __m128i Decode16( const char* hex, int& ok )
+{
+    const auto c = _mm_loadu_si128( (const __m128i*)hex );
+    const auto lc = _mm_or_si128( c, _mm_set1_epi8( 0x20 ) );
+    // Signed compares also reject bytes above 0x7F.
+    const auto digit = _mm_and_si128( _mm_cmpgt_epi8( c, _mm_set1_epi8( '0' - 1 ) ), _mm_cmplt_epi8( c, _mm_set1_epi8( '9' + 1 ) ) );
+    const auto alpha = _mm_and_si128( _mm_cmpgt_epi8( lc, _mm_set1_epi8( 'a' - 1 ) ), _mm_cmplt_epi8( lc, _mm_set1_epi8( 'f' + 1 ) ) );
+    if( _mm_movemask_epi8( _mm_or_si128( digit, alpha ) ) != 0xFFFF ) ok = 0;
+    const auto dv = _mm_and_si128( digit, _mm_sub_epi8( c, _mm_set1_epi8( '0' ) ) );
+    const auto av = _mm_and_si128( alpha, _mm_sub_epi8( lc, _mm_set1_epi8( 'a' - 10 ) ) );
+    const auto v = _mm_or_si128( dv, av );
+    const auto hi = _mm_slli_epi16( _mm_and_si128( v, _mm_set1_epi16( 0xFF ) ), 4 );
+    const auto lo = _mm_srli_epi16( v, 8 );
+    return _mm_or_si128( hi, lo );
+}
+
+// The second half overlaps the first, so that 20 bytes are handled without a scalar tail.
+void Codec::HexEncode( const uint8_t* bin, char* hex )
+{
+    Encode16( bin, hex );
+    Encode16( bin + 4, hex + 8 );
+}
+
+bool Codec::HexDecode( const char* hex, uint8_t* bin )
+{
+    int ok = 1;
+    const auto a = Decode16( hex, ok );
+    const auto b = Decode16( hex + 16, ok );
+    const auto c = Decode16( hex + 24, ok );
+    if( !ok ) return false;
+    _mm_storeu_si128( (__m128i*)bin, _mm_packus_epi16( a, b ) );
+    _mm_storel_epi64( (__m128i*)( bin + 12 ), _mm_packus_epi16( c, c ) );
+    return true;
+}
+
+#elif defined CODEC_NEON
+
+static inline uint8x16_t ToHex( uint8x16_t n )
+{
+    const auto gap = vandq_u8( vcgtq_u8( n, vdupq_n_u8( 9 ) ), vdupq_n_u8( 'a' - '0' - 10 ) );
+    return vaddq_u8( vaddq_u8( n, vdupq_n_u8( '0' ) ), gap );
+}
+
+static inline void Encode16( const uint8_t* bin, char* hex )
+{
+    const auto v = vld1q_u8( bin );
+    const auto hi = vshrq_n_u8( v, 4 );
+    const auto lo = vandq_u8( v, vdupq_n_u8( 0xF ) );
+    const auto z = vzipq_u8( hi, lo );
+    vst1q_u8( (uint8_t*)hex, ToHex( z.val[0] ) );
+    vst1q_u8( (uint8_t*)hex + 16, ToHex( z.val[1] ) );
+}
+
+// Nibble values of hex digits, and a mask of valid digits.
+static inline uint8x16_t FromHex( uint8x16_t c, uint8x16_t& valid )
+{
+    const auto lc = vorrq_u8( c, vdupq_n_u8( 0x20 ) );
+    const auto digit = vandq_u8( vcgeq_u8( c, vdupq_n_u8( '0' ) ), vcleq_u8( c, vdupq_n_u8( '9' ) ) );
+    const auto alpha = vandq_u8( vcgeq_u8( lc, vdupq_n_u8( 'a' ) ), vcleq_u8( lc, vdupq_n_u8( 'f' ) ) );
+    valid = vandq_u8( valid, vorrq_u8( digit, alpha ) );
+    const auto dv = vandq_u8( digit, vsubq_u8( c, vdupq_n_u8( '0' ) ) );
+    const auto av = vandq_u8( alpha, vsubq_u8( lc, vdupq_n_u8( 'a' - 10 ) ) );
+    return vorrq_u8( dv, av );
+}
+
+static inline bool AllSet( uint8x16_t v )
+{
+    const auto d = vand_u8( vget_low_u8( v ), vget_high_u8( v ) );
+    return vget_lane_u64( vreinterpret_u64_u8( d ), 0 ) == ~0ull;
+}
+
+void Codec::HexEncode( const uint8_t* bin, char* hex )
+{
+    Encode16( bin, hex );
+    Encode16( bin + 4, hex + 8 );
+}
+
+// Even and odd digits are loaded into separate vectors, chars 24-39 overlap the first load.
+bool Codec::HexDecode( const char* hex, uint8_t* bin )
+{
+    auto valid = vdupq_n_u8( 0xFF );
+    const auto a = vld2q_u8( (const uint8_t*)hex );
+    const auto ah = FromHex( a.val[0], valid );
+    const auto al = FromHex( a.val[1], valid );
+    const auto b = vld2_u8( (const uint8_t*)hex + 24 );
+    const auto bh = FromHex( vcombine_u8( b.val[0], b.val[0] ), valid );
+    const auto bl = FromHex( vcombine_u8( b.val[1], b.val[1] ), valid );
+    if( !AllSet( valid ) ) return false;
+    vst1q_u8( bin, vorrq_u8( vshlq_n_u8( ah, 4 ), al ) );
+    vst1_u8( bin + 12, vget_low_u8( vorrq_u8( vshlq_n_u8( bh, 4 ), bl ) ) );
+    return true;
+}
+
+#else
+
+static inline int HexVal( char c )
+{
+    if( c >= '0' && c <= '9' ) return c - '0';
+    if( c >= 'a' && c <= 'f' ) return c - 'a' + 10;
+    if( c >= 'A' && c <= 'F' ) return c - 'A' + 10;
+    return -1;
+}
+
+void Codec::HexEncode( const uint8_t* bin, char* hex )
+{
+    static const char digits[] = "0123456789abcdef";
+    for( int i=0; i<20; i++ )
+    {
+        hex[i*2] = digits[bin[i] >> 4];
+        hex[i*2+1] = digits[bin[i] & 0xF];
+    }
+}
+
+bool Codec::HexDecode( const char* hex, uint8_t* bin )
+{
+    for( int i=0; i<20; i++ )
+    {
+        const auto hi = HexVal( hex[i*2] );
+        const auto lo = HexVal( hex[i*2+1] );
+        if( hi < 0 || lo < 0 ) return false;
+        bin[i] = ( hi << 4 ) | lo;
+    }
+    return true;
+}
+
+#endif
+
+void Codec::HexEncodeBatch( const uint8_t* bin, size_t binStride, size_t count, char* hex )
+{
+    for( size_t i=0; i<count; i++ )
+    {
+        HexEncode( bin, hex );
+        hex[40] = '\0';
+        bin += binStride;
+        hex += 41;
+    }
+}
+
+size_t Codec::HexDecodeBatch( const char* const* hex, size_t count, uint8_t* bin, size_t binStride )
+{
+    size_t ret = 0;
+    for( size_t i=0; i<count; i++ )
+    {
+        if( HexDecode( hex[i], bin ) )
+        {
+            bin += binStride;
+            ret++;
+        }
+    }
+    return ret;
+}
+
+void Codec::EncodePlaceholder( const char* hex, uint64_t size, char* out )
+{
+    memcpy( out, Magic, MagicLen );
+    memcpy( out + MagicLen, hex, 40 );
+    out[MagicLen+40] = ' ';
+    char* ptr = out + PlaceholderSize - 1;
+    *ptr = '\n';
+    do
+    {
+        *--ptr = '0' + size % 10;
+        size /= 10;
+    }
+    while( size != 0 );
+    while( ptr > out + MagicLen + 41 ) *--ptr = ' ';
+}
+
+bool Codec::DecodePlaceholder( const char* data, size_t len, char* hex, uint64_t& size )
+{
+    if( len != PlaceholderSize || memcmp( data, Magic, MagicLen ) != 0 ) return false;
+    if( data[MagicLen+40] != ' ' || data[PlaceholderSize-1] != '\n' ) return false;
+    uint8_t bin[20];
+    if( !HexDecode( data + MagicLen, bin ) ) return false;
+
+    const char* ptr = data + MagicLen + 41;
+    const char* end = data + PlaceholderSize - 1;
+    while( ptr < end && *ptr == ' ' ) ptr++;
+    if( ptr == end ) return false;
+    uint64_t val = 0;
+    for( ; ptr < end; ptr++ )
+    {
+        if( *ptr < '0' || *ptr > '9' ) return false;
+        const uint64_t digit = *ptr - '0';
+        if( val > ( UINT64_MAX - digit ) / 10 ) return false;
+        val = val * 10 + digit;
+    }
+
+    memcpy( hex, data + MagicLen, 40 );
+    hex[40] = '\0';
+    size = val;
+    return true;
+}
@@ -0,0 +1,31 @@
+#ifndef __CODEC_HPP__
+#define __CODEC_HPP__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Reentrant, allocation free conversions of object hashes and placeholders. Hex conversion uses SSE2 or NEON when
+// available.
+namespace Codec
+{
+    enum { PlaceholderSize = 74 };
+
+    // 20 byte hash to 40 lowercase hex digits, without terminator.
+    void HexEncode( const uint8_t* bin, char* hex );
+    // 40 hex digits of either case to 20 bytes. Returns false if any character is not a hex digit.
+    bool HexDecode( const char* hex, uint8_t* bin );
+
+    // Encodes count hashes placed binStride bytes apart into consecutive null terminated 41 byte strings.
+    void HexEncodeBatch( const uint8_t* bin, size_t binStride, size_t count, char* hex );
+    // Decodes count hex strings into hashes placed binStride bytes apart. Invalid strings are skipped, the rest is
+    // stored without gaps. Returns the number of hashes stored.
+    size_t HexDecodeBatch( const char* const* hex, size_t count, uint8_t* bin, size_t binStride );
+
+    // Writes "#$# git-fat <hex> <size padded to 20>\n", PlaceholderSize bytes without terminator.
+    void EncodePlaceholder( const char* hex, uint64_t size, char* out );
+    // Parses a placeholder of len bytes. The hash is copied to hex with a terminator. Returns false if the data is
+    // not exactly a well formed placeholder.
+    bool DecodePlaceholder( const char* data, size_t len, char* hex, uint64_t& size );
+}
+
+#endif
@@ -0,0 +1,533 @@
+#include <chrono>
+#include <errno.h>
+#include <inttypes.h>
+#include <map>
+#include <memory>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#ifdef __linux__
+#  include <fcntl.h>
+#  include <poll.h>
+#  include <signal.h>
+#  include <sys/inotify.h>
+#  include <sys/socket.h>
+#  include <sys/un.h>
+#  include <sys/wait.h>
+#endif
+
+#include "Arena.hpp"
+#include "Buffer.hpp"
+#include "CleanCache.hpp"
+#include "Debug.hpp"
+#include "Filesystem.hpp"
+#include "glue.h"
+#include "Lard.hpp"
+
+// Requests and responses are text lines. A response is terminated by an empty line.
+//   ping                        - no data
+//   objects <alternates>        - result of ListObjects()
+//   referenced <all> <nowalk>   - result of ReferencedObjects() for HEAD, without pathspec
+//   status <all>                - result of GetStatus(), lines are "r|o|g <sha1>" for referenced, orphan and garbage
+//   placeholders                - "<blob> <sha1>" for indexed blobs of placeholder size, <sha1> is "-" if the blob
+//                                 is not a placeholder
+//   clean <path>                - "<size> <xxhash> <sha1>" of the clean cache record of path, if its object is stored
+//   object <sha1>               - "<offset> <size> <pack>" if the object is packed
+
+#ifdef __linux__
+
+static bool GetSocketAddress( const std::string& fn, struct sockaddr_un& addr )
+{
+    if( fn.size() >= sizeof( addr.sun_path ) ) return false;
+    memset( &addr, 0, sizeof( addr ) );
+    addr.sun_family = AF_UNIX;
+    memcpy( addr.sun_path, fn.c_str(), fn.size() + 1 );
+    return true;
+}
+
+static bool WriteAll( int fd, const char* ptr, size_t size )
+{
+    while( size > 0 )
+    {
+        const auto wr = write( fd, ptr, size );
+        if( wr < 0 && errno == EINTR ) continue;
+        if( wr <= 0 ) return false;
+        ptr += wr;
+        size -= wr;
+    }
+    return true;
+}
+
+// Reads lines until an empty line. Returns false if the stream ended early.
+static bool ReadLines( FILE* f, const std::function<void(const char*)>& cb )
+{
+    char* line = nullptr;
+    size_t cap = 0;
+    ssize_t len;
+    bool ok = false;
+    while( ( len = getline( &line, &cap, f ) ) > 0 )
+    {
+        if( line[len-1] != '\n' ) break;
+        line[--len] = '\0';
+        if( len == 0 )
+        {
+            ok = true;
+            break;
+        }
+        cb( line );
+    }
+    free( line );
+    return ok;
+}
+
+bool Lard::QueryDaemon( const char* request, std::vector<const char*>& result ) const
+{
+    if( m_isDaemon ) return false;
+
+    struct sockaddr_un addr;
+    if( !GetSocketAddress( m_fatdir + "/daemon.sock", addr ) ) return false;
+    const auto fd = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+    if( fd < 0 ) return false;
+    const auto req = std::string( request ) + "\n";
+    if( connect( fd, (struct sockaddr*)&addr, sizeof( addr ) ) != 0 || !WriteAll( fd, req.c_str(), req.size() ) )
+    {
+        close( fd );
+        return false;
+    }
+
+    FILE* f = fdopen( fd, "r" );
+    std::vector<const char*> lines;
+    const auto ok = ReadLines( f, [&lines]( const char* line ) { lines.emplace_back( Buffer::Store( line ) ); } );
+    fclose( f );
+
+    DBGPRINT( "Daemon request " << request << ": " << ( ok ? "ok" : "failed" ) << ", " << lines.size() << " lines" );
+    if( !ok ) return false;
+    std::swap( result, lines );
+    return true;
+}
+
+static volatile sig_atomic_t s_quit;
+
+namespace
+{
+// Watched sources a response depends on.
+enum
+{
+    DepStore = 1 << 0,
+    DepRefs = 1 << 1,
+    DepIndex = 1 << 2
+};
+
+// Response to a request, valid until watched files change.
+struct CachedResult
+{
+    Arena arena;
+    std::vector<const char*> lines;
+    bool valid = false;
+    int deps = 0;
+};
+
+struct Client
+{
+    int fd;
+    std::string request;
+    std::chrono::steady_clock::time_point deadline;
+};
+}
+
+// Clients which do not send a request or read the response in time are disconnected.
+enum { ClientTimeout = 5000 };
+enum { MaxRequest = 4096 };
+
+// Runs a query in a child process, so that the daemon does not accumulate state of git's object layer (parsed
+// objects, walk flags, ref caches) between queries.
+static bool RunQuery( const std::function<bool(FILE*)>& query, CachedResult& res )
+{
+    int fds[2];
+    if( pipe( fds ) != 0 ) return false;
+    const auto pid = fork();
+    if( pid < 0 )
+    {
+        close( fds[0] );
+        close( fds[1] );
+        return false;
+    }
+    if( pid == 0 )
+    {
+        close( fds[0] );
+        FILE* f = fdopen( fds[1], "w" );
+        const bool ok = query( f );
+        fprintf( f, "\n" );
+        fclose( f );
+        _exit( ok ? 0 : 1 );
+    }
+    close( fds[1] );
+
+    res.arena.Clear();
+    res.lines.clear();
+    FILE* f = fdopen( fds[0], "r" );
+    const auto ok = ReadLines( f, [&res]( const char* line ) { res.lines.emplace_back( res.arena.Store( line ) ); } );
+    fclose( f );
+    int status;
+    while( waitpid( pid, &status, 0 ) < 0 && errno == EINTR ) {}
+    res.valid = ok && WIFEXITED( status ) && WEXITSTATUS( status ) == 0;
+    return res.valid;
+}
+
+// Directories of ref watches are remembered, so that directories created later (e.g. refs/heads/feature/) are
+// watched too.
+static void AddWatchRecursive( int in, const std::string& dir, std::map<int, bool>& watches, std::map<int, std::string>& refDirs )
+{
+    const auto wd = inotify_add_watch( in, dir.c_str(), IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM | IN_CLOSE_WRITE | IN_ONLYDIR );
+    if( wd < 0 ) return;
+    watches[wd] = false;
+    refDirs[wd] = dir;
+    for( auto& v : ListDirectory( dir ) )
+    {
+        if( strcmp( v, "." ) == 0 || strcmp( v, ".." ) == 0 ) continue;
+        struct stat sb;
+        const auto path = dir + "/" + v;
+        if( stat( path.c_str(), &sb ) == 0 && S_ISDIR( sb.st_mode ) )
+        {
+            AddWatchRecursive( in, path, watches, refDirs );
+        }
+    }
+}
+
+// Ref changes, packed-refs included, are written through lock files and renamed into place.
+static bool IsRefChange( const char* name )
+{
+    const auto len = strlen( name );
+    if( len > 5 && strcmp( name + len - 5, ".lock" ) == 0 ) return false;
+    if( strcmp( name, "packed-refs" ) == 0 ) return true;
+    return strncmp( name, "index", 5 ) != 0 && strcmp( name, "fat" ) != 0 && strcmp( name, "objects" ) != 0;
+}
+
+// Blobs are immutable, so clients may use the results even if the index changed since.
+bool Lard::ListPlaceholderBlobs( FILE* out )
+{
+    ParsePathspec( nullptr, nullptr );
+    if( ReadCache() < 0 ) return false;
+
+    static Lard* lard;
+    static FILE* f;
+    lard = this;
+    f = out;
+    ListFiles( []( const char* fn, const char* localFn, const char* blob, int pos ) {
+        const auto size = GetIndexFileSize( pos );
+        if( size != 0 && size != GitFatMagic ) return;
+        if( lard->m_placeholderBlobs.find( blob ) != lard->m_placeholderBlobs.end() ) return;
+        const auto sha1 = lard->GetBlobObject( blob );
+        char hex[41];
+        StringHelpers::Sha1ToHex( (const unsigned char*)blob, hex );
+        fprintf( f, "%s %s\n", hex, sha1 ? sha1 : "-" );
+    } );
+    return true;
+}
+
+void Lard::Daemon()
+{
+    AssertInitDone();
+    Setup();
+    CreateDirStruct( m_packdir );
+
+    std::vector<const char*> tmp;
+    if( QueryDaemon( "ping", tmp ) )
+    {
+        fprintf( stderr, "Daemon is already running for %s\n", m_gitdir.c_str() );
+        exit( 1 );
+    }
+    m_isDaemon = true;
+
+    const auto sockFn = m_fatdir + "/daemon.sock";
+    struct sockaddr_un addr;
+    if( !GetSocketAddress( sockFn, addr ) )
+    {
+        fprintf( stderr, "Socket path %s is too long\n", sockFn.c_str() );
+        exit( 1 );
+    }
+    unlink( sockFn.c_str() );
+    const auto srv = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+    if( srv < 0 || bind( srv, (struct sockaddr*)&addr, sizeof( addr ) ) != 0 || listen( srv, 16 ) != 0 )
+    {
+        fprintf( stderr, "Cannot listen on %s: %s\n", sockFn.c_str(), strerror( errno ) );
+        exit( 1 );
+    }
+
+    // Watches are true for object store directories, false for refs.
+    const auto in = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+    std::map<int, bool> watches;
+    std::map<int, std::string> refDirs;
+    std::vector<std::string> storeDirs = { m_objdir, m_packdir };
+    for( auto& v : GetAlternates() ) storeDirs.emplace_back( v );
+    for( auto& v : storeDirs )
+    {
+        const auto wd = inotify_add_watch( in, v.c_str(), IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM );
+        if( wd >= 0 ) watches[wd] = true;
+    }
+    const auto wd = inotify_add_watch( in, m_gitdir.c_str(), IN_DELETE | IN_MOVED_TO | IN_CLOSE_WRITE );
+    if( wd >= 0 ) watches[wd] = false;
+    AddWatchRecursive( in, m_gitdir + "/refs", watches, refDirs );
+
+    s_quit = 0;
+    struct sigaction sa = {};
+    sa.sa_handler = []( int ) { s_quit = 1; };
+    sigaction( SIGINT, &sa, nullptr );
+    sigaction( SIGTERM, &sa, nullptr );
+    signal( SIGPIPE, SIG_IGN );
+
+    std::map<std::string, std::unique_ptr<CachedResult>> cache;
+    const CleanCache cleanCache( m_fatdir + "/clean" );
+
+    auto invalidate = [this, &cache]( int deps ) {
+        for( auto& v : cache )
+        {
+            if( v.second->deps & deps ) v.second->valid = false;
+        }
+        // Clean and object requests are answered with packs loaded by the daemon itself.
+        if( deps & DepStore )
+        {
+            m_packs.clear();
+            m_packsLoaded = false;
+        }
+    };
+
+    auto processEvents = [&]() {
+        alignas( struct inotify_event ) char buf[64 * 1024];
+        for(;;)
+        {
+            const auto len = read( in, buf, sizeof( buf ) );
+            if( len <= 0 ) break;
+            for( char* ptr = buf; ptr < buf + len; )
+            {
+                const auto ev = (const struct inotify_event*)ptr;
+                ptr += sizeof( struct inotify_event ) + ev->len;
+                if( ev->mask & IN_Q_OVERFLOW )
+                {
+                    invalidate( DepStore | DepRefs | DepIndex );
+                    continue;
+                }
+                auto it = watches.find( ev->wd );
+                if( it == watches.end() ) continue;
+                if( ev->mask & IN_IGNORED )
+                {
+                    // Watched directory was removed.
+                    watches.erase( it );
+                    refDirs.erase( ev->wd );
+                    continue;
+                }
+                if( it->second )
+                {
+                    invalidate( DepStore );
+                }
+                else if( ( ev->mask & IN_ISDIR ) && ( ev->mask & ( IN_CREATE | IN_MOVED_TO ) ) )
+                {
+                    // Refs may have been written to the new directory before the watch was added.
+                    auto dir = refDirs.find( ev->wd );
+                    if( dir != refDirs.end() )
+                    {
+                        const auto path = dir->second + "/" + ev->name;
+                        AddWatchRecursive( in, path, watches, refDirs );
+                    }
+                    invalidate( DepRefs );
+                }
+                else if( ev->len > 0 && strcmp( ev->name, "index" ) == 0 )
+                {
+                    invalidate( DepIndex );
+                }
+                else if( ev->len == 0 || IsRefChange( ev->name ) )
+                {
+                    invalidate( DepRefs );
+                }
+            }
+        }
+    };
+
+    // Returns false if the client should do the work itself.
+    auto serve = [&]( const char* line, std::string& out ) -> bool {
+        char buf[1024];
+        if( strcmp( line, "ping" ) == 0 ) return true;
+        if( strncmp( line, "clean ", 6 ) == 0 )
+        {
+            CleanCacheRecord r;
+            if( cleanCache.Find( line + 6, r ) )
+            {
+                char hex[41];
+                StringHelpers::Sha1ToHex( r.sha1, hex );
+                if( HasObject( hex ) )
+                {
+                    sprintf( buf, "%" PRIu64 " %" PRIu64 " %s\n", r.size, r.hash, hex );
+                    out += buf;
+                }
+            }
+            return true;
+        }
+        if( strncmp( line, "object ", 7 ) == 0 )
+        {
+            // Clients look for loose objects themselves. The path must not depend on the daemon's working directory.
+            const FatPack* pack;
+            const auto entry = FindPacked( line + 7, pack );
+            char* fn = entry ? realpath( ( pack->Base() + ".pack" ).c_str(), nullptr ) : nullptr;
+            if( fn )
+            {
+                sprintf( buf, "%" PRIu64 " %" PRIu64 " ", entry->offset, entry->size );
+                out += buf;
+                out += fn;
+                out += '\n';
+                free( fn );
+            }
+            return true;
+        }
+
+        int a, b;
+        int deps;
+        std::function<bool(FILE*)> query;
+        if( sscanf( line, "objects %d", &a ) == 1 )
+        {
+            deps = DepStore;
+            query = [this, a]( FILE* f ) { for( auto& v : ListObjects( a != 0 ) ) fprintf( f, "%s\n", v ); return true; };
+        }
+        else if( sscanf( line, "referenced %d %d", &a, &b ) == 2 )
+        {
+            deps = DepRefs;
+            query = [this, a, b]( FILE* f ) { for( auto& v : ReferencedObjects( a != 0, b != 0, nullptr ) ) fprintf( f, "%s\n", v ); return true; };
+        }
+        else if( sscanf( line, "status %d", &a ) == 1 )
+        {
+            deps = DepStore | DepRefs;
+            query = [this, a]( FILE* f ) {
+                std::vector<const char*> orphans, garbage;
+                for( auto& v : GetStatus( a != 0, orphans, garbage ) ) fprintf( f, "r %s\n", v );
+                for( auto& v : orphans ) fprintf( f, "o %s\n", v );
+                for( auto& v : garbage ) fprintf( f, "g %s\n", v );
+                return true;
+            };
+        }
+        else if( strcmp( line, "placeholders" ) == 0 )
+        {
+            deps = DepIndex;
+            query = [this]( FILE* f ) { return ListPlaceholderBlobs( f ); };
+        }
+        else
+        {
+            return false;
+        }
+
+        auto& entry = cache[line];
+        if( !entry ) entry = std::make_unique<CachedResult>();
+        entry->deps = deps;
+        if( !entry->valid ) RunQuery( query, *entry );
+        if( !entry->valid ) return false;
+        for( auto& v : entry->lines )
+        {
+            out += v;
+            out += '\n';
+        }
+        return true;
+    };
+
+    printf( "Listening on %s\n", sockFn.c_str() );
+    fflush( stdout );
+
+    // Requests are read without blocking, so that a client which does not send one cannot stall the others.
+    std::vector<Client> clients;
+    std::vector<struct pollfd> fds;
+    while( !s_quit )
+    {
+        auto now = std::chrono::steady_clock::now();
+        int timeout = -1;
+        fds.assign( { { srv, POLLIN, 0 }, { in, POLLIN, 0 } } );
+        for( auto& v : clients )
+        {
+            fds.push_back( { v.fd, POLLIN, 0 } );
+            const auto left = std::max<int64_t>( 0, std::chrono::duration_cast<std::chrono::milliseconds>( v.deadline - now ).count() );
+            if( timeout < 0 || left < timeout ) timeout = left;
+        }
+        if( poll( fds.data(), fds.size(), timeout ) < 0 ) continue;
+        processEvents();
+        now = std::chrono::steady_clock::now();
+
+        size_t kept = 0;
+        for( size_t i=0; i<clients.size(); i++ )
+        {
+            auto& client = clients[i];
+            bool closed = false;
+            if( fds[i+2].revents )
+            {
+                char buf[1024];
+                const auto rd = read( client.fd, buf, sizeof( buf ) );
+                if( rd > 0 ) client.request.append( buf, rd );
+                else closed = rd == 0 || ( errno != EAGAIN && errno != EINTR );
+            }
+            const auto end = client.request.find( '\n' );
+            if( end == std::string::npos )
+            {
+                if( closed || now >= client.deadline || client.request.size() > MaxRequest )
+                {
+                    close( client.fd );
+                }
+                else
+                {
+                    if( kept != i ) clients[kept] = std::move( client );
+                    kept++;
+                }
+                continue;
+            }
+            client.request.resize( end );
+
+            std::string out;
+            const bool ok = serve( client.request.c_str(), out );
+            DBGPRINT( "Request " << client.request << ( ok ? "" : " failed" ) );
+            // No terminating empty line tells the client to do the work itself.
+            if( ok )
+            {
+                out += '\n';
+                fcntl( client.fd, F_SETFL, fcntl( client.fd, F_GETFL ) & ~O_NONBLOCK );
+                struct timeval tv = { ClientTimeout / 1000, ( ClientTimeout % 1000 ) * 1000 };
+                setsockopt( client.fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof( tv ) );
+                if( !WriteAll( client.fd, out.c_str(), out.size() ) )
+                {
+                    DBGPRINT( "Cannot send response to " << client.request );
+                }
+            }
+            close( client.fd );
+        }
+        clients.resize( kept );
+
+        if( fds[0].revents & POLLIN )
+        {
+            const auto fd = accept4( srv, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK );
+            if( fd >= 0 )
+            {
+                clients.push_back( Client { fd, std::string(), now + std::chrono::milliseconds( ClientTimeout ) } );
+            }
+        }
+    }
+
+    for( auto& v : clients )
+    {
+        close( v.fd );
+    }
+    unlink( sockFn.c_str() );
+    close( srv );
+    close( in );
+}
+
+#else
+
+bool Lard::QueryDaemon( const char* request, std::vector<const char*>& result ) const
+{
+    return false;
+}
+
+void Lard::Daemon()
+{
+    fprintf( stderr, "Daemon is only supported on Linux\n" );
+    exit( 1 );
+}
+
+#endif
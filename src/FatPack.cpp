@@ -0,0 +1,227 @@
+#include <algorithm>
+#include <string.h>
+#include <unistd.h>
+#include <openssl/sha.h>
+
+#include "Buffer.hpp"
+#include "Debug.hpp"
+#include "FatPack.hpp"
+#include "Filesystem.hpp"
+#include "StringHelpers.hpp"
+
+static const char PackMagic[8] = { 'L', 'A', 'R', 'D', 'P', 'K', '0', '1' };
+static const char IdxMagic[8] = { 'L', 'A', 'R', 'D', 'I', 'X', '0', '1' };
+
+enum { IdxHeaderSize = sizeof( IdxMagic ) + sizeof( uint64_t ) };
+
+static FileMap<char> MapFile( const std::string& fn )
+{
+    if( !Exists( fn ) ) return FileMap<char>();
+    return FileMap<char>( fn.c_str(), true );
+}
+
+std::vector<std::string> ListFatPacks( const std::string& dir )
+{
+    // Names are copied out, the directory listing is temporary.
+    ArenaScope scope( Buffer::Local() );
+    std::vector<std::string> ret;
+    for( auto& v : ListDirectory( dir ) )
+    {
+        const auto len = strlen( v );
+        if( len > 4 && strcmp( v + len - 4, ".idx" ) == 0 )
+        {
+            ret.emplace_back( dir + "/" + std::string( v, len - 4 ) );
+        }
+    }
+    std::sort( ret.begin(), ret.end() );
+    return ret;
+}
+
+static bool EntryLess( const FatPackEntry& l, const FatPackEntry& r )
+{
+    return memcmp( l.sha1, r.sha1, 20 ) < 0;
+}
+
+FatPack::FatPack( const std::string& base )
+    : m_base( base )
+    , m_idx( MapFile( base + ".idx" ) )
+    , m_pack( MapFile( base + ".pack" ) )
+    , m_entries( nullptr )
+    , m_count( 0 )
+    , m_valid( false )
+{
+    if( !m_idx || m_idx.Size() < IdxHeaderSize || memcmp( m_idx, IdxMagic, sizeof( IdxMagic ) ) != 0 )
+    {
+        DBGPRINT( "Invalid pack index " << base << ".idx" );
+        return;
+    }
+    uint64_t count;
+    memcpy( &count, m_idx + sizeof( IdxMagic ), sizeof( count ) );
+    if( m_idx.Size() != IdxHeaderSize + count * sizeof( FatPackEntry ) )
+    {
+        DBGPRINT( "Truncated pack index " << base << ".idx" );
+        return;
+    }
+    if( m_pack && ( m_pack.Size() < sizeof( PackMagic ) || memcmp( m_pack, PackMagic, sizeof( PackMagic ) ) != 0 ) )
+    {
+        DBGPRINT( "Invalid pack data " << base << ".pack" );
+        return;
+    }
+
+    m_entries = (const FatPackEntry*)( m_idx + IdxHeaderSize );
+    m_count = count;
+    m_valid = true;
+}
+
+// Packs are opened by every filter process, so entries are not walked when a pack is opened. Lookups check the
+// entry they return, Verify and repack check the whole index.
+bool FatPack::Check() const
+{
+    if( !m_valid ) return false;
+    for( size_t i=0; i<m_count; i++ )
+    {
+        if( i > 0 && !EntryLess( m_entries[i-1], m_entries[i] ) )
+        {
+            DBGPRINT( "Pack index " << m_base << ".idx is not sorted" );
+            return false;
+        }
+        if( m_pack && !InPack( m_entries + i ) )
+        {
+            DBGPRINT( "Pack data " << m_base << ".pack is truncated" );
+            return false;
+        }
+    }
+    return true;
+}
+
+bool FatPack::InPack( const FatPackEntry* entry ) const
+{
+    return entry->offset <= m_pack.Size() && entry->size <= m_pack.Size() - entry->offset;
+}
+
+const FatPackEntry* FatPack::Find( const char* sha1 ) const
+{
+    uint8_t bin[20];
+    if( !StringHelpers::HexToSha1( sha1, bin ) ) return nullptr;
+    return Find( bin );
+}
+
+const FatPackEntry* FatPack::Find( const uint8_t* sha1 ) const
+{
+    if( !m_valid ) return nullptr;
+    FatPackEntry e;
+    memcpy( e.sha1, sha1, 20 );
+    const auto end = m_entries + m_count;
+    const auto it = std::lower_bound( m_entries, end, e, EntryLess );
+    if( it == end || memcmp( it->sha1, sha1, 20 ) != 0 ) return nullptr;
+    if( m_pack && !InPack( it ) )
+    {
+        DBGPRINT( "Pack data " << m_base << ".pack is truncated" );
+        return nullptr;
+    }
+    return it;
+}
+
+FatPackWriter::FatPackWriter( const std::string& dir, const char* prefix )
+    : m_dir( dir )
+    , m_prefix( prefix )
+    , m_file( nullptr )
+    , m_offset( 0 )
+{
+    char tmp[32];
+    sprintf( tmp, "/tmp-%d.pack", getpid() );
+    m_tmp = m_dir + tmp;
+    m_file = fopen( m_tmp.c_str(), "wb" );
+    if( !m_file )
+    {
+        fprintf( stderr, "Cannot open %s\n", m_tmp.c_str() );
+        return;
+    }
+    fwrite( PackMagic, 1, sizeof( PackMagic ), m_file );
+    m_offset = sizeof( PackMagic );
+}
+
+FatPackWriter::~FatPackWriter()
+{
+    if( m_file )
+    {
+        fclose( m_file );
+        unlink( m_tmp.c_str() );
+    }
+}
+
+bool FatPackWriter::Add( const char* sha1, const char* data, uint64_t size )
+{
+    if( !m_file ) return false;
+
+    FatPackEntry e = {};
+    if( !StringHelpers::HexToSha1( sha1, e.sha1 ) ) return false;
+    e.offset = m_offset;
+    e.size = size;
+
+    if( fwrite( data, 1, size, m_file ) != size )
+    {
+        fprintf( stderr, "Cannot write %s\n", m_tmp.c_str() );
+        return false;
+    }
+    m_offset += size;
+    m_entries.emplace_back( e );
+    return true;
+}
+
+// Pack name is derived from the hash of its index, so identical packs have identical names.
+bool FatPackWriter::Finish()
+{
+    if( !m_file ) return false;
+    if( fclose( m_file ) != 0 )
+    {
+        m_file = nullptr;
+        unlink( m_tmp.c_str() );
+        return false;
+    }
+    m_file = nullptr;
+
+    // Lookups rely on the index being sorted without duplicates.
+    std::sort( m_entries.begin(), m_entries.end(), EntryLess );
+    for( size_t i=1; i<m_entries.size(); i++ )
+    {
+        if( !EntryLess( m_entries[i-1], m_entries[i] ) )
+        {
+            fprintf( stderr, "Object added twice to pack %s\n", m_tmp.c_str() );
+            unlink( m_tmp.c_str() );
+            return false;
+        }
+    }
+
+    unsigned char sha1[20];
+    SHA1( (const unsigned char*)m_entries.data(), m_entries.size() * sizeof( FatPackEntry ), sha1 );
+    char hex[41];
+    StringHelpers::Sha1ToHex( sha1, hex );
+    m_base = m_dir + "/" + m_prefix + "-" + hex;
+
+    const auto idxTmp = m_base + ".idx.tmp";
+    FILE* f = fopen( idxTmp.c_str(), "wb" );
+    if( !f )
+    {
+        fprintf( stderr, "Cannot open %s\n", idxTmp.c_str() );
+        unlink( m_tmp.c_str() );
+        return false;
+    }
+    const uint64_t count = m_entries.size();
+    bool ok = fwrite( IdxMagic, 1, sizeof( IdxMagic ), f ) == sizeof( IdxMagic );
+    ok = ok && fwrite( &count, 1, sizeof( count ), f ) == sizeof( count );
+    ok = ok && fwrite( m_entries.data(), sizeof( FatPackEntry ), count, f ) == count;
+    ok = fclose( f ) == 0 && ok;
+
+    // Data goes in first, so that an index never refers to a missing pack.
+    if( !ok || rename( m_tmp.c_str(), ( m_base + ".pack" ).c_str() ) != 0 || rename( idxTmp.c_str(), ( m_base + ".idx" ).c_str() ) != 0 )
+    {
+        fprintf( stderr, "Cannot write pack %s\n", m_base.c_str() );
+        unlink( m_tmp.c_str() );
+        unlink( idxTmp.c_str() );
+        return false;
+    }
+
+    DBGPRINT( "Written pack " << m_base << ": " << count << " objects, " << m_offset << " bytes" );
+    return true;
+}
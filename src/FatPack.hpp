@@ -0,0 +1,86 @@
+#ifndef __FATPACK_HPP__
+#define __FATPACK_HPP__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "FileMap.hpp"
+
+// Many fat objects stored in a single file. A pack consists of two files:
+//   <name>.pack - header followed by concatenated object data,
+//   <name>.idx  - header, object count and entries sorted by hash.
+struct FatPackEntry
+{
+    uint8_t sha1[20];
+    uint32_t reserved;
+    uint64_t offset;
+    uint64_t size;
+};
+
+static_assert( sizeof( FatPackEntry ) == 40, "FatPackEntry must be tightly packed" );
+
+class FatPack
+{
+public:
+    FatPack( const std::string& base );
+
+    FatPack( const FatPack& ) = delete;
+    FatPack( FatPack&& ) = default;
+    FatPack& operator=( const FatPack& ) = delete;
+    FatPack& operator=( FatPack&& ) = default;
+
+    bool IsValid() const { return m_valid; }
+    bool HasData() const { return m_pack; }
+    bool Check() const;
+
+    const FatPackEntry* Find( const char* sha1 ) const;
+    const FatPackEntry* Find( const uint8_t* sha1 ) const;
+    const char* Data( const FatPackEntry* entry ) const { return (const char*)m_pack + entry->offset; }
+
+    size_t Count() const { return m_count; }
+    const FatPackEntry* Entries() const { return m_entries; }
+
+    const std::string& Base() const { return m_base; }
+
+private:
+    bool InPack( const FatPackEntry* entry ) const;
+
+    std::string m_base;
+    FileMap<char> m_idx;
+    FileMap<char> m_pack;
+    const FatPackEntry* m_entries;
+    size_t m_count;
+    bool m_valid;
+};
+
+class FatPackWriter
+{
+public:
+    FatPackWriter( const std::string& dir, const char* prefix );
+    ~FatPackWriter();
+
+    FatPackWriter( const FatPackWriter& ) = delete;
+    FatPackWriter& operator=( const FatPackWriter& ) = delete;
+
+    bool Add( const char* sha1, const char* data, uint64_t size );
+    bool Finish();
+
+    uint64_t Size() const { return m_offset; }
+    size_t Count() const { return m_entries.size(); }
+    const std::string& Base() const { return m_base; }
+
+private:
+    std::string m_dir;
+    std::string m_prefix;
+    std::string m_tmp;
+    std::string m_base;
+    FILE* m_file;
+    uint64_t m_offset;
+    std::vector<FatPackEntry> m_entries;
+};
+
+std::vector<std::string> ListFatPacks( const std::string& dir );
+
+#endif
@@ -17,6 +17,13 @@ template<typename T>
 class FileMap
 {
 public:
+    FileMap()
+        : m_ptr( nullptr )
+        , m_size( 0 )
+        , m_release( false )
+    {
+    }
+
     FileMap( const char* fn, bool mayFail = false )
         : m_ptr( nullptr )
         , m_size( GetFileSize( fn ) )
@@ -30,6 +37,7 @@ public:
             exit( 1 );
         }
         m_ptr = (T*)mmap( nullptr, m_size, PROT_READ, MAP_SHARED, fileno( f ), 0 );
+        if( m_ptr == MAP_FAILED ) m_ptr = nullptr;
         fclose( f );
     }
 
@@ -52,6 +60,10 @@ public:
     FileMap& operator=( const FileMap& ) = delete;
     FileMap& operator=( FileMap&& src )
     {
+        if( m_release && m_ptr )
+        {
+            munmap( m_ptr, m_size );
+        }
         m_ptr = src.m_ptr;
         m_size = src.m_size;
         m_release = src.m_release;
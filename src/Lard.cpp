@@ -1,25 +1,52 @@
 #include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <errno.h>
 #include <fcntl.h>
+#include <functional>
 #include <inttypes.h>
+#include <map>
+#include <memory>
+#include <poll.h>
 #include <sstream>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <thread>
 #include <unistd.h>
-#include <utime.h>
 #include <vector>
 #include <openssl/ssl.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 
+#ifdef __linux__
+#  include <linux/fs.h>
+#  include <sys/sendfile.h>
+#endif
+
+#include "AccessLog.hpp"
 #include "Buffer.hpp"
+#include "CleanCache.hpp"
+#include "Codec.hpp"
 #include "Debug.hpp"
+#include "FatPack.hpp"
 #include "FileMap.hpp"
 #include "Filesystem.hpp"
 #include "glue.h"
 #include "Lard.hpp"
+#include "Manifest.hpp"
+#include "Progress.hpp"
+#include "Sparse.hpp"
+#include "Trace.hpp"
+
+static const char RsyncDoneMarker[] = "lard-done ";
+
+static bool MoveFile( const char* src, const char* dst );
+static int64_t WriteFd( int fd, const char* ptr, uint64_t size );
+static bool CopyStream( int in, int out );
 
 static set_str* ptr_set_str;
 static map_strsize* ptr_map_strsize;
@@ -33,13 +60,30 @@ static int checkarg( int argc, char** argv, const char* arg )
     return -1;
 }
 
-Lard::Lard( const char* commandName )
-    : m_commandName( commandName )
+Lard::Lard( const char* commandName, int* nongit )
+    : m_pathspec( nullptr )
+    , m_packsLoaded( false )
+    , m_packsTime {}
+    , m_alternatesLoaded( false )
+    , m_fetchAlternates( 0 )
+    , m_hardlink( false )
+    , m_accessChecked( false )
+    , m_checkoutBatch( 0 )
+    , m_restoredCount( 0 )
+    , m_missingCount( 0 )
+    , m_progress( nullptr )
+    , m_syscallsAvoided( 0 )
+    , m_commandName( commandName )
+    , m_isDaemon( false )
 {
-    auto prefix = SetupGitDirectory();
+    auto prefix = SetupGitDirectory( nongit );
     if( prefix ) m_prefix = prefix;
     m_gitdir = GetGitDir();
-    m_objdir = m_gitdir + "/fat/objects";
+    m_fatdir = m_gitdir + "/fat";
+    m_objdir = m_fatdir + "/objects";
+    m_manifest = m_fatdir + "/manifest";
+    m_bundledir = m_fatdir + "/bundles";
+    m_packdir = m_fatdir + "/packs";
 
     DBGPRINT( "Prefix: " << m_prefix );
     DBGPRINT( "Git dir: " << m_gitdir );
@@ -57,19 +101,62 @@ void Lard::Init( int argc, char** argv )
     {
         printf( "Git lard already configured for %s, check configuration in .git/config\n", GetGitWorkTree() );
         printf( "    Note: migration from git-fat may require changing executable name.\n" );
+
+        // Older versions did not pass the path, without which the clean cache is not used.
+        const char* clean;
+        const char suffix[] = " filter-clean";
+        if( GetConfigKey( "filter.fat.clean", &clean ) )
+        {
+            const auto len = strlen( clean );
+            if( len >= sizeof( suffix ) - 1 && strcmp( clean + len - ( sizeof( suffix ) - 1 ), suffix ) == 0 )
+            {
+                const auto updated = std::string( clean ) + " %f";
+                SetConfigKey( "filter.fat.clean", updated.c_str() );
+                printf( "Updated filter.fat.clean to \"%s\", which enables the clean cache.\n", updated.c_str() );
+            }
+        }
     }
     else
     {
-        SetConfigKey( "filter.fat.clean", "git-fat filter-clean" );
+        SetConfigKey( "filter.fat.clean", "git-fat filter-clean %f" );
         SetConfigKey( "filter.fat.smudge", "git-fat filter-smudge" );
     }
 
+    if( checkarg( argc, argv, "--hooks" ) != -1 )
+    {
+        InstallHook( "post-checkout" );
+        InstallHook( "post-merge" );
+    }
+
     if( checkarg( argc, argv, "-r" ) != -1 )
     {
         SubmoduleInit( true );
     }
 }
 
+// Hooks make git restore placeholders of changed files after checkout and merge. Existing hooks are not replaced.
+void Lard::InstallHook( const char* name )
+{
+    const auto dir = m_gitdir + "/hooks";
+    const auto fn = dir + "/" + name;
+    if( Exists( fn ) )
+    {
+        printf( "Hook %s already exists, add '%s %s \"$@\"' to it manually\n", fn.c_str(), m_commandName, name );
+        return;
+    }
+    CreateDirStruct( dir );
+    FILE* f = fopen( fn.c_str(), "w" );
+    if( !f )
+    {
+        fprintf( stderr, "Cannot create hook %s\n", fn.c_str() );
+        return;
+    }
+    fprintf( f, "#!/bin/sh\nexec %s %s \"$@\"\n", m_commandName, name );
+    fclose( f );
+    chmod( fn.c_str(), 0755 );
+    printf( "Installed %s hook\n", name );
+}
+
 static std::vector<const char*> RelativeComplement( const set_str& s1, const set_str& s2 )
 {
     std::vector<const char*> ret;
@@ -83,12 +170,12 @@ static std::vector<const char*> RelativeComplement( const set_str& s1, const set
     return ret;
 }
 
-static std::vector<const char*> Intersect( const set_str& s1, const set_str& s2 )
+static std::vector<const char*> NotInManifest( const std::vector<const char*>& objects, const Manifest& manifest )
 {
     std::vector<const char*> ret;
-    for( auto& v : s1 )
+    for( auto& v : objects )
     {
-        if( s2.find( v ) != s2.end() )
+        if( !manifest.Contains( v ) )
         {
             ret.emplace_back( v );
         }
@@ -96,17 +183,46 @@ static std::vector<const char*> Intersect( const set_str& s1, const set_str& s2
     return ret;
 }
 
-void Lard::Status( int argc, char** argv )
+// Orphans are referenced objects missing in the store, garbage are stored objects which are not referenced.
+set_str Lard::GetStatus( bool all, std::vector<const char*>& orphans, std::vector<const char*>& garbage )
 {
-    Setup();
-    const auto catalog = ListDirectory( m_objdir );
+    std::vector<const char*> cached;
+    if( QueryDaemon( all ? "status 1" : "status 0", cached ) )
+    {
+        set_str referenced;
+        for( auto& v : cached )
+        {
+            if( v[0] == 'r' ) referenced.emplace( v + 2 );
+            else if( v[0] == 'o' ) orphans.emplace_back( v + 2 );
+            else if( v[0] == 'g' ) garbage.emplace_back( v + 2 );
+        }
+        return referenced;
+    }
+
+    set_str catalog;
+    auto scan = ScanObjects( catalog );
+    auto referenced = ReferencedObjects( all, false, nullptr );
+    scan.join();
     DBGPRINT( "Fat objects: " << catalog.size() );
-    bool all = checkarg( argc, argv, "--all" ) != -1;
-    const auto referenced = ReferencedObjects( all, false, nullptr );
     DBGPRINT( "Referenced objects: " << referenced.size() );
 
-    const auto garbage = RelativeComplement( catalog, referenced );
-    const auto orphans = RelativeComplement( referenced, catalog );
+    garbage = RelativeComplement( catalog, referenced );
+    orphans = RelativeComplement( referenced, catalog );
+    if( !GetAlternates().empty() )
+    {
+        // Only the few objects missing locally are looked up in alternates, which are not listed.
+        set_str missing( orphans.begin(), orphans.end() );
+        orphans = ProbeObjects( missing, false );
+    }
+    return referenced;
+}
+
+void Lard::Status( int argc, char** argv )
+{
+    Setup();
+    bool all = checkarg( argc, argv, "--all" ) != -1;
+    std::vector<const char*> orphans, garbage;
+    const auto referenced = GetStatus( all, orphans, garbage );
 
     if( all )
     {
@@ -135,32 +251,264 @@ void Lard::Status( int argc, char** argv )
 
 void Lard::GC()
 {
-    const auto catalog = ListDirectory( m_objdir );
+    set_str catalog;
+    auto scan = ScanObjects( catalog );
     const auto referenced = ReferencedObjects( false, false, nullptr );
+    scan.join();
     const auto garbage = RelativeComplement( catalog, referenced );
     printf( "Unreferenced objects to remove: %zu\n", garbage.size() );
+    Progress progress( "Removing", garbage.size() );
+    set_str packed;
     for( auto& v : garbage )
     {
+        const auto size = GetObjectSize( v );
+        if( Progress::IsVerbose() ) printf( "%10" PRIu64 " %s\n", size, v );
+        progress.Add( size );
         auto fn = GetObjectFn( v );
-        printf( "%10" PRIu64 " %s\n", GetFileSize( fn ), v );
-        unlink( fn );
+        if( Exists( fn ) )
+        {
+            unlink( fn );
+        }
+        const FatPack* pack;
+        if( FindPacked( v, pack ) )
+        {
+            packed.emplace( v );
+        }
+    }
+    if( !packed.empty() )
+    {
+        std::vector<size_t> packs;
+        for( size_t i=0; i<GetPacks().size(); i++ )
+        {
+            const auto& pack = GetPacks()[i];
+            for( auto& v : packed )
+            {
+                if( pack.Find( v ) )
+                {
+                    packs.emplace_back( i );
+                    break;
+                }
+            }
+        }
+        if( !WritePack( {}, packs, packed ) )
+        {
+            exit( 1 );
+        }
+    }
+    progress.Finish();
+
+    Evict( false );
+
+    // Results referring to removed objects would be hashed again anyway.
+    const CleanCache cache( m_fatdir + "/clean" );
+    const auto dropped = cache.Compact( [this]( const char* sha1 ) { return HasObject( sha1 ); } );
+    if( Progress::IsVerbose() ) printf( "Clean cache records removed: %zu\n", dropped );
+}
+
+// Removes least recently used objects until the store fits in lard.maxStoreSize. Objects referenced by HEAD or the
+// index are never evicted. Evicted objects are moved to lard.coldStore, if configured. Otherwise only objects listed
+// in the remote manifest are removed, as the local copy may be the only one. Packed objects are removed by rewriting
+// their packs. Sizes are allocated blocks, so that holes of sparse objects are not counted.
+void Lard::Evict( bool verbose )
+{
+    const auto maxSize = GetConfigSize( "lard.maxStoreSize", 0 );
+    if( maxSize == 0 )
+    {
+        if( verbose ) printf( "lard.maxStoreSize is not set\n" );
+        return;
+    }
+
+    std::unordered_map<std::string, uint32_t> access;
+    for( auto& v : GetAccessLog()->Read() )
+    {
+        auto& t = access[std::string( (const char*)v.sha1, 20 )];
+        t = std::max( t, v.time );
+    }
+
+    // Objects never accessed since tracking was enabled are considered used when they were stored.
+    auto lastUse = [&access]( const unsigned char* sha1, uint32_t stored ) {
+        auto it = access.find( std::string( (const char*)sha1, 20 ) );
+        return it != access.end() ? std::max( stored, it->second ) : stored;
+    };
+
+    struct Candidate
+    {
+        const char* sha1;
+        uint64_t size;
+        uint32_t time;
+        int pack;           // -1 for loose objects
+        const char* data;
+    };
+    std::vector<Candidate> candidates;
+    uint64_t total = 0;
+    // Commands limited by a pathspec still must keep everything HEAD needs.
+    const auto pathspec = m_pathspec;
+    m_pathspec = nullptr;
+    auto needed = ReferencedObjects( false, true, nullptr );
+    m_pathspec = pathspec;
+    for( auto& v : IndexObjects() )
+    {
+        needed.emplace( v );
+    }
+    for( auto& v : ListDirectory( m_objdir ) )
+    {
+        if( !StringHelpers::IsObjectName( v ) ) continue;
+        struct stat sb;
+        if( stat( GetObjectFn( v ), &sb ) != 0 ) continue;
+        const uint64_t size = sb.st_blocks * 512;
+        total += size;
+        if( needed.find( v ) != needed.end() ) continue;
+
+        unsigned char bin[20];
+        StringHelpers::HexToSha1( v, bin );
+        candidates.emplace_back( Candidate { v, size, lastUse( bin, sb.st_mtime ), -1, nullptr } );
+    }
+    for( size_t i=0; i<GetPacks().size(); i++ )
+    {
+        const auto& pack = GetPacks()[i];
+        struct stat sb;
+        if( stat( ( pack.Base() + ".pack" ).c_str(), &sb ) != 0 ) continue;
+        total += sb.st_blocks * 512;
+        for( size_t j=0; j<pack.Count(); j++ )
+        {
+            const auto entry = pack.Entries() + j;
+            char hex[41];
+            StringHelpers::Sha1ToHex( entry->sha1, hex );
+            if( needed.find( hex ) != needed.end() ) continue;
+            candidates.emplace_back( Candidate { Buffer::Store( hex, 40 ), entry->size, lastUse( entry->sha1, sb.st_mtime ), int( i ), pack.Data( entry ) } );
+        }
+    }
+
+    DBGPRINT( "Store size: " << total << ", limit: " << maxSize << ", eviction candidates: " << candidates.size() );
+    if( verbose ) printf( "Store size: %" PRIu64 " bytes, limit: %" PRIu64 " bytes\n", total, maxSize );
+
+    std::sort( candidates.begin(), candidates.end(), []( const Candidate& l, const Candidate& r ) { return l.time < r.time; } );
+
+    const auto cold = GetConfigString( "lard.coldStore" );
+    if( cold ) CreateDirStruct( cold );
+
+    Manifest manifest;
+    bool hasManifest = false;
+    if( !cold && total > maxSize )
+    {
+        hasManifest = GetConfigBool( "lard.manifest", true ) && HasRsyncRemote() && FetchManifest( manifest );
+    }
+
+    size_t evicted = 0;
+    size_t kept = 0;
+    uint64_t evictedSize = 0;
+    set_str dropped;
+    std::vector<size_t> packs;
+    for( auto& v : candidates )
+    {
+        if( total <= maxSize ) break;
+        if( !cold && !( hasManifest && manifest.Contains( v.sha1 ) ) )
+        {
+            kept++;
+            continue;
+        }
+        const std::string fn = GetObjectFn( v.sha1 );
+        const auto coldFn = cold ? std::string( cold ) + "/" + v.sha1 : std::string();
+        if( v.pack >= 0 )
+        {
+            if( cold && !Exists( coldFn ) && !StoreObject( v.sha1, v.data, v.size, nullptr, cold ) )
+            {
+                fprintf( stderr, "Cannot copy %s to cold store %s\n", v.sha1, cold );
+                continue;
+            }
+            dropped.emplace( v.sha1 );
+            if( std::find( packs.begin(), packs.end(), v.pack ) == packs.end() ) packs.emplace_back( v.pack );
+        }
+        else
+        {
+            if( cold && !MoveFile( fn.c_str(), coldFn.c_str() ) )
+            {
+                fprintf( stderr, "Cannot move %s to cold store %s\n", v.sha1, cold );
+                continue;
+            }
+            unlink( fn.c_str() );
+        }
+        if( verbose ) printf( "%10" PRIu64 " %s\n", v.size, v.sha1 );
+        unsigned char bin[20];
+        StringHelpers::HexToSha1( v.sha1, bin );
+        access.erase( std::string( (const char*)bin, 20 ) );
+        total -= v.size;
+        evictedSize += v.size;
+        evicted++;
+    }
+    if( !packs.empty() && !WritePack( {}, packs, dropped ) )
+    {
+        fprintf( stderr, "Cannot rewrite packs, packed objects were not evicted\n" );
+    }
+    if( evicted > 0 || verbose )
+    {
+        printf( "Evicted %zu objects (%" PRIu64 " bytes)%s%s\n", evicted, evictedSize, cold ? " to " : "", cold ? cold : "" );
+    }
+    if( kept > 0 )
+    {
+        printf( "Kept %zu objects not known to be on the remote, push them or set lard.coldStore\n", kept );
+    }
+
+    // Keep one record per object present in the store.
+    std::vector<AccessRecord> records;
+    for( auto& v : access )
+    {
+        char hex[41];
+        StringHelpers::Sha1ToHex( (const unsigned char*)v.first.data(), hex );
+        if( !Exists( GetObjectFn( hex ) ) ) continue;
+        AccessRecord r;
+        memcpy( r.sha1, v.first.data(), 20 );
+        r.time = v.second;
+        records.emplace_back( r );
     }
+    GetAccessLog()->Write( records );
 }
 
 void Lard::Verify()
 {
+    TRACE_SCOPE( "verify" );
     std::vector<std::pair<const char*, const char*>> corrupted;
     const auto catalog = ListDirectory( m_objdir );
+    size_t total = catalog.size();
+    for( auto& pack : GetPacks() ) total += pack.Count();
+    Progress progress( "Verifying", total );
     for( auto& v : catalog )
     {
         auto fn = GetObjectFn( v );
         FileMap<char> f( fn );
         auto sha1 = CalcSha1( f, f.DataSize() );
+        progress.Add( f.DataSize() );
         if( strncmp( v, sha1, 40 ) != 0 )
         {
             corrupted.emplace_back( v, Buffer::Store( sha1, 40 ) );
         }
     }
+    std::vector<const char*> invalid;
+    for( auto& pack : GetPacks() )
+    {
+        if( !pack.Check() )
+        {
+            invalid.emplace_back( pack.Base().c_str() );
+            continue;
+        }
+        for( size_t i=0; i<pack.Count(); i++ )
+        {
+            const auto entry = pack.Entries() + i;
+            char hex[41];
+            StringHelpers::Sha1ToHex( entry->sha1, hex );
+            auto sha1 = CalcSha1( pack.Data( entry ), entry->size );
+            progress.Add( entry->size );
+            if( strncmp( hex, sha1, 40 ) != 0 )
+            {
+                corrupted.emplace_back( Buffer::Store( hex, 40 ), Buffer::Store( sha1, 40 ) );
+            }
+        }
+    }
+    progress.Finish();
+    for( auto& v : invalid )
+    {
+        printf( "Invalid pack %s, index is not sorted or points outside of data\n", v );
+    }
     if( !corrupted.empty() )
     {
         printf( "Corrupted objects: %zu\n", corrupted.size() );
@@ -168,8 +516,8 @@ void Lard::Verify()
         {
             printf( "%s data hash is %s\n", v.first, v.second );
         }
-        exit( 1 );
     }
+    if( !invalid.empty() || !corrupted.empty() ) exit( 1 );
 }
 
 static std::vector<const char*>* ptr_vec_str;
@@ -199,16 +547,246 @@ void Lard::Find( int argc, char** argv )
     printf( "TODO\n" );
 }
 
+// Stores files with fat filter attribute and adds their placeholders to the index, equivalent to 'git add' running
+// filter-clean on each file. Files are hashed in parallel and the index is written once.
+void Lard::Add( int argc, char** argv )
+{
+    AssertInitDone();
+    Setup();
+    if( argc == 0 )
+    {
+        fprintf( stderr, "Usage: git lard add <path>...\n" );
+        exit( 1 );
+    }
+    // The lock is held until the index is written, so that entries added meanwhile by git are not lost.
+    if( LockIndex() < 0 ) exit( 1 );
+    if( ReadCache() < 0 )
+    {
+        fprintf( stderr, "index file corrupt\n" );
+        exit( 1 );
+    }
+
+    struct AddFile
+    {
+        const char* path;
+        struct stat st;
+        char sha1[41];
+        bool ok;
+    };
+    std::vector<AddFile> files;
+    size_t skipped = 0;
+
+    // Paths are taken the way 'git add' does, so ignored files and nested repositories are left out.
+    std::vector<const char*> paths;
+    ptr_vec_str = &paths;
+    auto cb = []( const char* path ) {
+        ptr_vec_str->emplace_back( Buffer::Store( path ) );
+    };
+    const char** args = new const char*[argc+1];
+    memcpy( args, argv, sizeof( const char* ) * argc );
+    args[argc] = nullptr;
+    const bool unmatched = ListWorkTreeFiles( args, cb ) != 0;
+    delete[] args;
+    if( unmatched ) exit( 1 );
+
+    for( auto& path : paths )
+    {
+        struct stat st;
+        // Tracked files may be deleted in the worktree.
+        if( lstat( path, &st ) != 0 || !S_ISREG( st.st_mode ) ) continue;
+        if( IsFatFile( path ) )
+        {
+            files.emplace_back( AddFile { path, st, {}, false } );
+        }
+        else
+        {
+            DBGPRINT( "Not a fat file: " << path );
+            skipped++;
+        }
+    }
+
+    // Lazily loaded state must be ready before it is shared by workers.
+    GetAlternates();
+    GetPacks();
+
+    std::atomic<size_t> next( 0 );
+    std::atomic<size_t> stored( 0 );
+    auto worker = [&]() {
+        for(;;)
+        {
+            const auto idx = next++;
+            if( idx >= files.size() ) break;
+            auto& file = files[idx];
+            bool isNew;
+            file.ok = IngestFile( file.path, file.st, file.sha1, isNew );
+            if( file.ok && isNew ) stored++;
+        }
+    };
+
+    std::vector<std::thread> threads;
+    const auto numThreads = std::max( 1u, std::thread::hardware_concurrency() );
+    for( unsigned int i=0; i<numThreads; i++ )
+    {
+        threads.emplace_back( worker );
+    }
+    for( auto& v : threads )
+    {
+        v.join();
+    }
+
+    size_t added = 0;
+    uint64_t bytes = 0;
+    for( auto& v : files )
+    {
+        if( !v.ok )
+        {
+            fprintf( stderr, "Cannot add %s\n", v.path );
+            continue;
+        }
+        const auto encoded = Encode( v.sha1, v.st.st_size );
+        if( AddIndexFile( v.path, encoded, GitFatMagic, &v.st ) != 0 )
+        {
+            fprintf( stderr, "Cannot add %s to index\n", v.path );
+            continue;
+        }
+        added++;
+        bytes += v.st.st_size;
+    }
+    {
+        TRACE_SCOPE( "index write" );
+        WriteIndex();
+    }
+
+    printf( "Added %zu files (%" PRIu64 " bytes), %zu new objects\n", added, bytes, stored.load() );
+    if( Sparse::Saved() > 0 )
+    {
+        printf( "Sparse files: %" PRIu64 " bytes of holes and zeros not written\n", Sparse::Saved() );
+    }
+    if( skipped > 0 )
+    {
+        printf( "Skipped %zu files without fat filter attribute, use git add for them\n", skipped );
+    }
+    if( added != files.size() ) exit( 1 );
+}
+
+// Finds data extents of a file which was created sparse. Returns false if it has no holes.
+static bool FindHoles( const char* path, const struct stat& st, std::vector<Sparse::Extent>& extents )
+{
+    if( !Sparse::MayHaveHoles( st ) ) return false;
+    const auto fd = open( path, O_RDONLY );
+    if( fd < 0 ) return false;
+    extents = Sparse::DataExtents( fd, st.st_size );
+    close( fd );
+    return Sparse::DataSize( extents ) < (uint64_t)st.st_size;
+}
+
+static bool SameStat( const struct stat& st1, const struct stat& st2 )
+{
+#ifdef __APPLE__
+    const auto& m1 = st1.st_mtimespec, & m2 = st2.st_mtimespec, & c1 = st1.st_ctimespec, & c2 = st2.st_ctimespec;
+#else
+    const auto& m1 = st1.st_mtim, & m2 = st2.st_mtim, & c1 = st1.st_ctim, & c2 = st2.st_ctim;
+#endif
+    return st1.st_ino == st2.st_ino && st1.st_size == st2.st_size && m1.tv_sec == m2.tv_sec && m1.tv_nsec == m2.tv_nsec &&
+        c1.tv_sec == c2.tv_sec && c1.tv_nsec == c2.tv_nsec;
+}
+
+// Hashes mapped file contents with SHA-1 and xxHash, block by block so that each block is read from memory once.
+// Holes are hashed from a buffer of zeros, so that their pages are never touched.
+static void HashFile( const char* ptr, uint64_t size, const std::vector<Sparse::Extent>* extents, unsigned char sha1[20], uint64_t& hash )
+{
+    enum { BlockSize = 256 * 1024 };
+    TRACE_SCOPE( "hash" );
+    Trace::Count( Trace::BytesHashed, size );
+
+    static const char zero[64 * 1024] = {};
+    SHA_CTX ctx;
+    SHA1_Init( &ctx );
+    XXH64_state_t* xxh = XXH64_createState();
+    XXH64_reset( xxh, 0 );
+    auto update = [&ctx, xxh]( const char* data, uint64_t len ) {
+        while( len > 0 )
+        {
+            const auto block = std::min<uint64_t>( len, BlockSize );
+            SHA1_Update( &ctx, data, block );
+            XXH64_update( xxh, data, block );
+            data += block;
+            len -= block;
+        }
+    };
+    uint64_t pos = 0;
+    auto zeros = [&update, &pos]( uint64_t end ) {
+        while( pos < end )
+        {
+            const auto len = std::min<uint64_t>( end - pos, sizeof( zero ) );
+            update( zero, len );
+            pos += len;
+        }
+    };
+    if( extents )
+    {
+        for( auto& v : *extents )
+        {
+            zeros( v.offset );
+            update( ptr + v.offset, v.size );
+            pos = v.offset + v.size;
+        }
+        zeros( size );
+    }
+    else
+    {
+        update( ptr, size );
+    }
+    SHA1_Final( sha1, &ctx );
+    hash = XXH64_digest( xxh );
+    XXH64_freeState( xxh );
+}
+
+// Hashes a worktree file and stores it, if the object is missing. The file must not change while it is read. Safe to
+// call from many threads once alternates and packs are loaded.
+bool Lard::IngestFile( const char* path, const struct stat& st, char* sha1, bool& stored ) const
+{
+    FileMap<char> map;
+    std::vector<Sparse::Extent> extents;
+    bool sparse = false;
+    if( st.st_size > 0 )
+    {
+        map = FileMap<char>( path, true );
+        if( !map ) return false;
+        sparse = FindHoles( path, st, extents );
+    }
+    unsigned char bin[20];
+    uint64_t hash;
+    HashFile( map, map.Size(), sparse ? &extents : nullptr, bin, hash );
+    StringHelpers::Sha1ToHex( bin, sha1 );
+
+    struct stat st2;
+    if( lstat( path, &st2 ) != 0 || !SameStat( st, st2 ) ) return false;
+    stored = false;
+    if( !HasObject( sha1 ) )
+    {
+        if( !StoreObject( sha1, map, map.Size(), sparse ? &extents : nullptr ) ) return false;
+        stored = true;
+    }
+    const CleanCache cache( m_fatdir + "/clean" );
+    cache.Store( path, st.st_size, hash, sha1 );
+    return true;
+}
+
 // file content -> fat-sha-magic
-void Lard::Clean()
+// Worktree path is passed when the filter is configured as 'filter-clean %f'.
+void Lard::Clean( int argc, char** argv )
 {
     Setup();
-    FilterClean( stdin, stdout );
+    FilterClean( stdin, stdout, argc > 0 ? argv[0] : nullptr );
 }
 
-void Lard::FilterClean( FILE* in, FILE* out )
+// If the path is known, the clean cache is used. Git does not guarantee that stdin matches the worktree file (e.g.
+// hash-object --path, apply --cached), so a cached result is only used if stdin has its size and xxHash. Otherwise
+// stdin is hashed with SHA-1, and the result is remembered for the path.
+void Lard::FilterClean( FILE* in, FILE* out, const char* path )
 {
-    size_t size = 0;
+    uint64_t size = 0;
 
     enum { ChunkSize = 4 * 1024 * 1024 };
     char* buf = new char[ChunkSize];
@@ -226,42 +804,124 @@ void Lard::FilterClean( FILE* in, FILE* out )
 
     std::vector<const char*> payload;
 
-    SHA_CTX ctx;
-    SHA1_Init( &ctx );
-
-    size += len;
-    SHA1_Update( &ctx, buf, len );
-    payload.emplace_back( buf );
-    while( len == ChunkSize )
+    // The daemon only reports records whose object is stored, which saves loading packs on a hit.
+    const CleanCache cache( m_fatdir + "/clean" );
+    CleanCacheRecord cached;
+    bool found = false;
+    bool present = false;
+    if( path )
     {
-        buf = new char[ChunkSize];
-        len = fread( buf, 1, ChunkSize, in );
-        size += len;
-        SHA1_Update( &ctx, buf, len );
-        payload.emplace_back( buf );
+        std::vector<const char*> reply;
+        const auto req = std::string( "clean " ) + path;
+        char hex[41];
+        if( !strchr( path, '\n' ) && QueryDaemon( req.c_str(), reply ) )
+        {
+            found = present = reply.size() == 1 &&
+                sscanf( reply[0], "%" SCNu64 " %" SCNu64 " %40s", &cached.size, &cached.hash, hex ) == 3 &&
+                StringHelpers::HexToSha1( hex, cached.sha1 );
+        }
+        else
+        {
+            found = cache.Find( path, cached );
+        }
     }
+    XXH64_state_t* xxh = path ? XXH64_createState() : nullptr;
+    if( xxh ) XXH64_reset( xxh, 0 );
 
-    unsigned char sha1[20];
-    SHA1_Final( sha1, &ctx );
+    const char* hex = nullptr;
+    {
+        TraceScope trace( "hash" );
+        SHA_CTX ctx;
+        SHA1_Init( &ctx );
+        // SHA-1 is deferred while the contents may match the cached record.
+        auto update = [&]( const char* ptr, size_t len ) {
+            size += len;
+            if( xxh ) XXH64_update( xxh, ptr, len );
+            if( !found ) SHA1_Update( &ctx, ptr, len );
+            payload.emplace_back( ptr );
+        };
+
+        update( buf, len );
+        while( len == ChunkSize )
+        {
+            buf = new char[ChunkSize];
+            len = fread( buf, 1, ChunkSize, in );
+            update( buf, len );
+        }
 
-    const char* hex = Sha1ToHex( sha1 );
-    const char* encoded = Encode( hex, size );
-    fwrite( encoded, 1, GitFatMagic, out );
+        if( found && cached.size == size && cached.hash == XXH64_digest( xxh ) )
+        {
+            hex = Sha1ToHex( cached.sha1 );
+            if( present || HasObject( hex ) )
+            {
+                present = true;
+                DBGPRINT( "Clean cache hit: " << path << " -> " << hex );
+            }
+            else
+            {
+                hex = nullptr;
+                present = false;
+            }
+        }
+        if( !hex )
+        {
+            if( found )
+            {
+                uint64_t offset = 0;
+                for( auto& ptr : payload )
+                {
+                    const auto s = std::min<uint64_t>( size - offset, ChunkSize );
+                    SHA1_Update( &ctx, ptr, s );
+                    offset += s;
+                }
+            }
+            unsigned char sha1[20];
+            SHA1_Final( sha1, &ctx );
+            Trace::Count( Trace::BytesHashed, size );
+            hex = Sha1ToHex( sha1 );
+        }
+        trace.Arg( "bytes", size );
+    }
 
-    auto path = GetObjectFn( hex );
-    if( !Exists( path ) )
+    bool stored = true;
+    if( !present && !HasObject( hex ) )
     {
-        DBGPRINT( "Caching file to " << path );
-        FILE* cache = fopen( path, "wb" );
-        assert( cache );
+        TRACE_SCOPE( "store object" );
+        Trace::Count( Trace::Files );
+        Trace::Count( Trace::BytesCopied, size );
+        const std::string fn = GetObjectFn( hex );
+        const auto tmp = fn + ".tmp";
+        DBGPRINT( "Caching file to " << fn );
+        // The size must only be set after all data was written, or a failed write would leave a zero filled object
+        // of the right size.
+        const auto fd = open( tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+        stored = fd >= 0;
+        uint64_t offset = 0;
         for( auto& ptr : payload )
         {
-            auto s = std::min<size_t>( size, ChunkSize );
-            fwrite( ptr, 1, s, cache );
-            size -= s;
+            auto s = std::min<uint64_t>( size - offset, ChunkSize );
+            stored = stored && Sparse::Write( fd, ptr, offset, s );
+            offset += s;
+        }
+        stored = stored && ftruncate( fd, size ) == 0;
+        if( fd >= 0 ) stored = close( fd ) == 0 && stored;
+        if( !stored || rename( tmp.c_str(), fn.c_str() ) != 0 )
+        {
+            fprintf( stderr, "Cannot write %s\n", fn.c_str() );
+            unlink( tmp.c_str() );
+            stored = false;
         }
-        fclose( cache );
-        assert( size == 0 );
+        DBGPRINT( "Sparse: " << Sparse::Saved() << " bytes of zeros not written" );
+    }
+    // Git must not record a placeholder of an object which was not stored.
+    if( !stored ) exit( 1 );
+    fwrite( Encode( hex, size ), 1, GitFatMagic, out );
+
+    if( xxh )
+    {
+        const auto hash = XXH64_digest( xxh );
+        if( !found || cached.size != size || cached.hash != hash ) cache.Store( path, size, hash, hex );
+        XXH64_freeState( xxh );
     }
 
     for( auto& ptr : payload )
@@ -274,58 +934,47 @@ void Lard::FilterClean( FILE* in, FILE* out )
 void Lard::Smudge()
 {
     enum { ChunkSize = 64 * 1024 };
+    TRACE_SCOPE( "smudge" );
 
     Setup();
 
     const char* sha1;
-    size_t size;
+    uint64_t size;
 
 #ifdef __linux__
-    bool done = false;
-    fseek( stdin, 0, SEEK_END );
-    const auto len = ftell( stdin );
-    if( len == GitFatMagic )
+    // Input is a placeholder if it ends right after the magic. Works for both files and pipes.
+    char buf[GitFatMagic+1];
+    size_t len = 0;
+    while( len < sizeof( buf ) )
     {
-        char buf[GitFatMagic];
-        fseek( stdin, 0, SEEK_SET );
-        fread( buf, 1, GitFatMagic, stdin );
-        if( Decode( buf, sha1, size ) )
-        {
-            auto fn = GetObjectFn( sha1 );
-            auto srcfd = open( fn, O_RDONLY );
-            if( srcfd >= 0 )
-            {
-                while( size > 0 )
-                {
-                    const auto rd = copy_file_range( srcfd, nullptr, fileno( stdout ), nullptr, size, 0 );
-                    if( rd <= 0 ) break;
-                    size -= rd;
-                }
-                close( srcfd );
+        const auto rd = read( STDIN_FILENO, buf + len, sizeof( buf ) - len );
+        if( rd < 0 && errno == EINTR ) continue;
+        if( rd <= 0 ) break;
+        len += rd;
+    }
 
-                if( size == 0 )
-                {
-                    done = true;
-                    DBGPRINT( "git-lard filter-smudge: restoring from " << fn );
-                }
-                else
-                {
-                    DBGPRINT( "git-lard filter-smudge: invalid size of " << fn );
-                }
-            }
-        }
-    }
-    if( !done )
+    if( len == GitFatMagic && Decode( buf, sha1, size ) )
     {
-        fseek( stdin, 0, SEEK_SET );
-        char buf[ChunkSize];
-        auto len = fread( buf, 1, ChunkSize, stdin );
-        fwrite( buf, 1, len, stdout );
-        while( len == ChunkSize )
+        const auto written = WriteObject( sha1, STDOUT_FILENO );
+        if( written < 0 )
         {
-            len = fread( buf, 1, ChunkSize, stdin );
-            fwrite( buf, 1, len, stdout );
+            DBGPRINT( "git-lard filter-smudge: fat object missing " << sha1 );
+            WriteFd( STDOUT_FILENO, buf, GitFatMagic );
+        }
+        else if( (uint64_t)written == size )
+        {
+            TouchObject( sha1 );
+            DBGPRINT( "git-lard filter-smudge: restoring " << sha1 );
         }
+        else
+        {
+            DBGPRINT( "git-lard filter-smudge: invalid size of " << sha1 );
+        }
+    }
+    else
+    {
+        WriteFd( STDOUT_FILENO, buf, len );
+        if( len == sizeof( buf ) ) CopyStream( STDIN_FILENO, STDOUT_FILENO );
 
         DBGPRINT( "git-lard filter-smudge: not a managed file" );
     }
@@ -335,33 +984,23 @@ void Lard::Smudge()
 
     if( len == GitFatMagic && Decode( buf, sha1, size ) )
     {
-        auto fn = GetObjectFn( sha1 );
-        FILE* f = fopen( fn, "rb" );
-        if( f )
+        fflush( stdout );
+        const auto read_size = WriteObject( sha1, fileno( stdout ) );
+        if( read_size >= 0 )
         {
-            size_t read_size = 0;
-            do
-            {
-                len = fread( buf, 1, ChunkSize, f );
-                fwrite( buf, 1, len, stdout );
-                read_size += len;
-            }
-            while( len == ChunkSize );
-
-            fclose( f );
-
-            if( size == read_size )
+            if( size == (uint64_t)read_size )
             {
-                DBGPRINT( "git-lard filter-smudge: restoring from " << fn );
+                TouchObject( sha1 );
+                DBGPRINT( "git-lard filter-smudge: restoring " << sha1 );
             }
             else
             {
-                DBGPRINT( "git-lard filter-smudge: invalid size of " << fn << " (expected " << size << ", got " << read_size <<")" );
+                DBGPRINT( "git-lard filter-smudge: invalid size of " << sha1 << " (expected " << size << ", got " << read_size <<")" );
             }
         }
         else
         {
-            DBGPRINT( "git-lard filter-smudge: fat object missing " << fn );
+            DBGPRINT( "git-lard filter-smudge: fat object missing " << sha1 );
             fwrite( buf, 1, GitFatMagic, stdout );
         }
     }
@@ -382,89 +1021,369 @@ void Lard::Smudge()
 
 void Lard::Checkout()
 {
-    static char objbuf[1024];
-    memcpy( objbuf, m_objdir.c_str(), m_objdir.size() );
-    static char* objbufptr = objbuf + m_objdir.size();
-    *objbufptr++ = '/';
-    objbufptr[40] = '\0';
-    static int objbufskip = objbufptr - objbuf;
+    CheckoutPlaceholders( nullptr, nullptr );
+}
+
+// Restores placeholders after git switched HEAD. Invoked by hooks installed with 'init --hooks'.
+// Arguments are: previous HEAD, new HEAD, and 1 for branch checkout or 0 for file checkout.
+void Lard::PostCheckout( int argc, char** argv )
+{
+    if( argc < 3 )
+    {
+        fprintf( stderr, "Usage: git lard post-checkout <old> <new> <flag>\n" );
+        exit( 1 );
+    }
+    if( strcmp( argv[2], "1" ) != 0 )
+    {
+        // Files checked out from index or arbitrary tree cannot be inferred from HEAD change.
+        Checkout();
+    }
+    else
+    {
+        CheckoutPlaceholders( argv[0], argv[1] );
+    }
+}
+
+void Lard::PostMerge()
+{
+    CheckoutPlaceholders( "ORIG_HEAD", "HEAD" );
+}
+
+// Placeholders are restored in batches while the index is scanned, so that memory use does not grow with index size.
+void Lard::CheckoutPlaceholders( const char* from, const char* to )
+{
+    enum { CheckoutBatch = 16 * 1024 };
 
     AssertInitDone();
-    ParsePathspec( m_prefix.c_str() );
+    Progress progress( "Restoring" );
+    m_progress = &progress;
+    m_checkoutBatch = CheckoutBatch;
+    CollectPlaceholders( from, to );
+    RestorePlaceholders();
+    progress.Finish();
+    m_progress = nullptr;
+    FinishCheckout();
+}
+
+void Lard::RestorePlaceholders()
+{
+    TRACE_SCOPE( "restore placeholders" );
+    std::vector<const char*> objects;
+    objects.reserve( m_placeholderObjects.size() );
+    for( auto& v : m_placeholderObjects )
+    {
+        objects.emplace_back( v.first );
+    }
+    for( auto& v : objects )
+    {
+        RestoreObject( v );
+    }
+    FlushPlaceholders();
+}
+
+// Finds placeholder files in the worktree and groups them by fat object. If a pair of revisions is given, only
+// files changed between them are checked, otherwise all files in the index.
+void Lard::CollectPlaceholders( const char* from, const char* to )
+{
+    TRACE_SCOPE( "placeholder scan" );
+    ParsePathspec( m_prefix.c_str(), m_pathspec );
     if( ReadCache() < 0 )
     {
         fprintf( stderr, "index file corrupt\n" );
         exit( 1 );
     }
 
-    static std::vector<std::pair<const char*, const char*>> fileList;
-    static shaset missingBlobs;
-    static shamap blobToCommit;
+    // Placeholder blobs decoded by the daemon are not read again.
+    std::vector<const char*> cached;
+    if( m_placeholderBlobs.empty() && QueryDaemon( "placeholders", cached ) )
+    {
+        for( auto& v : cached )
+        {
+            unsigned char blob[20];
+            if( strlen( v ) != 81 || !StringHelpers::HexToSha1( v, blob ) ) continue;
+            m_placeholderBlobs.emplace( Buffer::Store( (const char*)blob, 20 ), v[41] == '-' ? nullptr : v + 41 );
+        }
+    }
+
+    static Lard* lard;
+    lard = this;
 
-    auto cb = []( const char* fn, const char* localFn, const char* fileSha ) {
-        const char* sha1 = GetFatObjectSha1( fn );
+    auto cb = []( const char* fn, const char* localFn, const char* fileSha, int pos ) {
+        const char* sha1 = lard->GetPlaceholderSha1( fn, fileSha, pos );
         if( !sha1 ) return;
-        memcpy( objbufptr, sha1, 40 );
 
-        struct stat sb;
-        if( stat( objbuf, &sb ) == 0 )
+        auto& names = lard->m_placeholderNames;
+        const auto blob = names.Store( fileSha, 20 );
+        const auto idx = lard->m_placeholders.size();
+        const auto name = names.Store( fn );
+        lard->m_placeholders.emplace_back( Placeholder { name, name + ( localFn - fn ), blob } );
+
+        auto it = lard->m_placeholderObjects.find( sha1 );
+        if( it == lard->m_placeholderObjects.end() )
         {
-            fileList.emplace_back( strdup( objbuf ), strdup( fn ) );
-            utime( fn, nullptr );
+            it = lard->m_placeholderObjects.emplace( names.Store( sha1, 40 ), std::vector<size_t>() ).first;
         }
-        else
+        it->second.emplace_back( idx );
+
+        if( lard->m_checkoutBatch != 0 && lard->m_placeholders.size() >= lard->m_checkoutBatch )
         {
-            char* blob = new char[20];
-            memcpy( blob, fileSha, 20 );
-            missingBlobs.emplace( blob );
-            printf( "Data unavailable: %s %s\n", sha1, localFn );
+            lard->RestorePlaceholders();
         }
     };
 
-    ListFiles( cb );
+    if( from && DiffTrees( from, to, cb ) == 0 )
+    {
+        DBGPRINT( "Checked files changed between " << from << " and " << to );
+    }
+    else
+    {
+        ListFiles( cb );
+    }
+    DBGPRINT( "Placeholder scan: " << m_placeholders.size() << " placeholders, " << m_syscallsAvoided << " syscalls avoided" );
+}
+
+// Writes object contents to all placeholders referring to it. Returns false if the object is not available.
+bool Lard::RestoreObject( const char* sha1 )
+{
+    auto it = m_placeholderObjects.find( sha1 );
+    if( it == m_placeholderObjects.end() ) return true;
+    if( !HasObject( sha1 ) ) return false;
 
-    static auto it = fileList.begin();
-    auto listCb = []() -> struct CheckoutData {
-        if( it == fileList.end() )
+    const auto size = m_progress ? GetObjectSize( sha1 ) : 0;
+    for( auto& idx : it->second )
+    {
+        const auto& file = m_placeholders[idx];
+        if( Progress::IsVerbose() ) printf( "Restoring %s -> %s\n", it->first, file.fn );
+        if( MaterializeObject( it->first, file.fn ) )
         {
-            return CheckoutData {};
+            m_restored.emplace_back( file.fn );
+            if( m_progress ) m_progress->Add( size );
         }
-        printf( "Restoring %s -> %s\n", it->first + objbufskip, it->second );
-        CheckoutData ret { it->first, it->second };
-        ++it;
-        return ret;
+        else
+        {
+            fprintf( stderr, "Cannot restore %s\n", file.fn );
+        }
+    }
+
+    TouchObject( it->first );
+    m_placeholderObjects.erase( it );
+    return true;
+}
+
+// Updates index entries of restored files, reports placeholders which could not be restored and releases the
+// placeholder list.
+void Lard::FlushPlaceholders()
+{
+    static std::vector<const char*>* restored;
+    static size_t pos;
+    restored = &m_restored;
+    pos = 0;
+    auto listCb = []() -> const char* {
+        if( pos == restored->size() ) return nullptr;
+        return (*restored)[pos++];
     };
 
-    CheckoutFiles( listCb );
+    {
+        TRACE_SCOPE( "index update" );
+        UpdateIndexFiles( listCb );
+    }
+    m_restoredCount += m_restored.size();
+    m_restored.clear();
+
+    for( auto& v : m_placeholderObjects )
+    {
+        for( auto& idx : v.second )
+        {
+            if( Progress::IsVerbose() ) printf( "Data unavailable: %s %s\n", v.first, m_placeholders[idx].localFn );
+            m_missingCount++;
+            m_missingBlobs.emplace( Buffer::Store( m_placeholders[idx].blob, 20 ) );
+        }
+    }
+
+    m_placeholders.clear();
+    m_placeholderObjects.clear();
+    m_placeholderNames.Clear();
+}
+
+// Writes the index and finds commits introducing placeholders which could not be restored.
+void Lard::FinishCheckout()
+{
+    FlushPlaceholders();
+    {
+        TRACE_SCOPE( "index write" );
+        WriteIndex();
+    }
     printf( "\n" );
 
-    if( !missingBlobs.empty() )
+    if( m_access ) m_access->Flush();
+
+    struct rusage ru;
+    getrusage( RUSAGE_SELF, &ru );
+#ifdef __APPLE__
+    const auto peak = ru.ru_maxrss / ( 1024 * 1024 );
+#else
+    const auto peak = ru.ru_maxrss / 1024;
+#endif
+    printf( "Restored %zu files, peak memory usage %ld MiB\n", m_restoredCount, (long)peak );
+    if( Sparse::Saved() > 0 )
+    {
+        printf( "Sparse files: %" PRIu64 " bytes of holes and zeros not written\n", Sparse::Saved() );
+    }
+    DBGPRINT( "String storage: " << Buffer::Used() << " bytes used, " << Buffer::Reserved() << " bytes reserved" );
+    if( m_missingCount > 0 && !Progress::IsVerbose() )
+    {
+        printf( "Data unavailable for %zu files, use --verbose to list them\n", m_missingCount );
+    }
+
+    if( !m_missingBlobs.empty() )
     {
         printf( "!! Missing files !!\n" );
+        AttributeMissingBlobs();
+    }
+}
+
+// Finds commits which introduced missing blobs. First parents are walked from HEAD, and each blob is attributed to the
+// oldest commit of the run of commits containing it; for blobs which came from a side branch, that's the merge. In
+// date order, commits of other branches would interrupt the run. Results are cached in .git/fat/blobcommits-fp.
+void Lard::AttributeMissingBlobs()
+{
+    TRACE_SCOPE( "blob attribution" );
+    struct BlobState
+    {
+        struct commit* commit;
+        size_t seen;
+        bool done;
+        bool cached;
+    };
+    using BlobMap = std::unordered_map<const char*, BlobState, StringHelpers::hash_sha, StringHelpers::equal_to_sha>;
+
+    static BlobMap state;
+    static size_t pending;
+    state.clear();
+    for( auto& v : m_missingBlobs )
+    {
+        state.emplace( v, BlobState { nullptr, 0, false, false } );
+    }
+    pending = state.size();
+
+    struct CacheRecord
+    {
+        char blob[20];
+        char commit[20];
+    };
+    // Attribution follows first parents of HEAD, so cached results are only valid for the HEAD they were made for.
+    struct CacheHeader
+    {
+        char magic[8];
+        char head[20];
+        char pad[12];
+    };
+    static_assert( sizeof( CacheHeader ) == sizeof( CacheRecord ), "CacheHeader must have record size" );
+    static const char CacheMagic[8] = { 'L', 'A', 'R', 'D', 'B', 'C', '0', '1' };
+
+    const auto head = GetSha1( "HEAD" );
+    if( !head ) return;
+    CacheHeader hdr = {};
+    memcpy( hdr.magic, CacheMagic, sizeof( CacheMagic ) );
+    StringHelpers::HexToSha1( head, (unsigned char*)hdr.head );
+
+    const auto cacheFn = m_fatdir + "/blobcommits";
+    std::vector<CacheRecord> records;
+    if( Exists( cacheFn ) )
+    {
+        FileMap<char> cache( cacheFn.c_str(), true );
+        if( cache && cache.Size() >= sizeof( CacheHeader ) && memcmp( cache, &hdr, sizeof( CacheHeader ) ) == 0 )
+        {
+            const auto ptr = (const CacheRecord*)( (const char*)cache + sizeof( CacheHeader ) );
+            records.assign( ptr, ptr + ( cache.Size() / sizeof( CacheRecord ) - 1 ) );
+        }
+    }
+    for( auto& v : records )
+    {
+        auto it = state.find( v.blob );
+        if( it == state.end() || it->second.done ) continue;
+        auto commit = GetCommit( v.commit );
+        if( !commit ) continue;
+        it->second = BlobState { commit, 0, true, true };
+        pending--;
+    }
+    DBGPRINT( "Blob attribution cache: " << state.size() - pending << " of " << state.size() << " blobs" );
+
+    if( pending > 0 )
+    {
+        // Blobs found in the walk and not yet attributed. Commits are numbered, a blob seen in the current commit has
+        // its number.
+        static std::vector<BlobState*> active;
+        static size_t generation, seen;
+        active.clear();
+        generation = 1;
+        seen = 0;
 
         auto find = []( const char* blob ) -> int {
-            auto it = missingBlobs.find( blob );
-            return it == missingBlobs.end() ? 0 : 1;
+            auto it = state.find( blob );
+            return it != state.end() && !it->second.done;
         };
-        auto add = []( const char* blob, struct commit* commit )
-        {
-            blobToCommit[blob] = commit;
+        auto add = []( const char* blob, struct commit* commit ) {
+            auto& s = state.find( blob )->second;
+            if( !s.commit ) active.emplace_back( &s );
+            s.commit = commit;
+            if( s.seen != generation )
+            {
+                s.seen = generation;
+                seen++;
+            }
+        };
+        // Blob is attributed when the walk reaches a commit which no longer contains it. Active blobs are only
+        // checked if some of them were not seen.
+        auto done = []( struct commit* ) -> int {
+            if( seen != active.size() )
+            {
+                active.erase( std::remove_if( active.begin(), active.end(), []( BlobState* s ) {
+                    if( s->seen == generation ) return false;
+                    s->done = true;
+                    pending--;
+                    return true;
+                } ), active.end() );
+            }
+            generation++;
+            seen = 0;
+            return pending == 0;
         };
 
         rev_info* revs = NewRevInfo();
         AddRevHead( revs );
+        SetFirstParentWalk( revs );
         PrepareRevWalk( revs );
-        GetCommitsForBlobs( revs, find, add );
+        GetCommitsForBlobs( revs, find, add, done );
+        FreeRevs( revs );
 
-        for( auto& v : blobToCommit )
+        // The file is rewritten with results for the current HEAD only, so it does not grow across branches.
+        for( auto& v : state )
         {
-            PrintBlobCommitInfo( v.first, v.second );
+            if( !v.second.commit || v.second.cached ) continue;
+            CacheRecord r;
+            memcpy( r.blob, v.first, 20 );
+            memcpy( r.commit, GetCommitSha1( v.second.commit ), 20 );
+            records.emplace_back( r );
+        }
+        const auto tmp = cacheFn + ".tmp";
+        FILE* f = fopen( tmp.c_str(), "wb" );
+        if( f )
+        {
+            bool ok = fwrite( &hdr, sizeof( hdr ), 1, f ) == 1;
+            ok = ok && fwrite( records.data(), sizeof( CacheRecord ), records.size(), f ) == records.size();
+            ok = fclose( f ) == 0 && ok;
+            if( !ok || rename( tmp.c_str(), cacheFn.c_str() ) != 0 ) unlink( tmp.c_str() );
         }
-
-        FreeRevs( revs );
     }
 
-    // deliberately leak fileList here
+    for( auto& v : state )
+    {
+        if( v.second.commit )
+        {
+            PrintBlobCommitInfo( v.first, v.second.commit );
+        }
+    }
 }
 
 void Lard::Pull( int argc, char** argv )
@@ -478,7 +1397,7 @@ void Lard::Pull( int argc, char** argv )
     const char* rev = nullptr;
 
     int n;
-    for( int n=0; n<argc; n++ )
+    for( n=0; n<argc; n++ )
     {
         if( *argv[n] == '-' )
         {
@@ -520,16 +1439,106 @@ void Lard::Pull( int argc, char** argv )
 
     DBGPRINT( "Rev: " << ( rev ? rev : "(none)" ) << ", all: " << all );
 
-    const auto catalog = ListDirectory( m_objdir );
+    // Remaining arguments are pathspecs limiting which objects are fetched and restored.
+    if( n < argc )
+    {
+        m_pathspec = (const char**)argv + n;
+    }
+
     const auto referenced = rsyncCwd ? ReferencedObjectsCwd()
-                                     : ReferencedObjects( all, nowalk, rev );
-    const auto orphans = RelativeComplement( referenced, catalog );
-    // TODO: match orphans against patterns (in argv, if n<argc)
+                                     : ReferencedObjects( all, nowalk, rev, true );
+    auto orphans = ProbeObjects( referenced, false );
+
+    // The manifest is not consulted, as it may miss objects pushed by git-fat or older git-lard versions. rsync
+    // reports objects which are really not on the remote.
+    const bool bundles = GetConfigBool( "lard.bundle", false );
+    if( !orphans.empty() && bundles )
+    {
+        orphans = PullBundles( orphans );
+    }
+
+    // Placeholders are restored as soon as their objects arrive, while the transfer is still running. Objects which
+    // are already present are restored when rsync has nothing to report.
+    AssertInitDone();
+    CollectPlaceholders();
+
+    std::vector<const char*> local;
+    for( auto& v : m_placeholderObjects )
+    {
+        if( HasObject( v.first ) )
+        {
+            local.emplace_back( v.first );
+        }
+    }
+
+    // Objects which fail verification are not restored now, and are checked again after the transfer.
+    std::vector<const char*> deferred;
+    auto verifyObject = [this]( const char* name ) -> bool {
+        FileMap<char> f;
+        if( !MapObject( name, f ) ) return false;
+        return strncmp( CalcSha1( f, f.Size() ), name, 40 ) == 0;
+    };
+    auto onFile = [this, &deferred, &verifyObject]( const char* name ) {
+        const auto it = m_placeholderObjects.find( name );
+        if( it == m_placeholderObjects.end() ) return;
+        if( !verifyObject( name ) )
+        {
+            DBGPRINT( "Object " << name << " failed verification, deferring restore" );
+            deferred.emplace_back( it->first );
+            return;
+        }
+        RestoreObject( name );
+    };
+    auto onIdle = [this, &local]() -> bool {
+        if( local.empty() ) return false;
+        RestoreObject( local.back() );
+        local.pop_back();
+        return !local.empty();
+    };
+
+    const auto fetchDir = GetFetchDir();
+    const auto cmd = GetRsyncCommand( false, fetchDir.c_str() );
+    Progress progress( "Fetching", orphans.size() );
+    bool ret = ExecuteRsync( cmd, orphans, onFile, onIdle, &progress );
+    progress.Finish();
 
-    const auto cmd = GetRsyncCommand( false );
-    bool ret = ExecuteRsync( cmd, orphans );
+    // Clients with lard.bundle set may have pushed objects in bundles only.
+    if( !ret && !bundles )
+    {
+        std::vector<const char*> missing;
+        for( auto& v : orphans )
+        {
+            if( !HasObject( v ) ) missing.emplace_back( v );
+        }
+        if( !missing.empty() )
+        {
+            printf( "Looking for %zu missing objects in bundles\n", missing.size() );
+            ret = PullBundles( missing ).empty();
+        }
+    }
+
+    // Deferred objects may have been completed by a later transfer. Corrupted ones are dropped, so that their
+    // placeholders stay in the worktree.
+    for( auto& v : deferred )
+    {
+        if( m_placeholderObjects.find( v ) == m_placeholderObjects.end() || verifyObject( v ) ) continue;
+        fprintf( stderr, "Object %s is corrupted, removing\n", v );
+        unlink( GetObjectFn( v ) );
+        m_placeholderObjects.erase( v );
+        ret = false;
+    }
 
-    Checkout();
+    std::vector<const char*> objects;
+    for( auto& v : m_placeholderObjects )
+    {
+        objects.emplace_back( v.first );
+    }
+    for( auto& v : objects )
+    {
+        RestoreObject( v );
+    }
+    FinishCheckout();
+    Evict( false );
 
     if( recurseSubmodules )
     {
@@ -546,14 +1555,103 @@ void Lard::Push( int argc, char** argv )
 {
     Setup();
     bool all = checkarg( argc, argv, "--all" ) != -1;
-    const auto catalog = ListDirectory( m_objdir );
     const auto referenced = ReferencedObjects( all, false, nullptr );
-    const auto files = Intersect( catalog, referenced );
+    const auto files = ProbeObjects( referenced, true );
 
-    const auto cmd = GetRsyncCommand( true );
-    if( !ExecuteRsync( cmd, files ) )
+    const bool useManifest = GetConfigBool( "lard.manifest", true );
+    Manifest manifest;
+    const bool hasManifest = useManifest && FetchManifest( manifest );
+    const auto delta = hasManifest ? NotInManifest( files, manifest ) : files;
+    if( hasManifest )
     {
-        exit( 1 );
+        printf( "Objects to push: %zu (%zu already on remote)\n", delta.size(), files.size() - delta.size() );
+        if( delta.empty() ) return;
+    }
+
+    const auto individual = GetConfigBool( "lard.bundle", false ) ? PushBundles( delta ) : delta;
+    Progress progress( "Pushing", individual.size() );
+    std::map<std::string, std::vector<const char*>> loose;
+    std::vector<const char*> packed;
+    for( auto& v : individual )
+    {
+        const auto fn = FindObjectFile( v );
+        if( fn )
+        {
+            loose[std::string( fn, strrchr( fn, '/' ) - fn )].emplace_back( v );
+        }
+        else
+        {
+            packed.emplace_back( v );
+        }
+    }
+    for( auto& v : loose )
+    {
+        const auto cmd = GetRsyncCommand( true, v.first.c_str() );
+        if( !ExecuteRsync( cmd, v.second, nullptr, nullptr, &progress ) )
+        {
+            exit( 1 );
+        }
+    }
+    if( !packed.empty() )
+    {
+        // rsync needs files, extract packed objects to a staging directory.
+        const auto staging = m_fatdir + "/staging";
+        CreateDirStruct( staging );
+        bool ok = true;
+        for( auto& v : packed )
+        {
+            const auto fn = staging + "/" + v;
+            FILE* f = fopen( fn.c_str(), "wb" );
+            ok = f && WriteObject( v, fileno( f ) ) >= 0;
+            if( f ) fclose( f );
+            if( !ok ) break;
+        }
+        if( ok )
+        {
+            const auto cmd = GetRsyncCommand( true, staging.c_str() );
+            ok = ExecuteRsync( cmd, packed, nullptr, nullptr, &progress );
+        }
+        for( auto& v : packed )
+        {
+            unlink( ( staging + "/" + v ).c_str() );
+        }
+        if( !ok )
+        {
+            exit( 1 );
+        }
+    }
+
+    progress.Finish();
+
+    if( useManifest )
+    {
+        // Someone else may have pushed in the meantime. Merge with the current remote state to not lose their objects.
+        Manifest current;
+        if( FetchManifest( current ) )
+        {
+            manifest.Merge( current );
+            manifest.Add( delta );
+        }
+        else if( !hasManifest )
+        {
+            // Objects pushed here are only a part of the remote, a new manifest must list all of them.
+            std::vector<const char*> remote;
+            if( !ListRemoteObjects( remote ) )
+            {
+                fprintf( stderr, "Cannot list remote objects, manifest not created\n" );
+                return;
+            }
+            manifest.Add( remote );
+            manifest.Add( delta );
+        }
+        else
+        {
+            manifest.Add( delta );
+        }
+        if( !UploadManifest( manifest ) )
+        {
+            exit( 1 );
+        }
     }
 }
 
@@ -578,6 +1676,8 @@ void Lard::AssertInitDone()
 
 const char* Lard::CalcSha1( const char* ptr, size_t size ) const
 {
+    TRACE_SCOPE( "hash" );
+    Trace::Count( Trace::BytesHashed, size );
     unsigned char sha1[20];
     SHA1( (const unsigned char*)ptr, size, sha1 );
     return Sha1ToHex( sha1 );
@@ -585,25 +1685,19 @@ const char* Lard::CalcSha1( const char* ptr, size_t size ) const
 
 const char* Lard::Sha1ToHex( const unsigned char sha1[20] ) const
 {
-    static char ret[41] = {};
-    for( int i=0; i<20; i++ )
-    {
-        sprintf( ret+i*2, "%02x", sha1[i] );
-    }
+    thread_local static char ret[41];
+    StringHelpers::Sha1ToHex( sha1, ret );
     return ret;
 }
 
-bool Lard::Decode( const char* data, const char*& sha1, size_t& size, bool errOnFail )
+// Data must be GitFatMagic bytes long. Returned hash is valid until the next call on the same thread.
+bool Lard::Decode( const char* data, const char*& sha1, uint64_t& size, bool errOnFail )
 {
-    enum { MagicLen = 12 };
-    static const char magic[MagicLen+1] = "#$# git-fat ";
-    static char retbuf[41] = {};
+    thread_local static char retbuf[41];
 
-    if( memcmp( data, magic, MagicLen ) == 0 )
+    if( Codec::DecodePlaceholder( data, GitFatMagic, retbuf, size ) )
     {
-        memcpy( retbuf, data + MagicLen, 40 );
         sha1 = retbuf;
-        size = atoi( data + MagicLen + 41 );
         DBGPRINT( "Decoded git-fat string: hash " << sha1 << ", size: " << size );
         return true;
     }
@@ -620,25 +1714,27 @@ bool Lard::Decode( const char* data, const char*& sha1, size_t& size, bool errOn
     }
 }
 
-const char* Lard::Encode( const char* sha1, size_t size )
+const char* Lard::Encode( const char* sha1, uint64_t size )
 {
-    static char ret[GitFatMagic+1];
-    sprintf( ret, "#$# git-fat %s %20zu\n", sha1, size );
+    thread_local static char ret[GitFatMagic+1];
+    Codec::EncodePlaceholder( sha1, size, ret );
     return ret;
 }
 
 const char* Lard::GetFatObjectSha1( const char* fn )
 {
+    TRACE_SCOPE( "placeholder read" );
     struct stat sb;
     if( stat( fn, &sb ) != 0 ) return nullptr;
     if( sb.st_size != GitFatMagic ) return nullptr;
 
+    Trace::Count( Trace::Files );
     char buf[GitFatMagic];
     FILE* f = fopen( fn, "rb" );
     verify( fread( buf, 1, GitFatMagic, f ) == GitFatMagic );
     fclose( f );
 
-    size_t size;
+    uint64_t size;
     const char* sha1;
     if( !Decode( buf, sha1, size ) )
         return nullptr;
@@ -646,73 +1742,869 @@ const char* Lard::GetFatObjectSha1( const char* fn )
     return sha1;
 }
 
-const char* Lard::GetObjectFn( const char* sha1 ) const
+// Object referenced by a placeholder blob, or nullptr if the blob is not a placeholder.
+const char* Lard::GetBlobObject( const char* blob )
 {
-    static char fn[1024];
-    sprintf( fn, "%s/%s", m_objdir.c_str(), sha1 );
-    return fn;
+    // Only blobs of placeholder size are cached, other files would make the cache grow with the whole repository.
+    auto it = m_placeholderBlobs.find( blob );
+    if( it == m_placeholderBlobs.end() )
+    {
+        TRACE_SCOPE( "placeholder blob read" );
+        const char* sha1 = nullptr;
+        char buf[GitFatMagic];
+        uint64_t size;
+        const auto res = ReadPlaceholderBlob( blob, buf );
+        if( res < 0 ) return nullptr;
+        if( res > 0 && Decode( buf, sha1, size ) )
+        {
+            sha1 = Buffer::Store( sha1, 40 );
+        }
+        it = m_placeholderBlobs.emplace( Buffer::Store( blob, 20 ), sha1 ).first;
+    }
+    return it->second;
 }
 
-std::vector<const char*> Lard::GetRsyncCommand( bool push ) const
+// Returns fat object of a placeholder file, given its indexed blob and position in the index (-1 if not indexed).
+// The file is only accessed if its blob is a placeholder and cached stat data says it was a placeholder when indexed.
+const char* Lard::GetPlaceholderSha1( const char* fn, const char* blob, int pos )
 {
-    std::vector<const char*> ret = { "-v", "--progress", "--ignore-existing", "--from0", "--files-from=-" };
-
-    std::string cfgPath = std::string( GetGitWorkTree() ) + "/.gitfat";
+    if( pos < 0 ) return GetFatObjectSha1( fn );
 
-    const char *remote, *sshuser = nullptr, *sshport = nullptr, *options = nullptr;
-    auto cs = NewConfigSet();
-    ConfigSetAddFile( cs, cfgPath.c_str() );
-    if( !GetConfigSetKey( "rsync.remote", &remote, cs ) )
+    // Restored files and files not managed by git-fat are indexed with their real size. Zero size means no or racy
+    // stat data. Neither the blob nor the file is read, which saves open, read and close.
+    const auto indexSize = GetIndexFileSize( pos );
+    if( indexSize != 0 && indexSize != GitFatMagic )
     {
-        fprintf( stderr, "No rsync.remote in %s", cfgPath.c_str() );
-        exit( 1 );
+        m_syscallsAvoided += 3;
+        Trace::Count( Trace::SyscallsAvoided, 3 );
+        return nullptr;
     }
-    GetConfigSetKey( "rsync.sshport", &sshport, cs );
-    GetConfigSetKey( "rsync.sshuser", &sshuser, cs );
-    GetConfigSetKey( "rsync.options", &options, cs );
 
-    if( sshport || sshuser )
+    const bool cached = m_placeholderBlobs.find( blob ) != m_placeholderBlobs.end();
+    const auto object = GetBlobObject( blob );
+    if( !object ) return nullptr;
+
+    // Unchanged placeholder has the contents of its blob, which is already decoded. A single lstat replaces open,
+    // read and close, unless the blob had to be read.
+    if( indexSize == GitFatMagic && IsIndexFileClean( pos, fn ) )
     {
-        std::ostringstream ss;
-        ss << "--rsh=ssh";
-        if( sshport )
-        {
-            ss << " -p ";
-            ss << sshport;
-        }
-        if( sshuser )
+        if( cached )
         {
-            ss << " -l ";
-            ss << sshuser;
+            m_syscallsAvoided += 2;
+            Trace::Count( Trace::SyscallsAvoided, 2 );
         }
-        ret.emplace_back( strdup( ss.str().c_str() ) );
+        return object;
     }
 
-    if( options )
-    {
-        StringHelpers::split( options, std::back_inserter( ret ) );
-    }
+    return GetFatObjectSha1( fn );
+}
 
-    if( push )
+// Writes fat objects to stdout. In batch modes object names are read from stdin, like in git cat-file. Output for
+// each object is "<sha1> fat <size>" followed by contents and a newline (--batch only), or "<sha1> missing".
+void Lard::CatFat( int argc, char** argv )
+{
+    const bool batch = checkarg( argc, argv, "--batch" ) != -1;
+    const bool check = checkarg( argc, argv, "--batch-check" ) != -1;
+    const bool buffer = checkarg( argc, argv, "--buffer" ) != -1;
+
+    if( !batch && !check )
+    {
+        if( argc != 1 || argv[0][0] == '-' )
+        {
+            fprintf( stderr, "Usage: git lard cat-fat <object> | --batch | --batch-check [--buffer]\n" );
+            exit( 1 );
+        }
+        if( !StringHelpers::IsObjectName( argv[0] ) || WriteObject( argv[0], STDOUT_FILENO ) < 0 )
+        {
+            fprintf( stderr, "Object %s not found\n", argv[0] );
+            exit( 1 );
+        }
+        TouchObject( argv[0] );
+        return;
+    }
+
+    char* line = nullptr;
+    size_t cap = 0;
+    ssize_t len;
+    while( ( len = getline( &line, &cap, stdin ) ) > 0 )
+    {
+        if( line[len-1] == '\n' ) line[--len] = '\0';
+        if( !StringHelpers::IsObjectName( line ) || !HasObject( line ) )
+        {
+            printf( "%s missing\n", line );
+        }
+        else
+        {
+            const auto size = GetObjectSize( line );
+            printf( "%s fat %" PRIu64 "\n", line, size );
+            if( batch )
+            {
+                // Contents go directly from the object file to stdout.
+                fflush( stdout );
+                if( WriteObject( line, STDOUT_FILENO ) != (int64_t)size )
+                {
+                    fprintf( stderr, "Cannot read object %s\n", line );
+                    exit( 1 );
+                }
+                putchar( '\n' );
+            }
+            TouchObject( line );
+        }
+        // Readers waiting for each response before sending next request must not be blocked.
+        if( !buffer ) fflush( stdout );
+    }
+    free( line );
+}
+
+void Lard::Repack( int argc, char** argv )
+{
+    Setup();
+    const bool all = checkarg( argc, argv, "-a" ) != -1 || checkarg( argc, argv, "--all" ) != -1;
+    const auto threshold = GetConfigSize( "lard.packThreshold", 1024 * 1024 );
+
+    std::vector<const char*> loose;
+    for( auto& v : ListDirectory( m_objdir ) )
+    {
+        if( StringHelpers::IsObjectName( v ) && GetFileSize( GetObjectFn( v ) ) < threshold )
+        {
+            loose.emplace_back( v );
+        }
+    }
+
+    std::vector<size_t> packs;
+    if( all && GetPacks().size() > 1 )
+    {
+        for( size_t i=0; i<GetPacks().size(); i++ )
+        {
+            packs.emplace_back( i );
+        }
+    }
+
+    if( loose.empty() && packs.empty() )
+    {
+        printf( "Nothing to repack\n" );
+        return;
+    }
+
+    printf( "Packing %zu loose objects and %zu packs\n", loose.size(), packs.size() );
+    if( !WritePack( loose, packs, {} ) )
+    {
+        exit( 1 );
+    }
+}
+
+// Writes a new pack containing given loose objects and contents of given packs, except objects in drop. Packed
+// loose objects and source packs are removed afterwards.
+bool Lard::WritePack( const std::vector<const char*>& loose, const std::vector<size_t>& packs, const set_str& drop )
+{
+    CreateDirStruct( m_packdir );
+
+    // Names of packed objects are only needed while writing, a repack of all packs may add millions of them.
+    ArenaScope scope( Buffer::Local() );
+    set_str added;
+    FatPackWriter writer( m_packdir, "pack" );
+    for( auto& idx : packs )
+    {
+        const auto& pack = GetPacks()[idx];
+        if( !pack.Check() )
+        {
+            fprintf( stderr, "Invalid pack %s, run git lard verify\n", pack.Base().c_str() );
+            return false;
+        }
+        for( size_t i=0; i<pack.Count(); i++ )
+        {
+            const auto entry = pack.Entries() + i;
+            char hex[41];
+            StringHelpers::Sha1ToHex( entry->sha1, hex );
+            if( drop.find( hex ) != drop.end() || added.find( hex ) != added.end() ) continue;
+            if( !writer.Add( hex, pack.Data( entry ), entry->size ) ) return false;
+            added.emplace( Buffer::Store( hex, 40 ) );
+        }
+    }
+    for( auto& v : loose )
+    {
+        if( drop.find( v ) != drop.end() || added.find( v ) != added.end() ) continue;
+        FileMap<char> f( GetObjectFn( v ) );
+        if( !writer.Add( v, f, f.Size() ) ) return false;
+        added.emplace( v );
+    }
+
+    std::string base;
+    if( writer.Count() > 0 )
+    {
+        if( !writer.Finish() ) return false;
+        base = writer.Base();
+        printf( "Written %s (%zu objects, %" PRIu64 " bytes)\n", base.c_str(), writer.Count(), writer.Size() );
+    }
+
+    std::vector<std::string> obsolete;
+    for( auto& idx : packs )
+    {
+        // Identical contents result in the same pack name.
+        if( GetPacks()[idx].Base() != base )
+        {
+            obsolete.emplace_back( GetPacks()[idx].Base() );
+        }
+    }
+    m_packs.clear();
+    m_packsLoaded = false;
+    for( auto& v : obsolete )
+    {
+        unlink( ( v + ".idx" ).c_str() );
+        unlink( ( v + ".pack" ).c_str() );
+    }
+    for( auto& v : loose )
+    {
+        unlink( GetObjectFn( v ) );
+    }
+    return true;
+}
+
+const std::vector<FatPack>& Lard::GetPacks() const
+{
+    if( !m_packsLoaded )
+    {
+        m_packsLoaded = true;
+        // Taken before listing, a pack added meanwhile is picked up by the next reload.
+        struct stat st;
+        m_packsTime = stat( m_packdir.c_str(), &st ) == 0 ? st.st_mtim : timespec {};
+        for( auto& v : ListFatPacks( m_packdir ) )
+        {
+            FatPack pack( v );
+            if( pack.IsValid() && pack.HasData() )
+            {
+                m_packs.emplace_back( std::move( pack ) );
+            }
+            else
+            {
+                fprintf( stderr, "Ignoring invalid pack %s\n", v.c_str() );
+            }
+        }
+    }
+    return m_packs;
+}
+
+// Loads packs added to the pack directory since the last load, e.g. by a repack in another process. Loaded packs are
+// kept, even if they were removed, as the caller may still use their data. Returns true if a pack was added.
+bool Lard::ReloadPacks() const
+{
+    if( !m_packsLoaded ) return !GetPacks().empty();
+    struct stat st;
+    if( stat( m_packdir.c_str(), &st ) != 0 ) return false;
+    if( st.st_mtim.tv_sec == m_packsTime.tv_sec && st.st_mtim.tv_nsec == m_packsTime.tv_nsec ) return false;
+    m_packsTime = st.st_mtim;
+
+    bool added = false;
+    for( auto& v : ListFatPacks( m_packdir ) )
+    {
+        if( std::any_of( m_packs.begin(), m_packs.end(), [&v]( const FatPack& pack ) { return pack.Base() == v; } ) ) continue;
+        FatPack pack( v );
+        if( pack.IsValid() && pack.HasData() )
+        {
+            m_packs.emplace_back( std::move( pack ) );
+            added = true;
+        }
+    }
+    return added;
+}
+
+const FatPackEntry* Lard::FindPacked( const char* sha1, const FatPack*& pack ) const
+{
+    for( auto& v : GetPacks() )
+    {
+        const auto entry = v.Find( sha1 );
+        if( entry )
+        {
+            pack = &v;
+            return entry;
+        }
+    }
+    return nullptr;
+}
+
+// Loose objects and packed objects, optionally including objects from alternates.
+set_str Lard::ListObjects( bool alternates ) const
+{
+    TraceScope trace( "catalog scan" );
+    std::vector<const char*> cached;
+    if( QueryDaemon( alternates ? "objects 1" : "objects 0", cached ) )
+    {
+        return set_str( cached.begin(), cached.end() );
+    }
+
+    auto ret = ListDirectory( m_objdir );
+    if( alternates )
+    {
+        for( auto& v : GetAlternates() )
+        {
+            for( auto& obj : ListDirectory( v ) )
+            {
+                ret.emplace( obj );
+            }
+        }
+    }
+    // Pack indexes are converted in one pass, strings of objects already listed are left unused.
+    for( auto& pack : GetPacks() )
+    {
+        if( pack.Count() == 0 ) continue;
+        auto hex = Buffer::Local().Alloc( pack.Count() * 41 );
+        Codec::HexEncodeBatch( pack.Entries()->sha1, sizeof( FatPackEntry ), pack.Count(), hex );
+        for( size_t i=0; i<pack.Count(); i++, hex += 41 )
+        {
+            ret.emplace( hex );
+        }
+    }
+    trace.Arg( "objects", ret.size() );
+    return ret;
+}
+
+// Lists the local store on a worker thread, so that the I/O bound scan overlaps a revision walk done by the caller.
+// Lazily loaded state comes from git configuration, which is not thread safe, so it is loaded before.
+std::thread Lard::ScanObjects( set_str& catalog ) const
+{
+    GetAlternates();
+    GetPacks();
+    return std::thread( [this, &catalog]() { catalog = ListObjects(); } );
+}
+
+// Objects which are (or are not) in the store, alternates included. Commands which don't care about unreferenced
+// objects look up each one instead of listing the whole store.
+std::vector<const char*> Lard::ProbeObjects( const set_str& objects, bool present ) const
+{
+    TraceScope trace( "object probe" );
+    std::vector<const char*> ret;
+    for( auto& v : objects )
+    {
+        if( HasObject( v ) == present )
+        {
+            ret.emplace_back( v );
+        }
+    }
+    trace.Arg( "objects", objects.size() );
+    return ret;
+}
+
+const std::vector<std::string>& Lard::GetAlternates() const
+{
+    if( !m_alternatesLoaded )
+    {
+        m_alternatesLoaded = true;
+        m_hardlink = GetConfigBool( "lard.hardlink", false );
+        const auto alternates = GetConfigString( "lard.alternates" );
+        if( alternates )
+        {
+            const char* ptr = alternates;
+            while( *ptr )
+            {
+                auto end = strchr( ptr, ':' );
+                if( !end ) end = ptr + strlen( ptr );
+                if( end != ptr )
+                {
+                    m_alternates.emplace_back( ptr, end );
+                    DBGPRINT( "Alternate: " << m_alternates.back() );
+                }
+                ptr = *end ? end + 1 : end;
+            }
+        }
+        m_fetchAlternates = m_alternates.size();
+        const auto cold = GetConfigString( "lard.coldStore" );
+        if( cold )
+        {
+            m_alternates.emplace_back( cold );
+        }
+    }
+    return m_alternates;
+}
+
+// Objects are fetched to the first alternate, if it's writable, so that other clones sharing it can use them.
+std::string Lard::GetFetchDir() const
+{
+    const auto& alternates = GetAlternates();
+    if( m_fetchAlternates > 0 && access( alternates[0].c_str(), W_OK ) == 0 )
+    {
+        return alternates[0];
+    }
+    return m_objdir;
+}
+
+// Returns path to a loose object in local store or in one of alternates, or nullptr if there is no such file.
+const char* Lard::FindObjectFile( const char* sha1 ) const
+{
+    struct stat sb;
+    const auto fn = GetObjectFn( sha1 );
+    if( stat( fn, &sb ) == 0 ) return fn;
+
+    thread_local static char altfn[1024];
+    for( auto& v : GetAlternates() )
+    {
+        sprintf( altfn, "%s/%s", v.c_str(), sha1 );
+        if( stat( altfn, &sb ) == 0 ) return altfn;
+    }
+    return nullptr;
+}
+
+bool Lard::HasObject( const char* sha1 ) const
+{
+    if( FindObjectFile( sha1 ) ) return true;
+    const FatPack* pack;
+    return FindPacked( sha1, pack ) != nullptr;
+}
+
+uint64_t Lard::GetObjectSize( const char* sha1 ) const
+{
+    const auto fn = FindObjectFile( sha1 );
+    if( fn ) return GetFileSize( fn );
+    const FatPack* pack;
+    const auto entry = FindPacked( sha1, pack );
+    return entry ? entry->size : 0;
+}
+
+bool Lard::MapObject( const char* sha1, FileMap<char>& map ) const
+{
+    const auto fn = FindObjectFile( sha1 );
+    if( fn )
+    {
+        map = FileMap<char>( fn, true );
+        // Empty objects cannot be mapped.
+        return map || ( map.Size() == 0 && Exists( fn ) );
+    }
+    const FatPack* pack;
+    const auto entry = FindPacked( sha1, pack );
+    if( !entry ) return false;
+    map = FileMap<char>( FileMapPtrs { pack->Data( entry ), entry->size } );
+    return true;
+}
+
+static int64_t WriteFd( int fd, const char* ptr, uint64_t size )
+{
+    uint64_t left = size;
+    while( left > 0 )
+    {
+        const auto wr = write( fd, ptr, left );
+        if( wr < 0 && errno == EINTR ) continue;
+        if( wr <= 0 ) break;
+        ptr += wr;
+        left -= wr;
+    }
+    return size - left;
+}
+
+static int64_t CopyFd( int in, int out, uint64_t size )
+{
+    TRACE_SCOPE( "copy" );
+    Trace::Count( Trace::BytesCopied, size );
+    uint64_t left = size;
+#ifdef __linux__
+    while( left > 0 )
+    {
+        const auto rd = copy_file_range( in, nullptr, out, nullptr, left, 0 );
+        if( rd <= 0 ) break;
+        left -= rd;
+    }
+    // Output is not a regular file on the same filesystem, e.g. a pipe to git. Input must be a regular file.
+    while( left > 0 )
+    {
+        const auto rd = sendfile( out, in, nullptr, left );
+        if( rd < 0 && errno == EINTR ) continue;
+        if( rd <= 0 ) break;
+        left -= rd;
+    }
+    if( left == 0 ) return size;
+#endif
+    // Fall back to plain copy when the kernel cannot copy the data.
+    enum { ChunkSize = 64 * 1024 };
+    char buf[ChunkSize];
+    while( left > 0 )
+    {
+        const auto rd = read( in, buf, std::min<uint64_t>( left, ChunkSize ) );
+        if( rd <= 0 || WriteFd( out, buf, rd ) != rd ) break;
+        left -= rd;
+    }
+    return size - left;
+}
+
+// Copies a regular file to a new file. Holes of the input are skipped and stay holes in the output.
+static bool CopySparse( int in, int out, const struct stat& sb )
+{
+    if( !Sparse::MayHaveHoles( sb ) ) return CopyFd( in, out, sb.st_size ) == sb.st_size;
+    const auto extents = Sparse::DataExtents( in, sb.st_size );
+    for( auto& v : extents )
+    {
+        if( lseek( in, v.offset, SEEK_SET ) < 0 || lseek( out, v.offset, SEEK_SET ) < 0 ) return false;
+        if( CopyFd( in, out, v.size ) != (int64_t)v.size ) return false;
+    }
+    Sparse::AddSaved( sb.st_size - Sparse::DataSize( extents ) );
+    return ftruncate( out, sb.st_size ) == 0;
+}
+
+// Copies data until end of input. Data stays in kernel if either side is a pipe.
+static bool CopyStream( int in, int out )
+{
+#ifdef __linux__
+    for(;;)
+    {
+        const auto rd = splice( in, nullptr, out, nullptr, 1024 * 1024, SPLICE_F_MOVE | SPLICE_F_MORE );
+        if( rd == 0 ) return true;
+        if( rd > 0 ) continue;
+        if( errno == EINTR ) continue;
+        if( errno != EINVAL ) return false;
+        break;
+    }
+#endif
+    enum { ChunkSize = 64 * 1024 };
+    char buf[ChunkSize];
+    for(;;)
+    {
+        const auto rd = read( in, buf, ChunkSize );
+        if( rd < 0 && errno == EINTR ) continue;
+        if( rd == 0 ) return true;
+        if( rd < 0 || WriteFd( out, buf, rd ) != rd ) return false;
+    }
+}
+
+// Renames a file, copying it if source and destination are on different filesystems.
+static bool MoveFile( const char* src, const char* dst )
+{
+    if( rename( src, dst ) == 0 ) return true;
+    if( errno != EXDEV ) return false;
+
+    const auto tmp = std::string( dst ) + ".tmp";
+    const auto in = open( src, O_RDONLY );
+    if( in < 0 ) return false;
+    const auto out = open( tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+    struct stat sb;
+    bool ok = out >= 0 && fstat( in, &sb ) == 0 && CopyFd( in, out, sb.st_size ) == sb.st_size;
+    close( in );
+    if( out >= 0 ) ok = close( out ) == 0 && ok;
+    if( !ok || rename( tmp.c_str(), dst ) != 0 )
+    {
+        unlink( tmp.c_str() );
+        return false;
+    }
+    unlink( src );
+    return true;
+}
+
+// Writes contents of an object to fd. Returns number of bytes written, or -1 if object is not available.
+int64_t Lard::WriteObject( const char* sha1, int fd ) const
+{
+    const auto fn = FindObjectFile( sha1 );
+    const auto srcfd = fn ? open( fn, O_RDONLY ) : -1;
+    if( srcfd >= 0 )
+    {
+        struct stat sb;
+        const auto ret = fstat( srcfd, &sb ) == 0 ? CopyFd( srcfd, fd, sb.st_size ) : -1;
+        close( srcfd );
+        return ret;
+    }
+    if( !m_packsLoaded )
+    {
+        const auto ret = WriteDaemonObject( sha1, fd );
+        if( ret >= 0 ) return ret;
+    }
+    const FatPack* pack;
+    const auto entry = FindPacked( sha1, pack );
+    if( !entry ) return -1;
+    TRACE_SCOPE( "copy" );
+    Trace::Count( Trace::BytesCopied, entry->size );
+    return WriteFd( fd, pack->Data( entry ), entry->size );
+}
+
+// Writes a packed object located by the daemon, which saves loading all pack indexes. Returns -1 if the daemon is not
+// running or the object is not packed.
+int64_t Lard::WriteDaemonObject( const char* sha1, int fd ) const
+{
+    std::vector<const char*> reply;
+    const auto req = std::string( "object " ) + sha1;
+    if( !QueryDaemon( req.c_str(), reply ) || reply.size() != 1 ) return -1;
+    uint64_t offset, size;
+    int len = 0;
+    if( sscanf( reply[0], "%" SCNu64 " %" SCNu64 " %n", &offset, &size, &len ) != 2 || len == 0 ) return -1;
+    const auto srcfd = open( reply[0] + len, O_RDONLY );
+    if( srcfd < 0 ) return -1;
+    const auto ret = lseek( srcfd, offset, SEEK_SET ) == (off_t)offset ? CopyFd( srcfd, fd, size ) : -1;
+    close( srcfd );
+    return ret;
+}
+
+// Creates worktree file with object contents. Loose objects are cloned if the filesystem supports it, otherwise holes
+// and blocks of zeros are not written. Objects from alternates are hard linked if lard.hardlink is set; note that
+// such files must not be modified in place.
+bool Lard::MaterializeObject( const char* sha1, const char* fn ) const
+{
+    TRACE_SCOPE( "materialize" );
+    Trace::Count( Trace::Files );
+    const auto src = FindObjectFile( sha1 );
+    if( src && m_hardlink && strncmp( src, m_objdir.c_str(), m_objdir.size() ) != 0 )
+    {
+        unlink( fn );
+        if( link( src, fn ) == 0 ) return true;
+        DBGPRINT( "Cannot hard link " << src << " to " << fn << ": " << strerror( errno ) );
+    }
+
+    int fd = open( fn, O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+    if( fd < 0 ) return false;
+    bool ok = false;
+    const auto srcfd = src ? open( src, O_RDONLY ) : -1;
+    if( srcfd >= 0 )
+    {
+        struct stat sb;
+        if( fstat( srcfd, &sb ) == 0 )
+        {
+#ifdef FICLONE
+            ok = ioctl( fd, FICLONE, srcfd ) == 0;
+#endif
+            ok = ok || CopySparse( srcfd, fd, sb );
+        }
+        close( srcfd );
+    }
+    else
+    {
+        const FatPack* pack;
+        const auto entry = FindPacked( sha1, pack );
+        if( entry )
+        {
+            TRACE_SCOPE( "copy" );
+            Trace::Count( Trace::BytesCopied, entry->size );
+            ok = Sparse::Write( fd, pack->Data( entry ), 0, entry->size ) && ftruncate( fd, entry->size ) == 0;
+        }
+    }
+    close( fd );
+    return ok;
+}
+
+AccessLog* Lard::GetAccessLog()
+{
+    if( !m_access )
+    {
+        m_access = std::make_unique<AccessLog>( m_fatdir + "/access" );
+    }
+    return m_access.get();
+}
+
+// Access times are only tracked when store size is limited.
+void Lard::TouchObject( const char* sha1 )
+{
+    if( !m_accessChecked )
+    {
+        m_accessChecked = true;
+        if( GetConfigSize( "lard.maxStoreSize", 0 ) > 0 ) GetAccessLog();
+    }
+    if( m_access ) m_access->Touch( sha1 );
+}
+
+const char* Lard::GetObjectFn( const char* sha1 ) const
+{
+    thread_local static char fn[1024];
+    sprintf( fn, "%s/%s", m_objdir.c_str(), sha1 );
+    return fn;
+}
+
+bool Lard::GetConfigBool( const char* key, bool def ) const
+{
+    std::string cfgPath = std::string( GetGitWorkTree() ) + "/.gitfat";
+
+    int val;
+    auto cs = NewConfigSet();
+    ConfigSetAddFile( cs, cfgPath.c_str() );
+    const bool ret = GetConfigSetBool( key, &val, cs ) ? val != 0 : def;
+    FreeConfigSet( cs );
+    return ret;
+}
+
+const char* Lard::GetConfigString( const char* key ) const
+{
+    std::string cfgPath = std::string( GetGitWorkTree() ) + "/.gitfat";
+
+    const char* val;
+    auto cs = NewConfigSet();
+    ConfigSetAddFile( cs, cfgPath.c_str() );
+    const char* ret = GetConfigSetKey( key, &val, cs ) && val ? strdup( val ) : nullptr;
+    FreeConfigSet( cs );
+    return ret;
+}
+
+uint64_t Lard::GetConfigSize( const char* key, uint64_t def ) const
+{
+    std::string cfgPath = std::string( GetGitWorkTree() ) + "/.gitfat";
+
+    unsigned long val;
+    auto cs = NewConfigSet();
+    ConfigSetAddFile( cs, cfgPath.c_str() );
+    const uint64_t ret = GetConfigSetUlong( key, &val, cs ) ? val : def;
+    FreeConfigSet( cs );
+    return ret;
+}
+
+// Checks if rsync.remote is set, without reading other options.
+bool Lard::HasRsyncRemote() const
+{
+    std::string cfgPath = std::string( GetGitWorkTree() ) + "/.gitfat";
+    const char* remote;
+    auto cs = NewConfigSet();
+    ConfigSetAddFile( cs, cfgPath.c_str() );
+    const bool ret = GetConfigSetKey( "rsync.remote", &remote, cs );
+    FreeConfigSet( cs );
+    return ret;
+}
+
+// Appends ssh and user options to cmd, returns remote location.
+const char* Lard::GetRsyncRemote( std::vector<const char*>& cmd ) const
+{
+    std::string cfgPath = std::string( GetGitWorkTree() ) + "/.gitfat";
+
+    const char *remote, *sshuser = nullptr, *sshport = nullptr, *options = nullptr;
+    auto cs = NewConfigSet();
+    ConfigSetAddFile( cs, cfgPath.c_str() );
+    if( !GetConfigSetKey( "rsync.remote", &remote, cs ) )
+    {
+        fprintf( stderr, "No rsync.remote in %s", cfgPath.c_str() );
+        exit( 1 );
+    }
+    GetConfigSetKey( "rsync.sshport", &sshport, cs );
+    GetConfigSetKey( "rsync.sshuser", &sshuser, cs );
+    GetConfigSetKey( "rsync.options", &options, cs );
+
+    if( sshport || sshuser )
+    {
+        std::ostringstream ss;
+        ss << "--rsh=ssh";
+        if( sshport )
+        {
+            ss << " -p ";
+            ss << sshport;
+        }
+        if( sshuser )
+        {
+            ss << " -l ";
+            ss << sshuser;
+        }
+        cmd.emplace_back( strdup( ss.str().c_str() ) );
+    }
+
+    if( options )
+    {
+        StringHelpers::split( options, std::back_inserter( cmd ) );
+    }
+
+    remote = strdup( remote );
+    FreeConfigSet( cs );
+    return remote;
+}
+
+std::vector<const char*> Lard::GetRsyncCommand( bool push, const char* localDir ) const
+{
+    // Without verbose output transfers are reported by the progress status line.
+    std::vector<const char*> ret = { "--ignore-existing", "--sparse", "--from0", "--files-from=-" };
+    if( Progress::IsVerbose() )
+    {
+        ret.insert( ret.begin(), { "-v", "--progress" } );
+    }
+
+    const char* remote = GetRsyncRemote( ret );
+    const std::string local = localDir ? localDir : m_objdir;
+
+    if( push )
     {
-        ret.emplace_back( strdup( ( m_objdir + "/" ).c_str() ) );
+        ret.emplace_back( strdup( ( local + "/" ).c_str() ) );
         ret.emplace_back( strdup( ( std::string( remote ) + "/" ).c_str() ) );
     }
     else
     {
         ret.emplace_back( strdup( ( std::string( remote ) + "/" ).c_str() ) );
-        ret.emplace_back( strdup( ( m_objdir + "/" ).c_str() ) );
+        ret.emplace_back( strdup( ( local + "/" ).c_str() ) );
     }
 
     printf( "%s %s\n", push ? "Pushing to" : "Pulling from", remote );
-    FreeConfigSet( cs );
     return ret;
 }
 
+// Transfers metadata files (manifest, bundles) which are stored relative to .git/fat locally. A file missing on the
+// remote side removes the local copy (--delete-missing-args), so stale data is never used.
+std::vector<const char*> Lard::GetRsyncMetaCommand( bool push ) const
+{
+    std::vector<const char*> ret = { "-q", "--delete-missing-args", "--from0", "--files-from=-" };
+
+    const char* remote = GetRsyncRemote( ret );
+
+    if( push )
+    {
+        ret.emplace_back( strdup( ( m_fatdir + "/" ).c_str() ) );
+        ret.emplace_back( strdup( ( std::string( remote ) + "/" ).c_str() ) );
+    }
+    else
+    {
+        ret.emplace_back( strdup( ( std::string( remote ) + "/" ).c_str() ) );
+        ret.emplace_back( strdup( ( m_fatdir + "/" ).c_str() ) );
+    }
+
+    return ret;
+}
+
+// Reads rsync output, reporting each completed transfer to onFile and progress. Other output is passed through. When no
+// output is pending, onIdle is called until it returns false.
+static void ReadRsyncOutput( int fd, const std::function<void(const char*)>& onFile, const std::function<bool()>& onIdle, Progress* progress )
+{
+    const auto markerLen = strlen( RsyncDoneMarker );
+    bool idle = (bool)onIdle;
+    std::string line;
+    char buf[4096];
+    for(;;)
+    {
+        if( idle )
+        {
+            struct pollfd pfd = { fd, POLLIN, 0 };
+            if( poll( &pfd, 1, 0 ) == 0 )
+            {
+                idle = onIdle();
+                continue;
+            }
+        }
+        const auto rd = read( fd, buf, sizeof( buf ) );
+        if( rd < 0 && errno == EINTR ) continue;
+        if( rd <= 0 ) break;
+        for( ssize_t i=0; i<rd; i++ )
+        {
+            line += buf[i];
+            if( buf[i] != '\n' && buf[i] != '\r' ) continue;
+            if( line.compare( 0, markerLen, RsyncDoneMarker ) == 0 )
+            {
+                // Format is "marker bytes name".
+                line.pop_back();
+                const auto sp = line.find( ' ', markerLen );
+                if( sp != std::string::npos )
+                {
+                    const auto name = line.c_str() + sp + 1;
+                    if( !progress || Progress::IsVerbose() ) printf( "%s\n", name );
+                    if( progress ) progress->Add( strtoull( line.c_str() + markerLen, nullptr, 10 ) );
+                    if( onFile ) onFile( name );
+                }
+            }
+            else
+            {
+                fwrite( line.data(), 1, line.size(), stdout );
+            }
+            line.clear();
+        }
+        fflush( stdout );
+    }
+    fwrite( line.data(), 1, line.size(), stdout );
+}
+
 bool Lard::ExecuteRsync( const std::vector<const char*>& cmd, const std::vector<const char*>& files ) const
 {
+    return ExecuteRsync( cmd, files, nullptr, nullptr );
+}
+
+bool Lard::ExecuteRsync( const std::vector<const char*>& cmd, const std::vector<const char*>& files, const std::function<void(const char*)>& onFile, const std::function<bool()>& onIdle, Progress* progress ) const
+{
+    TraceScope trace( "rsync" );
+    trace.Arg( "files", files.size() );
+    const bool capture = onFile || progress;
     int fd[2];
+    int out[2];
     verify( pipe( fd ) == 0 );
+    if( capture ) verify( pipe( out ) == 0 );
     auto pid = fork();
     assert( pid != -1 );
     if( pid == 0 ) // child
@@ -720,13 +2612,26 @@ bool Lard::ExecuteRsync( const std::vector<const char*>& cmd, const std::vector<
         close( fd[1] );
         dup2( fd[0], STDIN_FILENO );
         close( fd[0] );
+        if( capture )
+        {
+            close( out[0] );
+            dup2( out[1], STDOUT_FILENO );
+            close( out[1] );
+        }
 
-        char** args = new char*[cmd.size()+1];
+        // First argument is the program name, options start after it.
+        char** args = new char*[cmd.size()+3];
         auto ptr = args;
+        *ptr++ = strdup( "rsync" );
         for( auto& v : cmd )
         {
             *ptr++ = strdup( v );
         }
+        if( capture )
+        {
+            // %b makes rsync log the file after transfer is done, instead of before.
+            *ptr++ = strdup( ( std::string( "--out-format=" ) + RsyncDoneMarker + "%b %n" ).c_str() );
+        }
         *ptr = nullptr;
         if( execvp( "rsync", args ) == -1 )
         {
@@ -736,13 +2641,28 @@ bool Lard::ExecuteRsync( const std::vector<const char*>& cmd, const std::vector<
     else // parent
     {
         close( fd[0] );
-        for( auto& v : files )
+        auto writeFiles = [fd, &files] {
+            for( auto& v : files )
+            {
+                write( fd[1], v, strlen( v ) + 1 );
+            }
+            close( fd[1] );
+        };
+        if( capture )
         {
-            write( fd[1], v, strlen( v ) + 1 );
+            // rsync may block on output before it reads the whole file list.
+            close( out[1] );
+            std::thread writer( writeFiles );
+            ReadRsyncOutput( out[0], onFile, onIdle, progress );
+            writer.join();
+            close( out[0] );
+        }
+        else
+        {
+            writeFiles();
         }
-        close( fd[1] );
         int status;
-        int ret = wait( &status );
+        int ret = waitpid( pid, &status, 0 );
         if( ret == -1 || !WIFEXITED( status ) || WEXITSTATUS( status ) != 0 )
         {
             fprintf( stderr, "Error executing rsync!\n" );
@@ -752,8 +2672,289 @@ bool Lard::ExecuteRsync( const std::vector<const char*>& cmd, const std::vector<
     return true;
 }
 
-set_str Lard::ReferencedObjects( bool all, bool nowalk, const char* rev )
+// Refreshes the local copy of remote manifest. Returns false if the remote doesn't have one.
+bool Lard::FetchManifest( Manifest& manifest ) const
+{
+    const auto cmd = GetRsyncMetaCommand( false );
+    if( !ExecuteRsync( cmd, { "manifest" } ) )
+    {
+        return false;
+    }
+    return manifest.Load( m_manifest.c_str() );
+}
+
+// Lists objects in the remote directory. Objects in bundles are not included.
+bool Lard::ListRemoteObjects( std::vector<const char*>& objects ) const
+{
+    TRACE_SCOPE( "remote listing" );
+    std::vector<const char*> cmd = { "rsync", "--list-only" };
+    const char* remote = GetRsyncRemote( cmd );
+    cmd.emplace_back( strdup( ( std::string( remote ) + "/" ).c_str() ) );
+    cmd.emplace_back( nullptr );
+
+    int out[2];
+    verify( pipe( out ) == 0 );
+    auto pid = fork();
+    assert( pid != -1 );
+    if( pid == 0 ) // child
+    {
+        close( out[0] );
+        dup2( out[1], STDOUT_FILENO );
+        close( out[1] );
+        execvp( "rsync", (char**)cmd.data() );
+        exit( 1 );
+    }
+
+    close( out[1] );
+    FILE* f = fdopen( out[0], "r" );
+    char line[4096];
+    while( fgets( line, sizeof( line ), f ) )
+    {
+        // Lines are "<mode> <size> <date> <time> <name>". Object names have no spaces.
+        auto end = line + strlen( line );
+        while( end > line && ( end[-1] == '\n' || end[-1] == '\r' ) ) *--end = '\0';
+        const auto name = strrchr( line, ' ' );
+        if( line[0] == '-' && name && StringHelpers::IsObjectName( name + 1 ) )
+        {
+            objects.emplace_back( Buffer::Store( name + 1, 40 ) );
+        }
+    }
+    fclose( f );
+    int status;
+    return waitpid( pid, &status, 0 ) != -1 && WIFEXITED( status ) && WEXITSTATUS( status ) == 0;
+}
+
+bool Lard::UploadManifest( const Manifest& manifest ) const
+{
+    if( !manifest.Save( m_manifest.c_str() ) )
+    {
+        return false;
+    }
+    const auto cmd = GetRsyncMetaCommand( true );
+    return ExecuteRsync( cmd, { "manifest" } );
+}
+
+// Packs objects smaller than lard.bundleThreshold into bundles of up to lard.bundleSize bytes and sends them to
+// the remote bundles directory. Returns objects which should be transferred individually.
+std::vector<const char*> Lard::PushBundles( const std::vector<const char*>& objects ) const
+{
+    TRACE_SCOPE( "push bundles" );
+    const auto threshold = GetConfigSize( "lard.bundleThreshold", 1024 * 1024 );
+    const auto target = GetConfigSize( "lard.bundleSize", 64 * 1024 * 1024 );
+
+    CreateDirStruct( m_bundledir );
+
+    std::vector<const char*> large;
+    std::vector<const char*> bundleFiles;
+    std::vector<std::string> bundles;
+    std::unique_ptr<FatPackWriter> writer;
+    size_t numSmall = 0;
+
+    auto flush = [&] {
+        if( !writer ) return;
+        if( !writer->Finish() )
+        {
+            exit( 1 );
+        }
+        const auto& base = writer->Base();
+        const auto name = "bundles/" + base.substr( base.rfind( '/' ) + 1 );
+        bundleFiles.emplace_back( strdup( ( name + ".pack" ).c_str() ) );
+        bundleFiles.emplace_back( strdup( ( name + ".idx" ).c_str() ) );
+        bundles.emplace_back( base );
+        writer.reset();
+    };
+
+    for( auto& v : objects )
+    {
+        FileMap<char> f;
+        verify( MapObject( v, f ) );
+        const auto size = f.Size();
+        if( size >= threshold )
+        {
+            large.emplace_back( v );
+            continue;
+        }
+
+        if( !writer )
+        {
+            writer = std::make_unique<FatPackWriter>( m_bundledir, "bundle" );
+        }
+        if( !writer->Add( v, f, size ) )
+        {
+            exit( 1 );
+        }
+        numSmall++;
+        if( writer->Size() >= target )
+        {
+            flush();
+        }
+    }
+    flush();
+
+    if( !bundleFiles.empty() )
+    {
+        printf( "Pushing %zu small objects in %zu bundles\n", numSmall, bundles.size() );
+        const auto cmd = GetRsyncMetaCommand( true );
+        if( !ExecuteRsync( cmd, bundleFiles ) )
+        {
+            exit( 1 );
+        }
+        // Keep the index, it's needed to find objects when pulling.
+        for( auto& v : bundles )
+        {
+            unlink( ( v + ".pack" ).c_str() );
+        }
+    }
+
+    return large;
+}
+
+// Fetches bundles containing any of the requested objects and unpacks them to the object store. Returns objects
+// that were not found in any bundle.
+std::vector<const char*> Lard::PullBundles( const std::vector<const char*>& objects ) const
+{
+    TRACE_SCOPE( "pull bundles" );
+    CreateDirStruct( m_bundledir );
+
+    std::vector<const char*> cmd = { "-r", "-q", "--delete", "--include=*.idx", "--exclude=*" };
+    const char* remote = GetRsyncRemote( cmd );
+    cmd.emplace_back( strdup( ( std::string( remote ) + "/bundles/" ).c_str() ) );
+    cmd.emplace_back( strdup( ( m_bundledir + "/" ).c_str() ) );
+    if( !ExecuteRsync( cmd, {} ) )
+    {
+        return objects;
+    }
+
+    const auto bundles = ListFatPacks( m_bundledir );
+
+    std::vector<std::vector<const char*>> wanted( bundles.size() );
+    std::vector<const char*> remaining;
+    {
+        std::vector<FatPack> packs;
+        packs.reserve( bundles.size() );
+        for( auto& v : bundles )
+        {
+            packs.emplace_back( v );
+        }
+        for( auto& v : objects )
+        {
+            size_t i = 0;
+            while( i < packs.size() && !packs[i].Find( v ) ) i++;
+            if( i == packs.size() )
+            {
+                remaining.emplace_back( v );
+            }
+            else
+            {
+                wanted[i].emplace_back( v );
+            }
+        }
+    }
+
+    std::vector<const char*> files;
+    for( size_t i=0; i<bundles.size(); i++ )
+    {
+        if( !wanted[i].empty() )
+        {
+            const auto name = "bundles/" + bundles[i].substr( bundles[i].rfind( '/' ) + 1 ) + ".pack";
+            files.emplace_back( strdup( name.c_str() ) );
+        }
+    }
+    if( files.empty() ) return remaining;
+
+    printf( "Fetching %zu bundles\n", files.size() );
+    const auto metaCmd = GetRsyncMetaCommand( false );
+    if( !ExecuteRsync( metaCmd, files ) )
+    {
+        fprintf( stderr, "Cannot fetch bundles\n" );
+        return objects;
+    }
+
+    // Unpacked objects go where pull fetches loose objects.
+    const auto fetchDir = GetFetchDir();
+    size_t unpacked = 0;
+    for( size_t i=0; i<bundles.size(); i++ )
+    {
+        if( wanted[i].empty() ) continue;
+        FatPack pack( bundles[i] );
+        for( auto& v : wanted[i] )
+        {
+            const auto entry = pack.HasData() ? pack.Find( v ) : nullptr;
+            if( !entry )
+            {
+                remaining.emplace_back( v );
+                continue;
+            }
+            const auto data = pack.Data( entry );
+            if( strncmp( CalcSha1( data, entry->size ), v, 40 ) != 0 )
+            {
+                fprintf( stderr, "Corrupted object %s in %s.pack\n", v, bundles[i].c_str() );
+                remaining.emplace_back( v );
+                continue;
+            }
+            if( !StoreObject( v, data, entry->size, nullptr, fetchDir.c_str() ) )
+            {
+                exit( 1 );
+            }
+            unpacked++;
+        }
+        unlink( ( bundles[i] + ".pack" ).c_str() );
+    }
+    printf( "Unpacked %zu objects from bundles\n", unpacked );
+
+    return remaining;
+}
+
+// Objects are stored sparse, in the local store unless another directory is given. If extents are given, only these
+// parts of data are read.
+bool Lard::StoreObject( const char* sha1, const char* data, uint64_t size, const std::vector<Sparse::Extent>* extents, const char* dir ) const
+{
+    TRACE_SCOPE( "store object" );
+    Trace::Count( Trace::Files );
+    Trace::Count( Trace::BytesCopied, size );
+    const std::string fn = std::string( dir ? dir : m_objdir.c_str() ) + "/" + sha1;
+    const auto tmp = fn + ".tmp";
+    const auto fd = open( tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+    if( fd < 0 )
+    {
+        fprintf( stderr, "Cannot open %s\n", tmp.c_str() );
+        return false;
+    }
+    bool ok = true;
+    if( extents )
+    {
+        for( auto& v : *extents )
+        {
+            ok = ok && Sparse::Write( fd, data + v.offset, v.offset, v.size );
+        }
+        Sparse::AddSaved( size - Sparse::DataSize( *extents ) );
+    }
+    else
+    {
+        ok = Sparse::Write( fd, data, 0, size );
+    }
+    ok = ok && ftruncate( fd, size ) == 0;
+    ok = close( fd ) == 0 && ok;
+    if( !ok || rename( tmp.c_str(), fn.c_str() ) != 0 )
+    {
+        fprintf( stderr, "Cannot write %s\n", fn.c_str() );
+        unlink( tmp.c_str() );
+        return false;
+    }
+    return true;
+}
+
+set_str Lard::ReferencedObjects( bool all, bool nowalk, const char* rev, bool sparse )
 {
+    std::vector<const char*> cached;
+    char request[64];
+    sprintf( request, "referenced %d %d", all ? 1 : 0, nowalk ? 1 : 0 );
+    if( !rev && !sparse && !m_pathspec && QueryDaemon( request, cached ) )
+    {
+        return set_str( cached.begin(), cached.end() );
+    }
+
+    TraceScope trace( "rev walk" );
     set_str ret;
     ptr_set_str = &ret;
 
@@ -779,15 +2980,24 @@ set_str Lard::ReferencedObjects( bool all, bool nowalk, const char* rev )
         AddRevHead( revs );
     }
     PrepareRevWalk( revs );
-    GetFatObjectsFromRevs( revs, nowalk, cb );
+    if( m_pathspec )
+    {
+        ParsePathspec( m_prefix.c_str(), m_pathspec );
+    }
+    int filter = 0;
+    if( m_pathspec ) filter |= FilterPathspec;
+    if( sparse ) filter |= FilterSparse;
+    GetFatObjectsFromRevs( revs, nowalk, filter, cb );
     FreeRevs( revs );
 
+    trace.Arg( "objects", ret.size() );
     return ret;
 }
 
 set_str Lard::ReferencedObjectsCwd()
 {
-    ParsePathspec( m_prefix.c_str() );
+    TraceScope trace( "placeholder scan" );
+    ParsePathspec( m_prefix.c_str(), m_pathspec );
     if( ReadCache() < 0 )
     {
         fprintf( stderr, "index file corrupt\n" );
@@ -796,14 +3006,61 @@ set_str Lard::ReferencedObjectsCwd()
 
     set_str ret;
     ptr_set_str = &ret;
+    // Placeholder blobs decoded by the daemon are not read again.
+    std::vector<const char*> cached;
+    if( m_placeholderBlobs.empty() && QueryDaemon( "placeholders", cached ) )
+    {
+        for( auto& v : cached )
+        {
+            unsigned char blob[20];
+            if( strlen( v ) != 81 || !StringHelpers::HexToSha1( v, blob ) ) continue;
+            m_placeholderBlobs.emplace( Buffer::Store( (const char*)blob, 20 ), v[41] == '-' ? nullptr : v + 41 );
+        }
+    }
+
+    static Lard* lard;
+    lard = this;
 
-    auto cb = []( const char* fn, const char* localFn, const char* fileSha ) {
-        const char* sha1 = GetFatObjectSha1( fn );
+    auto cb = []( const char* fn, const char* localFn, const char* fileSha, int pos ) {
+        const char* sha1 = lard->GetPlaceholderSha1( fn, fileSha, pos );
         if( !sha1 ) return;
         ptr_set_str->emplace( Buffer::Store( sha1, 40 ) );
     };
 
     ListFiles( cb );
+    DBGPRINT( "Placeholder scan: " << ret.size() << " objects, " << m_syscallsAvoided << " syscalls avoided" );
+    trace.Arg( "objects", ret.size() );
+    return ret;
+}
+
+// Objects of all placeholder blobs in the index, whatever the state of worktree files and the pathspec. This includes
+// staged files which were never committed.
+set_str Lard::IndexObjects()
+{
+    TraceScope trace( "index objects" );
+    ParsePathspec( nullptr, nullptr );
+    if( ReadCache() < 0 )
+    {
+        fprintf( stderr, "index file corrupt\n" );
+        exit( 1 );
+    }
+
+    set_str ret;
+    ptr_set_str = &ret;
+    static Lard* lard;
+    lard = this;
+
+    auto cb = []( const char* fn, const char* localFn, const char* fileSha, int pos ) {
+        const char* sha1 = lard->GetBlobObject( fileSha );
+        if( sha1 ) ptr_set_str->emplace( sha1 );
+    };
+
+    ListFiles( cb );
+    if( m_pathspec )
+    {
+        ParsePathspec( m_prefix.c_str(), m_pathspec );
+    }
+    trace.Arg( "objects", ret.size() );
     return ret;
 }
 
@@ -829,6 +3086,7 @@ map_strsize Lard::GenLargeBlobs( int threshold )
         }
     };
 
+    TRACE_SCOPE( "blob scan" );
     const auto time0 = std::chrono::high_resolution_clock::now();
     rev_info* revs = NewRevInfo();
     AddRevAll( revs );
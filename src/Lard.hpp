@@ -1,21 +1,35 @@
 #ifndef __LARD_HPP__
 #define __LARD_HPP__
 
+#include <functional>
+#include <memory>
 #include <stdint.h>
+#include <sys/stat.h>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#include "Arena.hpp"
+#include "FatPack.hpp"
+#include "FileMap.hpp"
+#include "Sparse.hpp"
 #include "StringHelpers.hpp"
 
+class AccessLog;
+class Manifest;
+class Progress;
+
 using set_str = std::unordered_set<const char*, StringHelpers::hash, StringHelpers::equal_to>;
 using map_strsize = std::unordered_map<const char*, size_t, StringHelpers::hash, StringHelpers::equal_to>;
 
 class Lard
 {
+    friend class LardRepository;
+
 public:
-    Lard( const char* commandName );
+    Lard( const char* commandName, int* nongit = nullptr );
     ~Lard();
 
     void Init( int argc, char** argv );
@@ -23,11 +37,18 @@ public:
     void GC();
     void Verify();
     void Find( int argc, char** argv );
-    void Clean();
+    void Clean( int argc, char** argv );
     void Smudge();
     void Checkout();
+    void PostCheckout( int argc, char** argv );
+    void PostMerge();
     void Pull( int argc, char** argv );
     void Push( int argc, char** argv );
+    void Repack( int argc, char** argv );
+    void Evict( bool verbose );
+    void Daemon();
+    void CatFat( int argc, char** argv );
+    void Add( int argc, char** argv );
 
     void Submodule( int argc, char** argv );
 
@@ -36,7 +57,9 @@ private:
     bool IsInitDone();
     void AssertInitDone();
 
-    void FilterClean( FILE* in, FILE* out );
+    void FilterClean( FILE* in, FILE* out, const char* path = nullptr );
+    bool IngestFile( const char* path, const struct stat& st, char* sha1, bool& stored ) const;
+    set_str GetStatus( bool all, std::vector<const char*>& orphans, std::vector<const char*>& garbage );
     void SubmoduleUpdate( bool recurse = false );
     void SubmoduleInit( bool recurse = false );
     void ExecuteOnSubmodules( char** args, const char* msg );
@@ -45,23 +68,115 @@ private:
     const char* CalcSha1( const char* ptr, size_t size ) const;
     const char* Sha1ToHex( const unsigned char sha1[20] ) const;
 
-    static bool Decode( const char* data, const char*& sha1, size_t& size, bool errOnFail = false );
-    static const char* Encode( const char* sha1, size_t size );
+    static bool Decode( const char* data, const char*& sha1, uint64_t& size, bool errOnFail = false );
+    static const char* Encode( const char* sha1, uint64_t size );
     static const char* GetFatObjectSha1( const char* fn );
+    const char* GetBlobObject( const char* blob );
+    const char* GetPlaceholderSha1( const char* fn, const char* blob, int pos );
     const char* GetObjectFn( const char* sha1 ) const;
 
-    std::vector<const char*> GetRsyncCommand( bool push ) const;
+    AccessLog* GetAccessLog();
+    void TouchObject( const char* sha1 );
+
+    const std::vector<FatPack>& GetPacks() const;
+    bool ReloadPacks() const;
+    const FatPackEntry* FindPacked( const char* sha1, const FatPack*& pack ) const;
+    bool WritePack( const std::vector<const char*>& loose, const std::vector<size_t>& packs, const set_str& drop );
+
+    const std::vector<std::string>& GetAlternates() const;
+    std::string GetFetchDir() const;
+    const char* FindObjectFile( const char* sha1 ) const;
+
+    bool QueryDaemon( const char* request, std::vector<const char*>& result ) const;
+    bool ListPlaceholderBlobs( FILE* out );
+
+    set_str ListObjects( bool alternates = false ) const;
+    std::thread ScanObjects( set_str& catalog ) const;
+    std::vector<const char*> ProbeObjects( const set_str& objects, bool present ) const;
+    bool HasObject( const char* sha1 ) const;
+    uint64_t GetObjectSize( const char* sha1 ) const;
+    bool MapObject( const char* sha1, FileMap<char>& map ) const;
+    int64_t WriteObject( const char* sha1, int fd ) const;
+    int64_t WriteDaemonObject( const char* sha1, int fd ) const;
+    bool MaterializeObject( const char* sha1, const char* fn ) const;
+
+    const char* GetConfigString( const char* key ) const;
+    bool GetConfigBool( const char* key, bool def ) const;
+    uint64_t GetConfigSize( const char* key, uint64_t def ) const;
+
+    bool HasRsyncRemote() const;
+    const char* GetRsyncRemote( std::vector<const char*>& cmd ) const;
+    std::vector<const char*> GetRsyncCommand( bool push, const char* localDir = nullptr ) const;
+    std::vector<const char*> GetRsyncMetaCommand( bool push ) const;
     bool ExecuteRsync( const std::vector<const char*>& cmd, const std::vector<const char*>& files ) const;
+    bool ExecuteRsync( const std::vector<const char*>& cmd, const std::vector<const char*>& files, const std::function<void(const char*)>& onFile, const std::function<bool()>& onIdle, Progress* progress = nullptr ) const;
+
+    bool FetchManifest( Manifest& manifest ) const;
+    bool UploadManifest( const Manifest& manifest ) const;
+    bool ListRemoteObjects( std::vector<const char*>& objects ) const;
 
-    set_str ReferencedObjects( bool all, bool nowalk, const char* rev );
+    std::vector<const char*> PushBundles( const std::vector<const char*>& objects ) const;
+    std::vector<const char*> PullBundles( const std::vector<const char*>& objects ) const;
+    bool StoreObject( const char* sha1, const char* data, uint64_t size, const std::vector<Sparse::Extent>* extents = nullptr, const char* dir = nullptr ) const;
+
+    void CollectPlaceholders( const char* from = nullptr, const char* to = nullptr );
+    void CheckoutPlaceholders( const char* from, const char* to );
+    void RestorePlaceholders();
+    void FlushPlaceholders();
+    void InstallHook( const char* name );
+    bool RestoreObject( const char* sha1 );
+    void FinishCheckout();
+    void AttributeMissingBlobs();
+
+    set_str ReferencedObjects( bool all, bool nowalk, const char* rev, bool sparse = false );
     set_str ReferencedObjectsCwd();
+    set_str IndexObjects();
     map_strsize GenLargeBlobs( int threshold );
 
     std::string m_prefix;
     std::string m_gitdir;
+    std::string m_fatdir;
     std::string m_objdir;
+    std::string m_manifest;
+    std::string m_bundledir;
+    std::string m_packdir;
+
+    const char** m_pathspec;
+
+    mutable std::vector<FatPack> m_packs;
+    mutable bool m_packsLoaded;
+    mutable struct timespec m_packsTime;
+
+    mutable std::vector<std::string> m_alternates;
+    mutable bool m_alternatesLoaded;
+    mutable size_t m_fetchAlternates;
+    mutable bool m_hardlink;
+
+    std::unique_ptr<AccessLog> m_access;
+    bool m_accessChecked;
+
+    struct Placeholder
+    {
+        const char* fn;
+        const char* localFn;
+        const char* blob;
+    };
+
+    std::vector<Placeholder> m_placeholders;
+    std::unordered_map<const char*, std::vector<size_t>, StringHelpers::hash, StringHelpers::equal_to> m_placeholderObjects;
+    std::vector<const char*> m_restored;
+    Arena m_placeholderNames;
+    size_t m_checkoutBatch;
+    size_t m_restoredCount;
+    size_t m_missingCount;
+    Progress* m_progress;
+    shaset m_missingBlobs;
+
+    std::unordered_map<const char*, const char*, StringHelpers::hash_sha, StringHelpers::equal_to_sha> m_placeholderBlobs;
+    size_t m_syscallsAvoided;
 
     const char* m_commandName;
+    bool m_isDaemon;
 };
 
 #endif
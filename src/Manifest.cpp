@@ -0,0 +1,108 @@
+#include <algorithm>
+#include <iterator>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+
+#include "Codec.hpp"
+#include "Debug.hpp"
+#include "FileMap.hpp"
+#include "Filesystem.hpp"
+#include "Manifest.hpp"
+#include "StringHelpers.hpp"
+
+static const char ManifestMagic[8] = { 'L', 'A', 'R', 'D', 'M', 'F', '0', '1' };
+
+Manifest::Manifest()
+{
+}
+
+bool Manifest::Load( const char* fn )
+{
+    m_data.clear();
+    if( !Exists( fn ) ) return false;
+
+    const auto size = GetFileSize( fn );
+    if( size < sizeof( ManifestMagic ) || ( size - sizeof( ManifestMagic ) ) % sizeof( Entry ) != 0 )
+    {
+        fprintf( stderr, "Invalid manifest file %s\n", fn );
+        return false;
+    }
+
+    FileMap<char> f( fn, true );
+    if( !f ) return false;
+    if( memcmp( f, ManifestMagic, sizeof( ManifestMagic ) ) != 0 )
+    {
+        fprintf( stderr, "Invalid manifest file %s\n", fn );
+        return false;
+    }
+
+    const auto num = ( size - sizeof( ManifestMagic ) ) / sizeof( Entry );
+    m_data.resize( num );
+    memcpy( m_data.data(), f + sizeof( ManifestMagic ), num * sizeof( Entry ) );
+
+    DBGPRINT( "Loaded manifest " << fn << ": " << num << " objects" );
+    return true;
+}
+
+bool Manifest::Save( const char* fn ) const
+{
+    std::string tmp = std::string( fn ) + ".tmp";
+    FILE* f = fopen( tmp.c_str(), "wb" );
+    if( !f )
+    {
+        fprintf( stderr, "Cannot open %s\n", tmp.c_str() );
+        return false;
+    }
+    bool ok = fwrite( ManifestMagic, 1, sizeof( ManifestMagic ), f ) == sizeof( ManifestMagic );
+    if( ok && !m_data.empty() )
+    {
+        ok = fwrite( m_data.data(), sizeof( Entry ), m_data.size(), f ) == m_data.size();
+    }
+    ok = fclose( f ) == 0 && ok;
+    if( !ok || rename( tmp.c_str(), fn ) != 0 )
+    {
+        fprintf( stderr, "Cannot write manifest %s\n", fn );
+        unlink( tmp.c_str() );
+        return false;
+    }
+    return true;
+}
+
+static inline bool EntryLess( const uint8_t* l, const uint8_t* r )
+{
+    return memcmp( l, r, 20 ) < 0;
+}
+
+bool Manifest::Contains( const char* sha1 ) const
+{
+    Entry e;
+    if( !StringHelpers::HexToSha1( sha1, e.sha1 ) ) return false;
+    const auto it = std::lower_bound( m_data.begin(), m_data.end(), e, []( const Entry& l, const Entry& r ) { return EntryLess( l.sha1, r.sha1 ); } );
+    return it != m_data.end() && memcmp( it->sha1, e.sha1, 20 ) == 0;
+}
+
+void Manifest::Add( const std::vector<const char*>& objects )
+{
+    if( objects.empty() ) return;
+    const auto base = m_data.size();
+    m_data.resize( base + objects.size() );
+    const auto added = Codec::HexDecodeBatch( objects.data(), objects.size(), m_data[base].sha1, sizeof( Entry ) );
+    m_data.resize( base + added );
+
+    auto less = []( const Entry& l, const Entry& r ) { return EntryLess( l.sha1, r.sha1 ); };
+    auto equal = []( const Entry& l, const Entry& r ) { return memcmp( l.sha1, r.sha1, 20 ) == 0; };
+    std::sort( m_data.begin() + base, m_data.end(), less );
+    std::inplace_merge( m_data.begin(), m_data.begin() + base, m_data.end(), less );
+    m_data.erase( std::unique( m_data.begin(), m_data.end(), equal ), m_data.end() );
+}
+
+void Manifest::Merge( const Manifest& other )
+{
+    auto less = []( const Entry& l, const Entry& r ) { return EntryLess( l.sha1, r.sha1 ); };
+    std::vector<Entry> merged;
+    merged.reserve( m_data.size() + other.m_data.size() );
+    std::set_union( m_data.begin(), m_data.end(), other.m_data.begin(), other.m_data.end(), std::back_inserter( merged ), less );
+    std::swap( m_data, merged );
+}
@@ -0,0 +1,31 @@
+#ifndef __MANIFEST_HPP__
+#define __MANIFEST_HPP__
+
+#include <stdint.h>
+#include <vector>
+
+// Sorted list of binary object hashes known to be present on the remote.
+class Manifest
+{
+public:
+    Manifest();
+
+    bool Load( const char* fn );
+    bool Save( const char* fn ) const;
+
+    bool Contains( const char* sha1 ) const;
+    void Add( const std::vector<const char*>& objects );
+    void Merge( const Manifest& other );
+
+    size_t Size() const { return m_data.size(); }
+
+private:
+    struct Entry
+    {
+        uint8_t sha1[20];
+    };
+
+    std::vector<Entry> m_data;
+};
+
+#endif
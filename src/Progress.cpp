@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <unistd.h>
+
+#include "Progress.hpp"
+
+bool Progress::s_verbose = false;
+
+enum { UpdateInterval = 100 };
+
+static void FormatBytes( double bytes, char* out )
+{
+    static const char* units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+    int unit = 0;
+    while( bytes >= 1024 && unit < 4 )
+    {
+        bytes /= 1024;
+        unit++;
+    }
+    sprintf( out, unit == 0 ? "%.0f %s" : "%.1f %s", bytes, units[unit] );
+}
+
+Progress::Progress( const char* title, size_t total )
+    : m_title( title )
+    , m_total( total )
+    , m_files( 0 )
+    , m_bytes( 0 )
+    , m_start( std::chrono::steady_clock::now() )
+    , m_last( m_start )
+    , m_width( 0 )
+    , m_tty( !s_verbose && isatty( STDOUT_FILENO ) )
+    , m_finished( false )
+{
+}
+
+Progress::~Progress()
+{
+    Finish();
+}
+
+void Progress::Add( uint64_t bytes )
+{
+    m_files++;
+    m_bytes += bytes;
+    if( !m_tty ) return;
+    const auto now = std::chrono::steady_clock::now();
+    if( std::chrono::duration_cast<std::chrono::milliseconds>( now - m_last ).count() < UpdateInterval ) return;
+    m_last = now;
+    Print( false );
+}
+
+// Nothing is printed for operations which had nothing to do.
+void Progress::Finish()
+{
+    if( m_finished ) return;
+    m_finished = true;
+    if( m_files == 0 && m_width == 0 ) return;
+    Print( true );
+}
+
+void Progress::Print( bool done )
+{
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>( std::chrono::steady_clock::now() - m_start ).count() / 1000.0;
+    char bytes[32], rate[32];
+    FormatBytes( m_bytes, bytes );
+    FormatBytes( elapsed > 0 ? m_bytes / elapsed : 0, rate );
+
+    char line[256];
+    int len;
+    if( done )
+    {
+        len = sprintf( line, "%s: %zu files, %s in %.1f s (%s/s)", m_title, m_files, bytes, elapsed, rate );
+    }
+    else if( m_total > m_files && m_files > 0 )
+    {
+        const auto eta = (unsigned long)( elapsed * ( m_total - m_files ) / m_files );
+        len = sprintf( line, "%s: %zu/%zu files, %s, %s/s, ETA %lu:%02lu", m_title, m_files, m_total, bytes, rate, eta / 60, eta % 60 );
+    }
+    else
+    {
+        len = sprintf( line, "%s: %zu files, %s, %s/s", m_title, m_files, bytes, rate );
+    }
+
+    // Status line is overwritten in place, padded to clear the previous one.
+    if( m_tty )
+    {
+        printf( "\r%s%*s", line, m_width > (size_t)len ? int( m_width - len ) : 0, "" );
+        m_width = len;
+    }
+    else
+    {
+        printf( "%s", line );
+    }
+    if( done ) printf( "\n" );
+    fflush( stdout );
+}
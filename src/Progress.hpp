@@ -0,0 +1,43 @@
+#ifndef __PROGRESS_HPP__
+#define __PROGRESS_HPP__
+
+#include <chrono>
+#include <stddef.h>
+#include <stdint.h>
+
+// Reports progress of an operation on files. On a terminal a status line with files, bytes, throughput and ETA (when
+// the total is known) is redrawn at most 10 times per second. Otherwise only a summary is printed when done. Per-file
+// messages are printed by callers if verbose output was requested.
+class Progress
+{
+public:
+    Progress( const char* title, size_t total = 0 );
+    ~Progress();
+
+    Progress( const Progress& ) = delete;
+    Progress& operator=( const Progress& ) = delete;
+
+    void SetTotal( size_t total ) { m_total = total; }
+    void Add( uint64_t bytes );
+    void Finish();
+
+    static bool IsVerbose() { return s_verbose; }
+    static void SetVerbose( bool verbose ) { s_verbose = verbose; }
+
+private:
+    void Print( bool done );
+
+    const char* m_title;
+    size_t m_total;
+    size_t m_files;
+    uint64_t m_bytes;
+    std::chrono::steady_clock::time_point m_start;
+    std::chrono::steady_clock::time_point m_last;
+    size_t m_width;
+    bool m_tty;
+    bool m_finished;
+
+    static bool s_verbose;
+};
+
+#endif
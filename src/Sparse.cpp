@@ -0,0 +1,97 @@
+#include <algorithm>
+#include <atomic>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Sparse.hpp"
+#include "Trace.hpp"
+
+static std::atomic<uint64_t> s_saved( 0 );
+
+std::vector<Sparse::Extent> Sparse::DataExtents( int fd, uint64_t size )
+{
+    std::vector<Extent> ret;
+#if defined SEEK_DATA && defined SEEK_HOLE
+    bool ok = true;
+    uint64_t pos = 0;
+    while( pos < size )
+    {
+        const auto data = lseek( fd, pos, SEEK_DATA );
+        if( data < 0 )
+        {
+            // Nothing but a hole up to the end. Other errors mean the filesystem cannot tell.
+            ok = errno == ENXIO;
+            break;
+        }
+        if( (uint64_t)data >= size ) break;
+        auto hole = lseek( fd, data, SEEK_HOLE );
+        if( hole < 0 || (uint64_t)hole > size ) hole = size;
+        ret.emplace_back( Extent { (uint64_t)data, (uint64_t)hole - data } );
+        pos = hole;
+    }
+    lseek( fd, 0, SEEK_SET );
+    if( ok ) return ret;
+    ret.clear();
+#endif
+    if( size != 0 ) ret.emplace_back( Extent { 0, size } );
+    return ret;
+}
+
+uint64_t Sparse::DataSize( const std::vector<Extent>& extents )
+{
+    uint64_t ret = 0;
+    for( auto& v : extents ) ret += v.size;
+    return ret;
+}
+
+// Compares the data with itself shifted by one byte, which memcmp does at full speed.
+bool Sparse::IsZero( const char* ptr, size_t size )
+{
+    return size == 0 || ( ptr[0] == 0 && memcmp( ptr, ptr + 1, size - 1 ) == 0 );
+}
+
+static bool WriteAt( int fd, const char* ptr, uint64_t offset, uint64_t size )
+{
+    while( size > 0 )
+    {
+        const auto wr = pwrite( fd, ptr, size, offset );
+        if( wr < 0 && errno == EINTR ) continue;
+        if( wr <= 0 ) return false;
+        ptr += wr;
+        offset += wr;
+        size -= wr;
+    }
+    return true;
+}
+
+// Blocks are aligned to the file offset, so that skipped blocks become holes. Consecutive data blocks are written at
+// once.
+bool Sparse::Write( int fd, const char* ptr, uint64_t offset, uint64_t size )
+{
+    uint64_t pending = 0;
+    uint64_t pos = 0;
+    while( pos < size )
+    {
+        const auto len = std::min<uint64_t>( BlockSize - ( offset + pos ) % BlockSize, size - pos );
+        if( IsZero( ptr + pos, len ) )
+        {
+            if( !WriteAt( fd, ptr + pending, offset + pending, pos - pending ) ) return false;
+            AddSaved( len );
+            pending = pos + len;
+        }
+        pos += len;
+    }
+    return WriteAt( fd, ptr + pending, offset + pending, size - pending );
+}
+
+void Sparse::AddSaved( uint64_t size )
+{
+    s_saved.fetch_add( size, std::memory_order_relaxed );
+    Trace::Count( Trace::BytesSparse, size );
+}
+
+uint64_t Sparse::Saved()
+{
+    return s_saved.load( std::memory_order_relaxed );
+}
@@ -0,0 +1,39 @@
+#ifndef __SPARSE_HPP__
+#define __SPARSE_HPP__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <vector>
+
+// Sparse file support. Holes are found with SEEK_DATA/SEEK_HOLE, and blocks of zeros are not written, so that mostly
+// empty files (VM images, preallocated caches) take little space in the store and in the worktree.
+namespace Sparse
+{
+    enum { BlockSize = 4096 };
+
+    struct Extent
+    {
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    // Less space is allocated than the file size. Cheap check before looking for holes.
+    static inline bool MayHaveHoles( const struct stat& st ) { return (uint64_t)st.st_blocks * 512 < (uint64_t)st.st_size; }
+
+    // Data regions of a file of given size, in order. Without hole support the whole file is one extent.
+    std::vector<Extent> DataExtents( int fd, uint64_t size );
+    uint64_t DataSize( const std::vector<Extent>& extents );
+
+    bool IsZero( const char* ptr, size_t size );
+
+    // Writes size bytes at offset of a regular file, leaving blocks of zeros as holes. File size is not changed,
+    // the caller sets it with ftruncate. Returns false on write error.
+    bool Write( int fd, const char* ptr, uint64_t offset, uint64_t size );
+
+    // Bytes not written by this process, because they were holes or zeros.
+    void AddSaved( uint64_t size );
+    uint64_t Saved();
+}
+
+#endif
@@ -8,6 +8,7 @@
 #include <unordered_map>
 #include <unordered_set>
 #include "../xxHash/xxhash.h"
+#include "Codec.hpp"
 
 struct commit;
 
@@ -29,6 +30,25 @@ namespace StringHelpers
         }
     }
 
+    // The decoder reads 40 bytes, shorter strings are rejected first.
+    static inline bool HexToSha1( const char* hex, unsigned char* sha1 )
+    {
+        return strnlen( hex, 40 ) == 40 && Codec::HexDecode( hex, sha1 );
+    }
+
+    static inline void Sha1ToHex( const unsigned char* sha1, char* hex )
+    {
+        Codec::HexEncode( sha1, hex );
+        hex[40] = '\0';
+    }
+
+    // Object names come from users and file listings, and end up in paths.
+    static inline bool IsObjectName( const char* name )
+    {
+        unsigned char sha1[20];
+        return name && strnlen( name, 41 ) == 40 && HexToSha1( name, sha1 );
+    }
+
     template <class T>
     static inline void split( const char* s, T o )
     {
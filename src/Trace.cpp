@@ -0,0 +1,221 @@
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "Debug.hpp"
+#include "Trace.hpp"
+
+bool Trace::s_enabled = false;
+std::atomic<uint64_t> Trace::s_counters[Trace::NumCounters];
+
+static int s_fd = -1;
+static pid_t s_pid;
+static std::mutex s_lock;
+static std::string s_buf;
+static uint64_t s_countersTime;
+static std::atomic<int> s_nextTid( 1 );
+
+enum { FlushSize = 64 * 1024 };
+enum { CounterInterval = 10 * 1000 };
+
+// Debug messages (debug builds) show up as instant events.
+struct TraceDebugCallback : public DebugLog::Callback
+{
+    void OnDebugMessage( const char* msg ) override;
+};
+
+static TraceDebugCallback s_debugCallback;
+
+static int GetTid()
+{
+    thread_local static int tid = s_nextTid.fetch_add( 1 );
+    return tid;
+}
+
+static void AppendEscaped( const char* str )
+{
+    for( ; *str; str++ )
+    {
+        const auto c = (unsigned char)*str;
+        if( c == '"' || c == '\\' )
+        {
+            s_buf += '\\';
+            s_buf += c;
+        }
+        else if( c < 0x20 )
+        {
+            char tmp[8];
+            sprintf( tmp, "\\u%04x", c );
+            s_buf += tmp;
+        }
+        else
+        {
+            s_buf += c;
+        }
+    }
+}
+
+// Forked children inherit the buffer, but only the tracing process writes it.
+static void Flush()
+{
+    if( getpid() == s_pid && !s_buf.empty() )
+    {
+        const char* ptr = s_buf.data();
+        size_t left = s_buf.size();
+        while( left > 0 )
+        {
+            const auto wr = write( s_fd, ptr, left );
+            if( wr < 0 && errno == EINTR ) continue;
+            if( wr <= 0 ) break;
+            ptr += wr;
+            left -= wr;
+        }
+    }
+    s_buf.clear();
+}
+
+// Bytes read and written and syscall counts come from the kernel, so that they include work done inside libgit.
+static void EmitCounters( uint64_t now )
+{
+    char tmp[256];
+    const auto pid = (int)s_pid;
+    s_countersTime = now;
+
+#ifdef __linux__
+    unsigned long long rchar = 0, wchar = 0, syscr = 0, syscw = 0;
+    FILE* f = fopen( "/proc/self/io", "r" );
+    if( f )
+    {
+        char line[128];
+        while( fgets( line, sizeof( line ), f ) )
+        {
+            sscanf( line, "rchar: %llu", &rchar );
+            sscanf( line, "wchar: %llu", &wchar );
+            sscanf( line, "syscr: %llu", &syscr );
+            sscanf( line, "syscw: %llu", &syscw );
+        }
+        fclose( f );
+        sprintf( tmp, "{\"name\":\"io bytes\",\"ph\":\"C\",\"ts\":%llu,\"pid\":%d,\"args\":{\"read\":%llu,\"written\":%llu}},\n", (unsigned long long)now, pid, rchar, wchar );
+        s_buf += tmp;
+        sprintf( tmp, "{\"name\":\"syscalls\",\"ph\":\"C\",\"ts\":%llu,\"pid\":%d,\"args\":{\"read\":%llu,\"write\":%llu}},\n", (unsigned long long)now, pid, syscr, syscw );
+        s_buf += tmp;
+    }
+#endif
+
+    sprintf( tmp, "{\"name\":\"files\",\"ph\":\"C\",\"ts\":%llu,\"pid\":%d,\"args\":{\"files\":%llu}},\n", (unsigned long long)now, pid,
+        (unsigned long long)Trace::Get( Trace::Files ) );
+    s_buf += tmp;
+    sprintf( tmp, "{\"name\":\"data bytes\",\"ph\":\"C\",\"ts\":%llu,\"pid\":%d,\"args\":{\"hashed\":%llu,\"copied\":%llu,\"sparse\":%llu}},\n", (unsigned long long)now, pid,
+        (unsigned long long)Trace::Get( Trace::BytesHashed ),
+        (unsigned long long)Trace::Get( Trace::BytesCopied ),
+        (unsigned long long)Trace::Get( Trace::BytesSparse ) );
+    s_buf += tmp;
+    sprintf( tmp, "{\"name\":\"syscalls avoided\",\"ph\":\"C\",\"ts\":%llu,\"pid\":%d,\"args\":{\"placeholders\":%llu}},\n", (unsigned long long)now, pid,
+        (unsigned long long)Trace::Get( Trace::SyscallsAvoided ) );
+    s_buf += tmp;
+
+    struct rusage ru;
+    getrusage( RUSAGE_SELF, &ru );
+#ifdef __APPLE__
+    const auto peak = ru.ru_maxrss / 1024;
+#else
+    const auto peak = ru.ru_maxrss;
+#endif
+    sprintf( tmp, "{\"name\":\"peak RSS\",\"ph\":\"C\",\"ts\":%llu,\"pid\":%d,\"args\":{\"KiB\":%ld}},\n", (unsigned long long)now, pid, (long)peak );
+    s_buf += tmp;
+}
+
+void TraceDebugCallback::OnDebugMessage( const char* msg )
+{
+    char tmp[128];
+    std::lock_guard<std::mutex> lg( s_lock );
+    if( !Trace::IsEnabled() ) return;
+    s_buf += "{\"name\":\"";
+    AppendEscaped( msg );
+    sprintf( tmp, "\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%llu,\"pid\":%d,\"tid\":%d},\n", (unsigned long long)Trace::Now(), (int)s_pid, GetTid() );
+    s_buf += tmp;
+    if( s_buf.size() >= FlushSize ) Flush();
+}
+
+// The file is a JSON array without the closing bracket, which trace viewers accept. This allows many processes to
+// append to it.
+void Trace::Init( const char* process )
+{
+    const char* fn = getenv( "GIT_LARD_TRACE" );
+    if( !fn || !*fn || s_enabled ) return;
+
+    // Filters started together may all find an empty file. Only the process which creates it writes the header, at
+    // once, so that it precedes events of other processes.
+    s_fd = open( fn, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0666 );
+    const bool created = s_fd >= 0;
+    if( !created && errno == EEXIST )
+    {
+        s_fd = open( fn, O_WRONLY | O_APPEND | O_CLOEXEC );
+    }
+    if( s_fd < 0 )
+    {
+        fprintf( stderr, "Cannot open trace file %s: %s\n", fn, strerror( errno ) );
+        return;
+    }
+    s_pid = getpid();
+
+    if( created && write( s_fd, "[\n", 2 ) != 2 )
+    {
+        fprintf( stderr, "Cannot write trace file %s: %s\n", fn, strerror( errno ) );
+    }
+    s_buf += "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":";
+    s_buf += std::to_string( s_pid );
+    s_buf += ",\"args\":{\"name\":\"";
+    AppendEscaped( process );
+    s_buf += "\"}},\n";
+    EmitCounters( Now() );
+
+    s_enabled = true;
+    DebugLog::AddCallback( &s_debugCallback );
+    atexit( Finish );
+}
+
+void Trace::Finish()
+{
+    if( !s_enabled ) return;
+    DebugLog::RemoveCallback( &s_debugCallback );
+
+    std::lock_guard<std::mutex> lg( s_lock );
+    s_enabled = false;
+    EmitCounters( Now() );
+    Flush();
+    close( s_fd );
+    s_fd = -1;
+}
+
+uint64_t Trace::Now()
+{
+    // Steady clock is shared by all processes, so events of filter processes line up.
+    return std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+void Trace::Span( const char* name, uint64_t start, const char* argName, uint64_t arg )
+{
+    const auto now = Now();
+    char tmp[256];
+    std::lock_guard<std::mutex> lg( s_lock );
+    if( !s_enabled ) return;
+    if( argName )
+    {
+        sprintf( tmp, "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%d,\"args\":{\"%s\":%llu}},\n", name, (unsigned long long)start, (unsigned long long)( now - start ), (int)s_pid, GetTid(), argName, (unsigned long long)arg );
+    }
+    else
+    {
+        sprintf( tmp, "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%d},\n", name, (unsigned long long)start, (unsigned long long)( now - start ), (int)s_pid, GetTid() );
+    }
+    s_buf += tmp;
+    if( now - s_countersTime >= CounterInterval ) EmitCounters( now );
+    if( s_buf.size() >= FlushSize ) Flush();
+}
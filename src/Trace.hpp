@@ -0,0 +1,76 @@
+#ifndef __TRACE_HPP__
+#define __TRACE_HPP__
+
+#include <atomic>
+#include <stdint.h>
+
+#define TRACE_CONCAT2(a,b) a##b
+#define TRACE_CONCAT(a,b) TRACE_CONCAT2(a,b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT( __traceScope, __LINE__ )( name )
+
+// Chrome trace event output (chrome://tracing, ui.perfetto.dev), enabled by GIT_LARD_TRACE=<file>. Events of all
+// git-lard processes, e.g. filters run by git, are appended to the same file. When tracing is disabled, spans and
+// counters cost a single branch.
+class Trace
+{
+public:
+    enum Counter
+    {
+        Files,
+        BytesHashed,
+        BytesCopied,
+        BytesSparse,
+        SyscallsAvoided,
+        NumCounters
+    };
+
+    Trace() = delete;
+
+    static void Init( const char* process );
+    static void Finish();
+
+    static bool IsEnabled() { return s_enabled; }
+    static void Count( Counter c, uint64_t val = 1 ) { if( s_enabled ) s_counters[c].fetch_add( val, std::memory_order_relaxed ); }
+
+    static uint64_t Get( Counter c ) { return s_counters[c].load( std::memory_order_relaxed ); }
+
+    static uint64_t Now();
+    static void Span( const char* name, uint64_t start, const char* argName, uint64_t arg );
+
+private:
+    static bool s_enabled;
+    static std::atomic<uint64_t> s_counters[NumCounters];
+};
+
+class TraceScope
+{
+public:
+    TraceScope( const char* name )
+        : m_name( name )
+        , m_start( Trace::IsEnabled() ? Trace::Now() : 0 )
+        , m_argName( nullptr )
+    {
+    }
+
+    ~TraceScope()
+    {
+        if( m_start != 0 ) Trace::Span( m_name, m_start, m_argName, m_arg );
+    }
+
+    TraceScope( const TraceScope& ) = delete;
+    TraceScope& operator=( const TraceScope& ) = delete;
+
+    void Arg( const char* name, uint64_t val )
+    {
+        m_argName = name;
+        m_arg = val;
+    }
+
+private:
+    const char* m_name;
+    uint64_t m_start;
+    const char* m_argName;
+    uint64_t m_arg;
+};
+
+#endif
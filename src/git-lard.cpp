@@ -2,10 +2,11 @@
 #include <sstream>
 #include <stdio.h>
 #include <stdlib.h>
-#include <string.h>
+#include <string>
 
 #include "Debug.hpp"
-#include "Lard.hpp"
+#include "liblard.hpp"
+#include "Trace.hpp"
 
 struct StdErrDebugCallback : public DebugLog::Callback
 {
@@ -17,7 +18,7 @@ struct StdErrDebugCallback : public DebugLog::Callback
 
 void Usage()
 {
-    printf( "Usage: git lard [init|status|push|pull|gc|verify|checkout|find|index-filtered|submodule]\n" );
+    printf( "Usage: git lard [init|add|status|push|pull|gc|evict|daemon|verify|checkout|repack|find|cat-fat|index-filtered|submodule] [--verbose]\n" );
     exit( 1 );
 }
 
@@ -40,63 +41,18 @@ int main( int argc, char** argv )
     DBGPRINT( "Command line: " << s.str() );
 #endif
 
-    Lard lard( argv[0] );
+    Trace::Init( ( std::string( "git-lard " ) + argv[1] ).c_str() );
+    TRACE_SCOPE( "command" );
 
-#define CSTR(x) strcmp( argv[1], x ) == 0
-    if( CSTR( "filter-clean" ) )
+    auto repo = LardRepository::Open( nullptr, argv[0] );
+    if( !repo )
     {
-        lard.Clean();
+        return 1;
     }
-    else if( CSTR( "filter-smudge" ) )
-    {
-        lard.Smudge();
-    }
-    else if( CSTR( "init" ) )
-    {
-        lard.Init( argc-2, argv+2 );
-    }
-    else if( CSTR( "status" ) )
-    {
-        lard.Status( argc-2, argv+2 );
-    }
-    else if( CSTR( "push" ) )
-    {
-        lard.Push( argc-2, argv+2 );
-    }
-    else if( CSTR( "pull" ) )
-    {
-        lard.Pull( argc-2, argv+2 );
-    }
-    else if( CSTR( "gc" ) )
-    {
-        lard.GC();
-    }
-    else if( CSTR( "verify" ) )
-    {
-        lard.Verify();
-    }
-    else if( CSTR( "checkout" ) )
-    {
-        lard.Checkout();
-    }
-    else if( CSTR( "find" ) )
-    {
-        lard.Find( argc-2, argv+2 );
-    }
-    else if( CSTR( "index-filter" ) )
-    {
-        printf( "TODO\n" );
-        exit( 1 );
-    }
-    else if( CSTR( "submodule" ) )
-    {
-        lard.Submodule( argc-2, argv+2 );
-    }
-    else
+    if( !repo->Run( argc-1, argv+1 ) )
     {
         Usage();
     }
-#undef CSTR
 
     return 0;
 }
@@ -3,15 +3,21 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "git/attr.h"
 #include "git/cache.h"
 #include "git/config.h"
+#include "git/diff.h"
+#include "git/diffcore.h"
 #include "git/dir.h"
 #include "git/git-compat-util.h"
 #include "git/pathspec.h"
 #include "git/revision.h"
+#include "git/tree.h"
+#include "git/tree-walk.h"
 #include "git/list-objects.h"
 #include "git/submodule.h"
 #include "git/lockfile.h"
+#include "git/oidset.h"
 #include "git/repository.h"
 
 #include "glue.h"
@@ -20,11 +26,14 @@
 static char s_tmpbuf[4096];
 static struct pathspec pathspec;
 static int prefixlen;
+static const char* s_prefix;
 
-const char* SetupGitDirectory()
+// Dies outside of a repository, unless nongit is given.
+const char* SetupGitDirectory( int* nongit )
 {
-    const char* prefix = setup_git_directory();
+    const char* prefix = setup_git_directory_gently( nongit );
     prefixlen = prefix ? strlen( prefix ) : 0;
+    s_prefix = prefix;
     return prefix;
 }
 
@@ -44,9 +53,10 @@ const char* GetGitWorkTree()
     return get_git_work_tree();
 }
 
-void ParsePathspec( const char* prefix )
+void ParsePathspec( const char* prefix, const char** args )
 {
-    parse_pathspec( &pathspec, 0, PATHSPEC_PREFER_CWD, prefix, NULL );
+    clear_pathspec( &pathspec );
+    parse_pathspec( &pathspec, 0, PATHSPEC_PREFER_CWD, prefix, args );
 }
 
 int CheckIfConfigKeyExists( const char* key )
@@ -75,6 +85,26 @@ int GetConfigSetKey( const char* key, const char** val, struct config_set* cs )
     return !ret;
 }
 
+int GetConfigSetBool( const char* key, int* val, struct config_set* cs )
+{
+    int ret = git_configset_get_bool( cs, key, val );
+    if( ret )
+    {
+        ret = git_config_get_bool( key, val );
+    }
+    return !ret;
+}
+
+int GetConfigSetUlong( const char* key, unsigned long* val, struct config_set* cs )
+{
+    int ret = git_configset_get_ulong( cs, key, val );
+    if( ret )
+    {
+        ret = git_config_get_ulong( key, val );
+    }
+    return !ret;
+}
+
 struct config_set* NewConfigSet()
 {
     struct config_set* cs = (struct config_set*)malloc( sizeof( struct config_set ) );
@@ -92,8 +122,10 @@ void FreeConfigSet( struct config_set* cs )
     git_configset_clear( cs );
 }
 
+// Flags left by a previous walk in the same process would hide already visited objects.
 struct rev_info* NewRevInfo()
 {
+    clear_object_flags( ALL_REV_FLAGS );
     struct rev_info* revs = (struct rev_info*)malloc( sizeof( struct rev_info ) );
     init_revisions( revs, NULL );
     return revs;
@@ -127,6 +159,13 @@ int AddRev( struct rev_info* revs, const char* rev )
     return 0;
 }
 
+// Follows only first parents, in topological order. Must be set before PrepareRevWalk.
+void SetFirstParentWalk( struct rev_info* revs )
+{
+    revs->first_parent_only = 1;
+    revs->topo_order = 1;
+}
+
 void PrepareRevWalk( struct rev_info* revs )
 {
     verify( prepare_revision_walk( revs ) == 0 );
@@ -146,10 +185,68 @@ struct commit* GetRevision( struct rev_info* revs )
 static void null_show_commit( struct commit* a, void* b ) {}
 static void null_show_object( struct object* a, const char* b, void* c ) {}
 
+static struct exclude_list sparse_list;
+static int sparse_loaded;
+
+static int LoadSparseCheckout()
+{
+    int enabled;
+    char* fn;
+
+    if( sparse_loaded ) return sparse_loaded > 0;
+    sparse_loaded = -1;
+    if( git_config_get_bool( "core.sparsecheckout", &enabled ) || !enabled ) return 0;
+
+    fn = git_pathdup( "info/sparse-checkout" );
+    memset( &sparse_list, 0, sizeof( sparse_list ) );
+    if( add_excludes_from_file_to_list( fn, "", 0, &sparse_list, NULL ) < 0 )
+    {
+        free( fn );
+        return 0;
+    }
+    free( fn );
+    sparse_loaded = 1;
+    return 1;
+}
+
+// Same rules as unpack_trees: a match on a directory is inherited by everything below, unless overridden.
+static int IsInSparseCheckout( const char* path )
+{
+    int included = 0;
+    int len = strlen( path );
+    const char* basename = path;
+    int dtype;
+    int ret;
+
+    for( int i=0; i<len; i++ )
+    {
+        if( path[i] != '/' ) continue;
+        dtype = DT_DIR;
+        ret = is_excluded_from_list( path, i, basename, &dtype, &sparse_list, &the_index );
+        if( ret >= 0 ) included = ret;
+        basename = path + i + 1;
+    }
+    dtype = DT_REG;
+    ret = is_excluded_from_list( path, len, basename, &dtype, &sparse_list, &the_index );
+    if( ret >= 0 ) included = ret;
+    return included > 0;
+}
+
+static int filter_objects;
+
 static void show_fat_object( struct object* obj, const char* name, void* data )
 {
     if( obj->type == OBJ_BLOB )
     {
+        if( ( filter_objects & FilterPathspec ) && !match_pathspec( &pathspec, name, strlen( name ), 0, NULL, 0 ) )
+        {
+            return;
+        }
+        if( ( filter_objects & FilterSparse ) && !IsInSparseCheckout( name ) )
+        {
+            return;
+        }
+
         unsigned long size;
         struct object_info oi = { NULL };
         oi.sizep = &size;
@@ -167,8 +264,13 @@ static void show_fat_object( struct object* obj, const char* name, void* data )
     }
 }
 
-void GetFatObjectsFromRevs( struct rev_info* revs, int nowalk, void(*cb)( char* ) )
+void GetFatObjectsFromRevs( struct rev_info* revs, int nowalk, int filter, void(*cb)( char* ) )
 {
+    if( ( filter & FilterSparse ) && !LoadSparseCheckout() )
+    {
+        filter &= ~FilterSparse;
+    }
+    filter_objects = filter;
     revs->blob_objects = 1;
     revs->tree_objects = 1;
     revs->no_walk = nowalk;
@@ -211,37 +313,64 @@ struct TreeCallbacks
 
 static struct commit* tree_commit;
 
-static int ReadTree( const unsigned char* sha1, struct strbuf* base, const char* pathname, unsigned int mode, int stage, void* _cb )
-{
-    struct TreeCallbacks* cb = (struct TreeCallbacks*)_cb;
+// Trees known not to contain any of the searched blobs. Only valid during one search.
+static struct oidset clean_trees = OIDSET_INIT;
 
-    if( S_ISGITLINK( mode ) )
-    {
-        return 0;
-    }
-    if( S_ISDIR( mode ) )
-    {
-        return READ_TREE_RECURSIVE;
-    }
+static int ScanTree( struct tree* tree, struct TreeCallbacks* cb )
+{
+    if( oidset_contains( &clean_trees, &tree->object.oid ) ) return 0;
+    if( parse_tree( tree ) ) return 0;
 
-    int found = cb->find( sha1 );
-    if( found )
+    int found = 0;
+    struct tree_desc desc;
+    struct name_entry entry;
+    init_tree_desc( &desc, tree->buffer, tree->size );
+    while( tree_entry( &desc, &entry ) )
     {
-        cb->add( sha1, tree_commit );
+        if( S_ISGITLINK( entry.mode ) ) continue;
+        if( S_ISDIR( entry.mode ) )
+        {
+            found |= ScanTree( lookup_tree( entry.oid ), cb );
+        }
+        else if( cb->find( (const char*)entry.oid->hash ) )
+        {
+            cb->add( (const char*)entry.oid->hash, tree_commit );
+            found = 1;
+        }
     }
+    free_tree_buffer( tree );
 
-    return 0;
+    if( !found ) oidset_insert( &clean_trees, &tree->object.oid );
+    return found;
 }
 
-void GetCommitsForBlobs( struct rev_info* revs, int(*find)( const char* ), void(*add)( const char*, struct commit* ) )
+// Walks commits and reports searched blobs found in their trees. Subtrees which did not contain any searched blob
+// are not read again. The walk stops when 'done' returns nonzero after a commit.
+void GetCommitsForBlobs( struct rev_info* revs, int(*find)( const char* ), void(*add)( const char*, struct commit* ), int(*done)( struct commit* ) )
 {
     struct TreeCallbacks cb;
     cb.find = find;
     cb.add = add;
     while( ( tree_commit = get_revision( revs ) ) != NULL )
     {
-        read_tree_recursive( tree_commit->tree, "", 0, 0, &pathspec, ReadTree, &cb );
+        ScanTree( tree_commit->tree, &cb );
+        if( done( tree_commit ) ) break;
     }
+    oidset_clear( &clean_trees );
+}
+
+struct commit* GetCommit( const char* sha1 )
+{
+    struct object_id oid;
+    hashcpy( oid.hash, (const unsigned char*)sha1 );
+    struct commit* commit = lookup_commit_reference_gently( &oid, 1 );
+    if( !commit || parse_commit( commit ) ) return NULL;
+    return commit;
+}
+
+const char* GetCommitSha1( struct commit* commit )
+{
+    return (const char*)commit->object.oid.hash;
 }
 
 void PrintBlobCommitInfo( const char* blob, struct commit* commit )
@@ -258,89 +387,235 @@ int ReadCache()
     return read_cache();
 }
 
-void ListFiles( void(*cb)( const char*, const char*, const char* ) )
+// Prepends submodule prefix to name and checks it against pathspec.
+static int MatchFile( const char* name, unsigned int mode, char* buf )
 {
     const char* super_prefix = get_super_prefix();
+    char* ptr = buf;
+    if( super_prefix )
+    {
+        size_t len = strlen( super_prefix );
+        memcpy( ptr, super_prefix, len );
+        ptr += len;
+    }
+
+    size_t len = strlen( name );
+    memcpy( ptr, name, len );
+    ptr += len;
+
+    *ptr = '\0';
 
+    static char* ps_matched;
+    return match_pathspec( &pathspec, buf, ptr-buf, 0, ps_matched, S_ISDIR( mode ) || S_ISGITLINK( mode ) );
+}
+
+void ListFiles( void(*cb)( const char*, const char*, const char*, int ) )
+{
     for( int i=0; i<active_nr; i++ )
     {
         const struct cache_entry* ce = active_cache[i];
         if( ce->ce_flags & CE_UPDATE ) continue;
+        if( ce_skip_worktree( ce ) ) continue;
         char buf[1024];
-        char* ptr = buf;
-        if( super_prefix )
+        if( MatchFile( ce->name, ce->ce_mode, buf ) )
         {
-            size_t len = strlen( super_prefix );
-            memcpy( ptr, super_prefix, len );
-            ptr += len;
+            cb( buf, buf + prefixlen, (const char*)ce->oid.hash, i );
         }
+    }
+}
 
-        size_t len = strlen( ce->name );
-        memcpy( ptr, ce->name, len );
-        ptr += len;
+// Returns worktree file size recorded in the index, 0 if unknown or racily clean.
+uint32_t GetIndexFileSize( int pos )
+{
+    return active_cache[pos]->ce_stat_data.sd_size;
+}
+
+// Checks if worktree file is unchanged since it was written to the index, using stat data only.
+int IsIndexFileClean( int pos, const char* fn )
+{
+    struct stat st;
+    if( lstat( fn, &st ) != 0 ) return 0;
+    return ie_match_stat( &the_index, active_cache[pos], &st, CE_MATCH_IGNORE_VALID | CE_MATCH_IGNORE_SKIP_WORKTREE | CE_MATCH_RACY_IS_DIRTY ) == 0;
+}
 
-        *ptr = '\0';
+// Reads blob contents if it has size of a git-fat placeholder.
+// Returns 1 if buf was filled, 0 if the blob has placeholder size but cannot be read, -1 if it is not a placeholder.
+int ReadPlaceholderBlob( const char* blob, char* buf )
+{
+    unsigned long size;
+    if( sha1_object_info( (const unsigned char*)blob, &size ) != OBJ_BLOB || size != GitFatMagic ) return -1;
+
+    enum object_type type;
+    void* ptr = read_sha1_file( (const unsigned char*)blob, &type, &size );
+    if( !ptr ) return 0;
+    memcpy( buf, ptr, GitFatMagic );
+    free( ptr );
+    return 1;
+}
 
-        static char* ps_matched;
-        if( match_pathspec( &pathspec, buf, ptr-buf, 0, ps_matched, S_ISDIR( ce->ce_mode ) || S_ISGITLINK( ce->ce_mode ) ) )
+static void ShowChangedFiles( struct diff_queue_struct* q, struct diff_options* opt, void* data )
+{
+    for( int i=0; i<q->nr; i++ )
+    {
+        const struct diff_filespec* spec = q->queue[i]->two;
+        if( !DIFF_FILE_VALID( spec ) || !S_ISREG( spec->mode ) ) continue;
+        char buf[1024];
+        if( MatchFile( spec->path, spec->mode, buf ) )
         {
-            cb( buf, buf + prefixlen, (const char*)ce->oid.hash );
+            const int pos = cache_name_pos( spec->path, strlen( spec->path ) );
+            ((void(*)(const char*,const char*,const char*,int))data)( buf, buf + prefixlen, (const char*)spec->oid.hash, pos );
         }
     }
 }
 
+// Lists files whose contents differ between two trees. Returns -1 if the trees cannot be compared, e.g. when
+// 'from' is the null object passed to post-checkout after clone.
+int DiffTrees( const char* from, const char* to, void(*cb)( const char*, const char*, const char*, int ) )
+{
+    struct object_id oldOid, newOid;
+    if( get_oid( from, &oldOid ) || get_oid( to, &newOid ) ) return -1;
+    if( is_null_oid( &oldOid ) || is_null_oid( &newOid ) ) return -1;
+
+    struct diff_options opt;
+    diff_setup( &opt );
+    opt.flags.recursive = 1;
+    opt.output_format = DIFF_FORMAT_CALLBACK;
+    opt.format_callback = ShowChangedFiles;
+    opt.format_callback_data = cb;
+    diff_setup_done( &opt );
+
+    diff_tree_oid( &oldOid, &newOid, "", &opt );
+    diffcore_std( &opt );
+    diff_flush( &opt );
+    return 0;
+}
+
 static struct lock_file lock_file;
 
-void CheckoutFiles( struct CheckoutData(*cb)() )
+// Refreshes cached stat data of files restored by the caller. Changes are kept in memory until WriteIndex().
+void UpdateIndexFiles( const char*(*cb)() )
 {
-    struct CheckoutData data = cb();
-    if( !data.from ) return;
+    const char* fn = cb();
+    if( !fn ) return;
 
     assert( &the_index );
-    int newfd = hold_locked_index( &lock_file, LOCK_DIE_ON_ERROR );
 
     do
     {
-        int namelen = strlen( data.to );
-        int pos = cache_name_pos( data.to, namelen );
+        int namelen = strlen( fn );
+        int pos = cache_name_pos( fn, namelen );
 
         if( pos < 0 ) pos = -pos - 1;
 
-        while( pos < active_nr )
+        if( pos < active_nr && ce_namelen( active_cache[pos] ) == namelen && !memcmp( active_cache[pos]->name, fn, namelen ) )
         {
             struct cache_entry* ce = active_cache[pos];
-            if( ce_namelen( ce ) != namelen || memcmp( ce->name, data.to, namelen ) ) break;
-            pos++;
-
-            FILE* in = fopen( data.from, "rb" );
-            FILE* out = fopen( data.to, "wb" );
-
-            enum { BufSize = 64 * 1024 };
-            char buf[BufSize];
-            int size;
-            do
+            struct stat st;
+            if( lstat( ce->name, &st ) == 0 )
             {
-                size = fread( buf, 1, BufSize, in );
-                fwrite( buf, 1, size, out );
+                fill_stat_cache_info( ce, &st );
+                ce->ce_flags |= CE_UPDATE_IN_BASE;
             }
-            while( size == BufSize );
+        }
+        fn = cb();
+    }
+    while( fn );
 
-            fclose( in );
-            fclose( out );
+    the_index.cache_changed |= CE_ENTRY_CHANGED;
+}
 
-            struct stat st;
-            lstat( ce->name, &st );
-            fill_stat_cache_info( ce, &st );
-            ce->ce_flags |= CE_UPDATE_IN_BASE;
+// Adds a file with given blob contents to the index. Stat data is taken from the worktree file, so that git does
+// not run the clean filter on it again.
+int AddIndexFile( const char* path, const char* data, size_t size, const struct stat* st )
+{
+    unsigned char sha1[20];
+    if( write_sha1_file( data, size, blob_type, sha1 ) ) return -1;
+
+    const int len = strlen( path );
+    struct cache_entry* ce = xcalloc( 1, cache_entry_size( len ) );
+    memcpy( ce->name, path, len );
+    ce->ce_namelen = len;
+    ce->ce_flags = create_ce_flags( 0 );
+    ce->ce_mode = create_ce_mode( st->st_mode );
+    hashcpy( ce->oid.hash, sha1 );
+    fill_stat_cache_info( ce, (struct stat*)st );
+    return add_cache_entry( ce, ADD_CACHE_OK_TO_ADD | ADD_CACHE_OK_TO_REPLACE );
+}
+
+int IsFatFile( const char* path )
+{
+    static struct attr_check* check;
+    if( !check ) check = attr_check_initl( "filter", NULL );
+    git_check_attr( path, check );
+    const char* value = check->items[0].value;
+    return !ATTR_TRUE( value ) && !ATTR_FALSE( value ) && !ATTR_UNSET( value ) && strcmp( value, "fat" ) == 0;
+}
+
+// Lists regular files matching pathspec in args which 'git add' would see: tracked files, and untracked files which
+// are not ignored by .gitignore, info/exclude or core.excludesFile. Submodules and nested repositories are skipped.
+// Returns nonzero if some pathspec did not match any file.
+int ListWorkTreeFiles( const char** args, void(*cb)( const char* ) )
+{
+    struct pathspec ps;
+    parse_pathspec( &ps, 0, PATHSPEC_PREFER_CWD, prefixlen ? s_prefix : NULL, args );
+    char* seen = xcalloc( ps.nr, 1 );
+
+    for( int i=0; i<active_nr; i++ )
+    {
+        const struct cache_entry* ce = active_cache[i];
+        if( !S_ISREG( ce->ce_mode ) ) continue;
+        // Unmerged files have an entry for each stage.
+        if( i > 0 && ce_namelen( active_cache[i-1] ) == ce_namelen( ce ) && !memcmp( active_cache[i-1]->name, ce->name, ce_namelen( ce ) ) ) continue;
+        if( !match_pathspec( &ps, ce->name, ce_namelen( ce ), 0, seen, 0 ) ) continue;
+        cb( ce->name );
+    }
 
-            break;
+    struct dir_struct dir;
+    memset( &dir, 0, sizeof( dir ) );
+    setup_standard_excludes( &dir );
+    fill_directory( &dir, &the_index, &ps );
+    for( int i=0; i<dir.nr; i++ )
+    {
+        const struct dir_entry* ent = dir.entries[i];
+        // Untracked repositories are listed as directories.
+        if( ent->len == 0 || ent->name[ent->len-1] != '/' )
+        {
+            match_pathspec( &ps, ent->name, ent->len, 0, seen, 0 );
+            cb( ent->name );
         }
-        data = cb();
+        free( dir.entries[i] );
     }
-    while( data.from );
+    free( dir.entries );
+    free( dir.ignored );
 
-    the_index.cache_changed |= CE_ENTRY_CHANGED;
+    const int ret = report_path_error( seen, &ps, prefixlen ? s_prefix : NULL );
+    free( seen );
+    clear_pathspec( &ps );
+    return ret;
+}
+
+// Returns path relative to worktree top. Dies if path is outside of the repository.
+const char* GetWorkTreePath( const char* path )
+{
+    return prefix_path( prefixlen ? s_prefix : NULL, prefixlen, path );
+}
+
+// Takes the index lock before the index is read. Released by WriteIndex().
+int LockIndex()
+{
+    return hold_locked_index( &lock_file, LOCK_REPORT_ON_ERROR ) < 0 ? -1 : 0;
+}
+
+void WriteIndex()
+{
+    const int locked = is_lock_file_locked( &lock_file );
+    if( !the_index.cache_changed )
+    {
+        if( locked ) rollback_lock_file( &lock_file );
+        return;
+    }
 
+    int newfd = locked ? 0 : hold_locked_index( &lock_file, LOCK_DIE_ON_ERROR );
     if( 0 <= newfd && write_locked_index( &the_index, &lock_file, COMMIT_LOCK ) )
     {
         fprintf( stderr, "Unable to write new index file\n" );
@@ -4,23 +4,32 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
 #include <stdint.h>
 
 enum { GitFatMagic = 74 };
 
+enum
+{
+    FilterPathspec = 1 << 0,
+    FilterSparse = 1 << 1
+};
+
 struct rev_info;
 struct commit;
 struct config_set;
 
-const char* SetupGitDirectory();
+const char* SetupGitDirectory( int* nongit );
 const char* GetGitDir();
 const char* GetGitWorkTree();
-void ParsePathspec( const char* prefix );
+void ParsePathspec( const char* prefix, const char** args );
 
 int CheckIfConfigKeyExists( const char* key );
 void SetConfigKey( const char* key, const char* val );
 int GetConfigKey( const char* key, const char** val );
 int GetConfigSetKey( const char* key, const char** val, struct config_set* cs );
+int GetConfigSetBool( const char* key, int* val, struct config_set* cs );
+int GetConfigSetUlong( const char* key, unsigned long* val, struct config_set* cs );
 
 struct config_set* NewConfigSet();
 void ConfigSetAddFile( struct config_set* cs, const char* file );
@@ -30,28 +39,36 @@ struct rev_info* NewRevInfo();
 void AddRevHead( struct rev_info* revs );
 void AddRevAll( struct rev_info* revs );
 int AddRev( struct rev_info* revs, const char* rev );
+void SetFirstParentWalk( struct rev_info* revs );
 void PrepareRevWalk( struct rev_info* revs );
 void FreeRevs( struct rev_info* revs );
 
 struct commit* GetRevision( struct rev_info* revs );
-void GetFatObjectsFromRevs( struct rev_info* revs, int nowalk, void(*cb)( char* ) );
+void GetFatObjectsFromRevs( struct rev_info* revs, int nowalk, int filter, void(*cb)( char* ) );
 void GetObjectsFromRevs( struct rev_info* revs, void(*cb)( char*, size_t ) );
 void GetCommitList( struct rev_info* revs, void(*cb)( char* ) );
-void GetCommitsForBlobs( struct rev_info* revs, int(*find)( const char* ), void(*add)( const char*, struct commit* ) );
+void GetCommitsForBlobs( struct rev_info* revs, int(*find)( const char* ), void(*add)( const char*, struct commit* ), int(*done)( struct commit* ) );
+struct commit* GetCommit( const char* sha1 );
+const char* GetCommitSha1( struct commit* commit );
 
 void PrintBlobCommitInfo( const char* blob, struct commit* commit );
 
 void GetLinks( void(*cb)( const char* ) );
 
-struct CheckoutData
-{
-    const char* from;
-    const char* to;
-};
-
 int ReadCache();
-void ListFiles( void(*cb)( const char*, const char*, const char* ) );
-void CheckoutFiles( struct CheckoutData(*cb)() );
+void ListFiles( void(*cb)( const char*, const char*, const char*, int ) );
+int DiffTrees( const char* from, const char* to, void(*cb)( const char*, const char*, const char*, int ) );
+uint32_t GetIndexFileSize( int pos );
+int IsIndexFileClean( int pos, const char* fn );
+int ReadPlaceholderBlob( const char* blob, char* buf );
+void UpdateIndexFiles( const char*(*cb)() );
+int LockIndex();
+void WriteIndex();
+struct stat;
+int AddIndexFile( const char* path, const char* data, size_t size, const struct stat* st );
+int IsFatFile( const char* path );
+int ListWorkTreeFiles( const char** args, void(*cb)( const char* ) );
+const char* GetWorkTreePath( const char* path );
 
 const char* GetSha1( const char* name );
 
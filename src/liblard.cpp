@@ -0,0 +1,241 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Buffer.hpp"
+#include "FileMap.hpp"
+#include "Lard.hpp"
+#include "liblard.hpp"
+#include "Progress.hpp"
+#include "Trace.hpp"
+
+static bool s_opened = false;
+
+// Git state cannot be set up again in this process, also after a failure.
+std::unique_ptr<LardRepository> LardRepository::Open( const char* path, const char* commandName )
+{
+    if( s_opened ) return nullptr;
+    if( path && chdir( path ) != 0 )
+    {
+        fprintf( stderr, "Cannot open %s\n", path );
+        return nullptr;
+    }
+    s_opened = true;
+    Trace::Init( "liblard" );
+    int nongit = 0;
+    std::unique_ptr<Lard> lard( new Lard( commandName, &nongit ) );
+    if( nongit )
+    {
+        fprintf( stderr, "Not a git repository: %s\n", path ? path : "." );
+        return nullptr;
+    }
+    return std::unique_ptr<LardRepository>( new LardRepository( std::move( lard ) ) );
+}
+
+struct LardRepository::Object::Map
+{
+    FileMap<char> map;
+};
+
+LardRepository::Object::Object()
+{
+}
+
+LardRepository::Object::~Object()
+{
+}
+
+LardRepository::Object::Object( Object&& ) = default;
+LardRepository::Object& LardRepository::Object::operator=( Object&& ) = default;
+
+const char* LardRepository::Object::Data() const
+{
+    return m_map ? (const char*)m_map->map : nullptr;
+}
+
+uint64_t LardRepository::Object::Size() const
+{
+    return m_map ? m_map->map.Size() : 0;
+}
+
+LardRepository::LardRepository( std::unique_ptr<Lard>&& lard )
+    : m_lard( std::move( lard ) )
+{
+    m_lard->Setup();
+}
+
+LardRepository::~LardRepository()
+{
+}
+
+const char* LardRepository::ResolvePlaceholder( const char* path ) const
+{
+    const auto sha1 = Lard::GetFatObjectSha1( path );
+    return sha1 ? Buffer::Store( sha1, 40 ) : nullptr;
+}
+
+const char* LardRepository::Ingest( const char* path )
+{
+    struct stat st;
+    if( lstat( path, &st ) != 0 || !S_ISREG( st.st_mode ) ) return nullptr;
+    char sha1[41];
+    bool stored;
+    if( !m_lard->IngestFile( path, st, sha1, stored ) ) return nullptr;
+    return Buffer::Store( sha1, 40 );
+}
+
+// The repository stays open while other processes repack the store, so packs are reloaded when an object is missing.
+bool LardRepository::HasObject( const char* sha1 ) const
+{
+    if( !StringHelpers::IsObjectName( sha1 ) ) return false;
+    return m_lard->HasObject( sha1 ) || ( m_lard->ReloadPacks() && m_lard->HasObject( sha1 ) );
+}
+
+uint64_t LardRepository::GetObjectSize( const char* sha1 ) const
+{
+    if( !StringHelpers::IsObjectName( sha1 ) ) return 0;
+    if( !m_lard->HasObject( sha1 ) ) m_lard->ReloadPacks();
+    return m_lard->GetObjectSize( sha1 );
+}
+
+bool LardRepository::OpenObject( const char* sha1, Object& object ) const
+{
+    if( !StringHelpers::IsObjectName( sha1 ) ) return false;
+    object.m_map.reset( new Object::Map );
+    auto& map = object.m_map->map;
+    if( m_lard->MapObject( sha1, map ) || ( m_lard->ReloadPacks() && m_lard->MapObject( sha1, map ) ) ) return true;
+    object.m_map.reset();
+    return false;
+}
+
+int LardRepository::OpenObjectFd( const char* sha1 ) const
+{
+    if( !StringHelpers::IsObjectName( sha1 ) ) return -1;
+    const auto fn = m_lard->FindObjectFile( sha1 );
+    return fn ? open( fn, O_RDONLY | O_CLOEXEC ) : -1;
+}
+
+LardRepository::Status LardRepository::GetStatus( bool all )
+{
+    Status ret;
+    const auto referenced = m_lard->GetStatus( all, ret.orphans, ret.garbage );
+    ret.referenced.assign( referenced.begin(), referenced.end() );
+    return ret;
+}
+
+std::vector<const char*> LardRepository::GetReferenced( bool all, const char* rev )
+{
+    const auto referenced = m_lard->ReferencedObjects( all, false, rev );
+    return std::vector<const char*>( referenced.begin(), referenced.end() );
+}
+
+bool LardRepository::Run( int argc, char** argv )
+{
+    // --verbose is accepted by all commands, before a "--" separator.
+    int argn = 1;
+    for( int i=1; i<argc; i++ )
+    {
+        if( strcmp( argv[i], "--" ) == 0 )
+        {
+            while( i < argc ) argv[argn++] = argv[i++];
+            break;
+        }
+        if( strcmp( argv[i], "--verbose" ) == 0 )
+        {
+            Progress::SetVerbose( true );
+        }
+        else
+        {
+            argv[argn++] = argv[i];
+        }
+    }
+    argc = argn;
+    argv[argc] = nullptr;
+
+    auto& lard = *m_lard;
+#define CSTR(x) strcmp( argv[0], x ) == 0
+    if( CSTR( "filter-clean" ) )
+    {
+        lard.Clean( argc-1, argv+1 );
+    }
+    else if( CSTR( "filter-smudge" ) )
+    {
+        lard.Smudge();
+    }
+    else if( CSTR( "init" ) )
+    {
+        lard.Init( argc-1, argv+1 );
+    }
+    else if( CSTR( "add" ) )
+    {
+        lard.Add( argc-1, argv+1 );
+    }
+    else if( CSTR( "status" ) )
+    {
+        lard.Status( argc-1, argv+1 );
+    }
+    else if( CSTR( "push" ) )
+    {
+        lard.Push( argc-1, argv+1 );
+    }
+    else if( CSTR( "pull" ) )
+    {
+        lard.Pull( argc-1, argv+1 );
+    }
+    else if( CSTR( "gc" ) )
+    {
+        lard.GC();
+    }
+    else if( CSTR( "evict" ) )
+    {
+        lard.Evict( true );
+    }
+    else if( CSTR( "daemon" ) )
+    {
+        lard.Daemon();
+    }
+    else if( CSTR( "verify" ) )
+    {
+        lard.Verify();
+    }
+    else if( CSTR( "checkout" ) )
+    {
+        lard.Checkout();
+    }
+    else if( CSTR( "post-checkout" ) )
+    {
+        lard.PostCheckout( argc-1, argv+1 );
+    }
+    else if( CSTR( "post-merge" ) )
+    {
+        lard.PostMerge();
+    }
+    else if( CSTR( "repack" ) )
+    {
+        lard.Repack( argc-1, argv+1 );
+    }
+    else if( CSTR( "cat-fat" ) )
+    {
+        lard.CatFat( argc-1, argv+1 );
+    }
+    else if( CSTR( "find" ) )
+    {
+        lard.Find( argc-1, argv+1 );
+    }
+    else if( CSTR( "index-filter" ) )
+    {
+        printf( "TODO\n" );
+        exit( 1 );
+    }
+    else if( CSTR( "submodule" ) )
+    {
+        lard.Submodule( argc-1, argv+1 );
+    }
+    else
+    {
+        return false;
+    }
+#undef CSTR
+    return true;
+}
@@ -0,0 +1,74 @@
+#ifndef __LIBLARD_HPP__
+#define __LIBLARD_HPP__
+
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
+class Lard;
+
+// Embeddable interface to a git-lard repository, for tools which would otherwise run git-lard for each query.
+// Git keeps repository state in globals, so only one repository can be opened in a process. Returned strings are
+// valid for the lifetime of the process. Object names are 40 character hex strings. Each calling thread keeps string
+// storage, which is reused by later threads, so memory grows with the peak number of threads, not the total.
+class LardRepository
+{
+public:
+    struct Status
+    {
+        std::vector<const char*> referenced;
+        std::vector<const char*> orphans;
+        std::vector<const char*> garbage;
+    };
+
+    // Contents of an object, mapped until the object is destroyed or opened again. Empty objects have no data.
+    class Object
+    {
+    public:
+        Object();
+        ~Object();
+
+        Object( Object&& );
+        Object& operator=( Object&& );
+
+        const char* Data() const;
+        uint64_t Size() const;
+
+    private:
+        friend class LardRepository;
+        struct Map;
+        std::unique_ptr<Map> m_map;
+    };
+
+    // Changes the current directory to path, if given. Returns nullptr if there is no repository, or if a repository
+    // was already opened. Hooks installed by init run commandName.
+    static std::unique_ptr<LardRepository> Open( const char* path = nullptr, const char* commandName = "git-lard" );
+    ~LardRepository();
+
+    LardRepository( const LardRepository& ) = delete;
+    LardRepository& operator=( const LardRepository& ) = delete;
+
+    // Paths are relative to the worktree top.
+    const char* ResolvePlaceholder( const char* path ) const;
+    const char* Ingest( const char* path );
+
+    bool HasObject( const char* sha1 ) const;
+    uint64_t GetObjectSize( const char* sha1 ) const;
+    bool OpenObject( const char* sha1, Object& object ) const;
+    // Returns -1 if the object is missing or packed.
+    int OpenObjectFd( const char* sha1 ) const;
+
+    Status GetStatus( bool all );
+    std::vector<const char*> GetReferenced( bool all, const char* rev = nullptr );
+
+    // Runs a git-lard command, argv[0] being its name, e.g. "pull". argv must be terminated by nullptr and is modified.
+    // Returns false if the command is unknown. Commands print to stdout and exit the process on failure.
+    bool Run( int argc, char** argv );
+
+private:
+    LardRepository( std::unique_ptr<Lard>&& lard );
+
+    std::unique_ptr<Lard> m_lard;
+};
+
+#endif
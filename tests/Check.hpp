@@ -0,0 +1,50 @@
+#ifndef __CHECK_HPP__
+#define __CHECK_HPP__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+
+// Unit tests are single source files linked with the library. Failed checks are printed and counted, the test exits
+// with 1 if any failed.
+static int s_failed = 0;
+
+#define CHECK( cond ) do { if( !( cond ) ) { fprintf( stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond ); s_failed++; } } while( 0 )
+
+static inline int CheckResult( const char* name )
+{
+    printf( "%s %s\n", s_failed == 0 ? "ok" : "FAIL", name );
+    return s_failed == 0 ? 0 : 1;
+}
+
+// Empty directory, removed with its contents when the test ends.
+class TempDir
+{
+public:
+    TempDir()
+    {
+        const char* tmp = getenv( "TMPDIR" );
+        m_path = std::string( tmp && *tmp ? tmp : "/tmp" ) + "/lard-test.XXXXXX";
+        if( !mkdtemp( &m_path[0] ) )
+        {
+            fprintf( stderr, "Cannot create %s\n", m_path.c_str() );
+            exit( 1 );
+        }
+    }
+
+    ~TempDir()
+    {
+        system( ( "rm -rf '" + m_path + "'" ).c_str() );
+    }
+
+    TempDir( const TempDir& ) = delete;
+    TempDir& operator=( const TempDir& ) = delete;
+
+    std::string operator/( const char* name ) const { return m_path + "/" + name; }
+    const std::string& Path() const { return m_path; }
+
+private:
+    std::string m_path;
+};
+
+#endif
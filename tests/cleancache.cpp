@@ -0,0 +1,118 @@
+// Clean cache: lookups of appended and compacted records, replacement of damaged files and compaction.
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+
+#include "CleanCache.hpp"
+#include "StringHelpers.hpp"
+
+#include "Check.hpp"
+
+static const char* A = "0123456789abcdef0123456789abcdef01234567";
+static const char* B = "89abcdef0123456789abcdef0123456789abcdef";
+
+static bool HasRecord( const CleanCache& cache, const char* path, uint64_t size, uint64_t hash, const char* sha1 )
+{
+    CleanCacheRecord r;
+    if( !cache.Find( path, r ) ) return false;
+    char hex[41];
+    StringHelpers::Sha1ToHex( r.sha1, hex );
+    return r.size == size && r.hash == hash && strcmp( hex, sha1 ) == 0;
+}
+
+static long FileSize( const std::string& fn )
+{
+    FILE* f = fopen( fn.c_str(), "rb" );
+    if( !f ) return -1;
+    fseek( f, 0, SEEK_END );
+    const long size = ftell( f );
+    fclose( f );
+    return size;
+}
+
+// Size of the sorted table, stored in the header after the magic.
+static uint64_t SortedRecords( const std::string& fn )
+{
+    uint64_t sorted = 0;
+    FILE* f = fopen( fn.c_str(), "rb" );
+    if( !f ) return 0;
+    if( fseek( f, 8, SEEK_SET ) != 0 || fread( &sorted, sizeof( sorted ), 1, f ) != 1 ) sorted = 0;
+    fclose( f );
+    return sorted;
+}
+
+int main()
+{
+    TempDir dir;
+    const auto fn = dir / "clean";
+    CleanCache cache( fn );
+    CleanCacheRecord r;
+
+    CHECK( !cache.Find( "a.bin", r ) );
+    CHECK( cache.Compact( nullptr ) == 0 );
+
+    // First record creates the file, later ones are appended and the newest record of a path wins.
+    cache.Store( "a.bin", 10, 1, A );
+    cache.Store( "b.bin", 20, 2, B );
+    CHECK( HasRecord( cache, "a.bin", 10, 1, A ) );
+    CHECK( HasRecord( cache, "b.bin", 20, 2, B ) );
+    CHECK( !cache.Find( "c.bin", r ) );
+    cache.Store( "a.bin", 11, 3, B );
+    CHECK( HasRecord( cache, "a.bin", 11, 3, B ) );
+    CHECK( FileSize( fn ) == 4 * sizeof( CleanCacheRecord ) );
+
+    cache.Store( "c.bin", 30, 4, "not an object name" );
+    CHECK( !cache.Find( "c.bin", r ) );
+
+    // Compaction keeps the latest record of each path in the sorted table.
+    CHECK( cache.Compact( nullptr ) == 1 );
+    CHECK( FileSize( fn ) == 3 * sizeof( CleanCacheRecord ) );
+    CHECK( HasRecord( cache, "a.bin", 11, 3, B ) );
+    CHECK( HasRecord( cache, "b.bin", 20, 2, B ) );
+
+    // Records are found both in the table and appended after it, also when the file is compacted by Store.
+    char path[32];
+    for( int i=0; i<3000; i++ )
+    {
+        sprintf( path, "dir/%d.bin", i );
+        cache.Store( path, i, i * 7, ( i & 1 ) ? A : B );
+    }
+    CHECK( FileSize( fn ) / sizeof( CleanCacheRecord ) - 1 - SortedRecords( fn ) < 1024 );
+    for( int i=0; i<3000; i++ )
+    {
+        sprintf( path, "dir/%d.bin", i );
+        CHECK( HasRecord( cache, path, i, i * 7, ( i & 1 ) ? A : B ) );
+    }
+    CHECK( HasRecord( cache, "a.bin", 11, 3, B ) );
+
+    // Records of objects rejected by keep are dropped.
+    cache.Compact( []( const char* sha1 ) { return strcmp( sha1, A ) != 0; } );
+    CHECK( !cache.Find( "dir/1.bin", r ) );
+    CHECK( HasRecord( cache, "dir/2.bin", 2, 14, B ) );
+    CHECK( HasRecord( cache, "a.bin", 11, 3, B ) );
+
+    // A torn append would shift later records, the next store compacts the file.
+    {
+        FILE* f = fopen( fn.c_str(), "ab" );
+        fwrite( "torn", 1, 4, f );
+        fclose( f );
+    }
+    cache.Store( "d.bin", 40, 5, A );
+    CHECK( FileSize( fn ) % sizeof( CleanCacheRecord ) == 0 );
+    CHECK( HasRecord( cache, "d.bin", 40, 5, A ) );
+    CHECK( HasRecord( cache, "a.bin", 11, 3, B ) );
+
+    // Files in another format are not read and are replaced by the next store.
+    {
+        FILE* f = fopen( fn.c_str(), "wb" );
+        fprintf( f, "%096d", 0 );
+        fclose( f );
+    }
+    CHECK( !cache.Find( "a.bin", r ) );
+    cache.Store( "a.bin", 12, 6, A );
+    CHECK( HasRecord( cache, "a.bin", 12, 6, A ) );
+    CHECK( FileSize( fn ) == 2 * sizeof( CleanCacheRecord ) );
+
+    return CheckResult( "cleancache" );
+}
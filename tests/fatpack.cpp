@@ -0,0 +1,113 @@
+// Fat packs: writing, lookup, index-only packs, damaged files and duplicate objects.
+
+#include <string.h>
+#include <string>
+#include <unistd.h>
+
+#include "FatPack.hpp"
+#include "Filesystem.hpp"
+
+#include "Check.hpp"
+
+static const char* A = "0123456789abcdef0123456789abcdef01234567";
+static const char* B = "89abcdef0123456789abcdef0123456789abcdef";
+static const char* C = "fedcba9876543210fedcba9876543210fedcba98";
+static const char* D = "0000000000000000000000000000000000000001";
+
+static const std::string DataA = "first object";
+static const std::string DataB = "";
+static const std::string DataC = std::string( 100000, 'c' );
+
+static std::string WritePack( const std::string& dir )
+{
+    FatPackWriter writer( dir, "pack" );
+    CHECK( writer.Add( B, DataB.data(), DataB.size() ) );
+    CHECK( writer.Add( A, DataA.data(), DataA.size() ) );
+    CHECK( writer.Add( C, DataC.data(), DataC.size() ) );
+    CHECK( writer.Count() == 3 );
+    CHECK( writer.Finish() );
+    return writer.Base();
+}
+
+static bool HasObject( const FatPack& pack, const char* sha1, const std::string& data )
+{
+    const auto e = pack.Find( sha1 );
+    return e && e->size == data.size() && memcmp( pack.Data( e ), data.data(), data.size() ) == 0;
+}
+
+int main()
+{
+    TempDir dir;
+
+    const auto base = WritePack( dir.Path() );
+    CHECK( base.compare( 0, dir.Path().size() + 6, dir / "pack-" ) == 0 );
+    const auto list = ListFatPacks( dir.Path() );
+    CHECK( list.size() == 1 && list[0] == base );
+
+    {
+        FatPack pack( base );
+        CHECK( pack.IsValid() );
+        CHECK( pack.HasData() );
+        CHECK( pack.Check() );
+        CHECK( pack.Count() == 3 );
+        CHECK( HasObject( pack, A, DataA ) );
+        CHECK( HasObject( pack, B, DataB ) );
+        CHECK( HasObject( pack, C, DataC ) );
+        CHECK( !pack.Find( D ) );
+        CHECK( !pack.Find( "0123" ) );
+        CHECK( !pack.Find( "0123456789abcdef0123456789abcdef0123456z" ) );
+    }
+
+    // Pack names depend only on the contents.
+    {
+        TempDir other;
+        CHECK( WritePack( other.Path() ).substr( other.Path().size() ) == base.substr( dir.Path().size() ) );
+    }
+
+    // Bundles are kept as index only, objects are found without data.
+    {
+        TempDir other;
+        const auto copy = other / "bundle";
+        CHECK( system( ( "cp '" + base + ".idx' '" + copy + ".idx'" ).c_str() ) == 0 );
+        FatPack pack( copy );
+        CHECK( pack.IsValid() );
+        CHECK( !pack.HasData() );
+        CHECK( pack.Check() );
+        const auto e = pack.Find( C );
+        CHECK( e && e->size == DataC.size() );
+    }
+
+    // Entries pointing past the end of truncated data are not returned.
+    CHECK( truncate( ( base + ".pack" ).c_str(), 1000 ) == 0 );
+    {
+        FatPack pack( base );
+        CHECK( pack.IsValid() );
+        CHECK( !pack.Check() );
+        CHECK( HasObject( pack, A, DataA ) );
+        CHECK( !pack.Find( C ) );
+    }
+
+    CHECK( truncate( ( base + ".idx" ).c_str(), 20 ) == 0 );
+    {
+        FatPack pack( base );
+        CHECK( !pack.IsValid() );
+        CHECK( !pack.Check() );
+        CHECK( !pack.Find( A ) );
+    }
+
+    FatPack missing( dir / "missing" );
+    CHECK( !missing.IsValid() );
+
+    // Objects added twice would break lookups, the pack is not written.
+    {
+        TempDir other;
+        FatPackWriter writer( other.Path(), "pack" );
+        CHECK( writer.Add( A, DataA.data(), DataA.size() ) );
+        CHECK( writer.Add( A, DataA.data(), DataA.size() ) );
+        CHECK( !writer.Add( "not an object name", DataA.data(), DataA.size() ) );
+        CHECK( !writer.Finish() );
+        CHECK( ListFatPacks( other.Path() ).empty() );
+    }
+
+    return CheckResult( "fatpack" );
+}
@@ -0,0 +1,69 @@
+// Manifest of objects on the remote: lookup, merge and file round trip.
+
+#include <stdio.h>
+#include <vector>
+
+#include "Manifest.hpp"
+
+#include "Check.hpp"
+
+static const char* A = "0123456789abcdef0123456789abcdef01234567";
+static const char* B = "89abcdef0123456789abcdef0123456789abcdef";
+static const char* C = "fedcba9876543210fedcba9876543210fedcba98";
+static const char* D = "0000000000000000000000000000000000000001";
+
+int main()
+{
+    TempDir dir;
+
+    Manifest m;
+    CHECK( m.Size() == 0 );
+    CHECK( !m.Contains( A ) );
+
+    // Input is unsorted and has duplicates and invalid names.
+    m.Add( { C, A, "0123456789abcdef0123456789abcdef0123456z", A } );
+    CHECK( m.Size() == 2 );
+    CHECK( m.Contains( A ) );
+    CHECK( m.Contains( C ) );
+    CHECK( !m.Contains( B ) );
+    CHECK( !m.Contains( "" ) );
+    CHECK( !m.Contains( "0123" ) );
+
+    m.Add( {} );
+    CHECK( m.Size() == 2 );
+
+    // Added names are merged with the sorted list.
+    m.Add( { D, B } );
+    CHECK( m.Size() == 4 );
+    CHECK( m.Contains( B ) && m.Contains( D ) );
+
+    const auto fn = dir / "manifest";
+    CHECK( m.Save( fn.c_str() ) );
+    Manifest loaded;
+    CHECK( loaded.Load( fn.c_str() ) );
+    CHECK( loaded.Size() == 4 );
+    for( auto& v : { A, B, C, D } )
+    {
+        CHECK( loaded.Contains( v ) );
+    }
+
+    Manifest other;
+    other.Add( { A, "1111111111111111111111111111111111111111" } );
+    loaded.Merge( other );
+    CHECK( loaded.Size() == 5 );
+    CHECK( loaded.Contains( "1111111111111111111111111111111111111111" ) );
+
+    // Empty manifests are valid, missing or damaged files are not.
+    Manifest empty;
+    CHECK( empty.Save( fn.c_str() ) );
+    CHECK( loaded.Load( fn.c_str() ) );
+    CHECK( loaded.Size() == 0 );
+    CHECK( !loaded.Load( ( dir / "missing" ).c_str() ) );
+    FILE* f = fopen( fn.c_str(), "wb" );
+    fwrite( "LARDMF01xyz", 1, 11, f );
+    fclose( f );
+    CHECK( !loaded.Load( fn.c_str() ) );
+    CHECK( loaded.Size() == 0 );
+
+    return CheckResult( "manifest" );
+}
@@ -0,0 +1,401 @@
+#!/bin/sh
+# Runs git-lard integration tests against local repositories and fat stores.
+#
+#   run.sh [-k] [-w <workdir>] <git-lard binary> [test...]
+#
+#   -k               keep the work directory
+#   -w <workdir>     work directory (default: a new temporary directory)
+#
+# Tests are the Test_<name> functions below, all of them run by default. Each runs in its own directory, a line
+# "ok <name>" or "FAIL <name>" followed by its output is printed, and the exit code is 1 if any failed.
+
+KEEP=
+WORK=
+while getopts kw: opt; do
+    case $opt in
+        k) KEEP=1 ;;
+        w) WORK=$OPTARG ;;
+        *) sed -n '2,10s/^# \{0,1\}//p' "$0"; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+if [ $# -lt 1 ]; then
+    sed -n '2,10s/^# \{0,1\}//p' "$0"
+    exit 1
+fi
+
+LARD=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+shift
+
+if [ -z "$WORK" ]; then
+    WORK=$(mktemp -d "${TMPDIR:-/tmp}/lard-test.XXXXXX")
+else
+    mkdir -p "$WORK"
+    WORK=$(cd "$WORK" && pwd)
+fi
+if [ -z "$KEEP" ]; then
+    trap 'rm -rf "$WORK"' EXIT
+fi
+
+# Git configuration of the user must not affect results.
+mkdir -p "$WORK/bin" "$WORK/home"
+ln -sf "$LARD" "$WORK/bin/git-lard"
+ln -sf "$LARD" "$WORK/bin/git-fat"
+export PATH="$WORK/bin:$PATH"
+export HOME="$WORK/home"
+export GIT_CONFIG_NOSYSTEM=1
+export GIT_AUTHOR_NAME=test GIT_AUTHOR_EMAIL=test@localhost GIT_COMMITTER_NAME=test GIT_COMMITTER_EMAIL=test@localhost
+git config --global protocol.file.allow always
+unset GIT_LARD_TRACE
+
+Fail()
+{
+    echo "$*"
+    exit 1
+}
+
+# Runs a command, failing the test if it fails. Its output is kept in $OUT.
+Run()
+{
+    OUT=$("$@" 2>&1) || Fail "$* failed: $OUT"
+}
+
+# Runs a command and fails the test if its output does not contain $1.
+Expect()
+{
+    pattern=$1
+    shift
+    Run "$@"
+    case $OUT in
+        *"$pattern"*) ;;
+        *) Fail "$*: expected \"$pattern\", got: $OUT" ;;
+    esac
+}
+
+# Writes file $1 of size $3, with contents depending on $2.
+Write()
+{
+    mkdir -p "$(dirname "$1")"
+    yes "$2" | head -c "$3" > "$1"
+}
+
+# Creates repository $1 with fat store $1.remote and enters it.
+NewRepo()
+{
+    REMOTE=$PWD/$1.remote
+    mkdir -p "$REMOTE"
+    git init -q "$1"
+    cd "$1" || Fail "cd $1"
+    Run git lard init
+    printf '[rsync]\n\tremote = %s\n' "$REMOTE" > .gitfat
+    printf '*.bin filter=fat -crlf\n' > .gitattributes
+}
+
+Commit()
+{
+    Run git add -A
+    Run git commit -q -m "$1"
+}
+
+# Fat object name of file $1.
+Sha1()
+{
+    sha1sum < "$1" | cut -d' ' -f1
+}
+
+IsPlaceholder()
+{
+    [ "$(head -c 12 "$1")" = '#$# git-fat ' ]
+}
+
+Test_manifest()
+{
+    NewRepo repo
+    Write a.bin a 1000
+    Write b.bin b 2000
+    Commit first
+    Run git lard push
+    [ -f "$REMOTE/manifest" ] || Fail "no manifest on remote"
+    Expect "Objects to push: 0 (2 already on remote)" git lard push
+
+    Write c.bin c 3000
+    Commit second
+    Expect "Objects to push: 1 (2 already on remote)" git lard push
+    [ -f "$REMOTE/$(Sha1 c.bin)" ] || Fail "c.bin not pushed"
+
+    # Objects pushed by clients without a manifest are found by the listing of a new one.
+    rm "$REMOTE/manifest"
+    Write foreign foreign 100
+    cp foreign "$REMOTE/$(Sha1 foreign)"
+    rm foreign
+    Run git lard push
+    [ "$(wc -c < "$REMOTE/manifest")" -eq $((8 + 4 * 20)) ] || Fail "manifest does not list 4 objects"
+    Expect "Objects to push: 0 (3 already on remote)" git lard push
+}
+
+Test_bundle()
+{
+    NewRepo repo
+    Run git config lard.bundle true
+    Run git config lard.bundleThreshold 1500
+    Write a.bin a 1000
+    Write b.bin b 1200
+    Write c.bin c 2000
+    Commit first
+    Expect "Pushing 2 small objects in 1 bundles" git lard push
+    [ ! -f "$REMOTE/$(Sha1 a.bin)" ] || Fail "a.bin pushed loose"
+    [ -f "$REMOTE/$(Sha1 c.bin)" ] || Fail "c.bin not pushed loose"
+
+    # Pull finds bundled objects also without lard.bundle.
+    cd ..
+    Run git clone -q repo clone
+    cd clone || Fail "cd clone"
+    Run git lard init
+    Run git lard pull
+    for f in a.bin b.bin c.bin; do
+        cmp -s "$f" "../repo/$f" || Fail "$f not restored"
+    done
+}
+
+Test_repack()
+{
+    NewRepo repo
+    Write a.bin a 1000
+    Write b.bin b 2000
+    Write c.bin c 3000
+    Commit first
+    cp a.bin ../a.orig
+    A=$(Sha1 a.bin)
+    Run git config lard.packThreshold 2500
+    Run git lard repack
+    [ ! -f ".git/fat/objects/$A" ] || Fail "a.bin not packed"
+    [ -f ".git/fat/objects/$(Sha1 c.bin)" ] || Fail "c.bin packed"
+    ls .git/fat/packs/*.idx > /dev/null 2>&1 || Fail "no pack written"
+
+    git lard cat-fat "$A" > ../a.out || Fail "cat-fat failed"
+    cmp -s ../a.out ../a.orig || Fail "cat-fat returned wrong data"
+    Expect "$A fat 1000" sh -c "echo $A | git lard cat-fat --batch-check"
+    Expect "0000000000000000000000000000000000000001 missing" sh -c "echo 0000000000000000000000000000000000000001 | git lard cat-fat --batch-check"
+
+    # Packed objects are smudged, verified and pushed like loose ones.
+    rm a.bin
+    Run git checkout -- a.bin
+    cmp -s a.bin ../a.orig || Fail "a.bin not restored from pack"
+    Run git lard verify
+    Run git lard push
+    cmp -s "$REMOTE/$A" ../a.orig || Fail "packed object not pushed"
+}
+
+Test_pathspec()
+{
+    NewRepo repo
+    Write d1/a.bin a 1000
+    Write d1/sub/b.bin b 2000
+    Write d2/c.bin c 3000
+    Commit first
+    Run git lard push
+
+    cd ..
+    Run git clone -q repo clone
+    cd clone || Fail "cd clone"
+    Run git lard init
+    IsPlaceholder d2/c.bin || Fail "clone has fat contents"
+    Run git lard pull -- 'd1/**'
+    cmp -s d1/a.bin ../repo/d1/a.bin || Fail "d1/a.bin not restored"
+    cmp -s d1/sub/b.bin ../repo/d1/sub/b.bin || Fail "d1/sub/b.bin not restored"
+    IsPlaceholder d2/c.bin || Fail "d2/c.bin restored"
+    [ ! -f ".git/fat/objects/$(Sha1 ../repo/d2/c.bin)" ] || Fail "d2/c.bin fetched"
+
+    Run git lard pull -- d2
+    cmp -s d2/c.bin ../repo/d2/c.bin || Fail "d2/c.bin not restored"
+}
+
+Test_sparse_checkout()
+{
+    NewRepo repo
+    Write d1/a.bin a 1000
+    Write d2/b.bin b 2000
+    Commit first
+    Run git lard push
+
+    cd ..
+    Run git clone -q repo clone
+    cd clone || Fail "cd clone"
+    Run git lard init
+    Run git config core.sparseCheckout true
+    echo 'd1/' > .git/info/sparse-checkout
+    Run git read-tree -mu HEAD
+    IsPlaceholder d1/a.bin || Fail "clone has fat contents"
+    [ ! -e d2/b.bin ] || Fail "d2/b.bin checked out"
+
+    # Neither the index nor history pulls fetch objects outside the sparse checkout.
+    B=$(Sha1 ../repo/d2/b.bin)
+    Run git lard pull
+    cmp -s d1/a.bin ../repo/d1/a.bin || Fail "d1/a.bin not restored"
+    [ ! -f ".git/fat/objects/$B" ] || Fail "d2/b.bin fetched"
+    Run git lard pull --all
+    [ ! -f ".git/fat/objects/$B" ] || Fail "d2/b.bin fetched from history"
+    Run git lard checkout
+    [ ! -e d2/b.bin ] || Fail "d2/b.bin restored"
+}
+
+Test_evict()
+{
+    NewRepo repo
+    Write a.bin a1 5000
+    Write b.bin b 5000
+    Commit first
+    A1=$(Sha1 a.bin)
+    Write a.bin a2 5000
+    Commit second
+    A2=$(Sha1 a.bin)
+    B=$(Sha1 b.bin)
+    Run git config lard.maxStoreSize 1
+
+    # Without a cold store, only objects on the remote are evicted, and never those of HEAD.
+    Expect "Kept 1 objects not known to be on the remote" git lard evict
+    [ -f ".git/fat/objects/$A1" ] || Fail "unpushed object evicted"
+    Run git lard push --all
+    Expect "Evicted 1 objects" git lard evict
+    [ ! -f ".git/fat/objects/$A1" ] || Fail "pushed object not evicted"
+    [ -f ".git/fat/objects/$A2" ] && [ -f ".git/fat/objects/$B" ] || Fail "HEAD object evicted"
+
+    # Packed objects are moved to the cold store, which is searched like an alternate.
+    Write a.bin a3 5000
+    Commit third
+    Run git config lard.coldStore "$PWD/../cold"
+    Run git config lard.packThreshold 10000
+    Run git lard repack
+    Expect "Evicted 1 objects" git lard evict
+    [ -f "../cold/$A2" ] || Fail "packed object not moved to cold store"
+    Write ../a2 a2 5000
+    Run git checkout HEAD~1 -- a.bin
+    cmp -s a.bin ../a2 || Fail "a.bin not restored from cold store"
+    Run git lard verify
+}
+
+Test_placeholder()
+{
+    NewRepo repo
+    Write a.bin a 1000
+    Write b.bin b 2000
+    Write c.bin c 3000
+    Commit first
+    Run git lard push
+
+    cd ..
+    Run git clone -q repo clone
+    cd clone || Fail "cd clone"
+    Run git lard init
+    # Entries written in the same second as the files have no stat data, refresh them later.
+    sleep 1
+    git update-index -q --refresh
+
+    # A local file of placeholder size with the indexed mtime and inode is told apart from the placeholder when the
+    # index is not newer than the file.
+    Run git config core.trustctime false
+    touch -r a.bin ../stamp
+    printf '%74s' local > a.bin
+    touch -r ../stamp a.bin
+    touch -r ../stamp .git/index
+    Run git lard pull
+    [ "$(cat a.bin)" = "$(printf '%74s' local)" ] || Fail "racy a.bin overwritten"
+    cmp -s b.bin ../repo/b.bin || Fail "b.bin not restored"
+    cmp -s c.bin ../repo/c.bin || Fail "c.bin not restored"
+
+    # Restored files are indexed with their real size and skipped without reading them.
+    sleep 1
+    git update-index -q --refresh
+    GIT_LARD_TRACE=$PWD/../trace git lard checkout > /dev/null 2>&1 || Fail "checkout failed"
+    grep -q '"placeholders":[1-9]' ../trace || Fail "placeholder scan read restored files"
+}
+
+# Prints the fat object of the placeholder blob of $1 cleaned with the contents of file $2.
+CleanObject()
+{
+    blob=$(git hash-object --path "$1" --stdin < "$2") || Fail "hash-object failed"
+    git cat-file blob "$blob" | cut -d' ' -f3
+}
+
+Test_clean_cache()
+{
+    NewRepo repo
+    Write a.bin a 100000
+    Commit first
+    [ -f .git/fat/clean ] || Fail "no clean cache"
+    Write ../a a 100000
+    Write ../other o 100000
+
+    # Contents matching the cached record are not hashed with SHA-1.
+    [ "$(GIT_LARD_TRACE=$PWD/../hit CleanObject a.bin a.bin)" = "$(Sha1 ../a)" ] || Fail "wrong object on hit"
+    grep -q '"hashed":[1-9]' ../hit && Fail "hashed on hit"
+
+    # Other contents piped for a cached path are recognized, also with equal size.
+    [ "$(GIT_LARD_TRACE=$PWD/../miss CleanObject a.bin ../other)" = "$(Sha1 ../other)" ] || Fail "stdin not checked"
+    grep -q '"hashed":[1-9]' ../miss || Fail "not hashed on miss"
+    [ -f ".git/fat/objects/$(Sha1 ../other)" ] || Fail "object not stored on miss"
+
+    # A racy modification keeps size and mtime, the worktree file is still checked.
+    touch -r a.bin ../stamp
+    Write a.bin b 100000
+    touch -r ../stamp a.bin
+    Run git add a.bin
+    [ "$(git cat-file blob :a.bin | cut -d' ' -f3)" = "$(Sha1 a.bin)" ] || Fail "racy change not cleaned"
+    [ "$(CleanObject a.bin ../a)" = "$(Sha1 ../a)" ] || Fail "old contents not recognized"
+}
+
+Test_add()
+{
+    NewRepo repo
+    Write d1/a.bin a 1000
+    Write d1/sub/b.bin b 2000
+    Write d1/ignored.bin i 100
+    Write d1/text.txt t 10
+    Write d2/c.bin c 3000
+    echo 'ignored.bin' > .gitignore
+    Run git add .gitattributes .gitfat .gitignore
+
+    # Only files matching the pathspec with the filter attribute are added, ignored files are skipped.
+    Run git lard add d1
+    [ "$(git ls-files d1 d2 | tr '\n' ' ')" = "d1/a.bin d1/sub/b.bin " ] || Fail "wrong files added: $(git ls-files)"
+    [ -f ".git/fat/objects/$(Sha1 d1/a.bin)" ] || Fail "object not stored"
+
+    git ls-files -s > ../lard.idx
+    Run git rm -q -r --cached d1
+    Run git add d1/a.bin d1/sub/b.bin
+    git ls-files -s | cmp -s - ../lard.idx || Fail "index differs from git add"
+}
+
+Test_sparse_files()
+{
+    NewRepo repo
+    Write a.bin a 1000
+    truncate -s 10M a.bin
+    cp --sparse=always a.bin ../a
+    Run git lard add a.bin
+    Run git commit -q -m first
+    [ "$(git cat-file blob :a.bin | cut -d' ' -f3)" = "$(Sha1 ../a)" ] || Fail "sparse file hashed wrong"
+    cmp -s ".git/fat/objects/$(Sha1 ../a)" ../a || Fail "object differs"
+
+    rm a.bin
+    Run git -c filter.fat.smudge=cat checkout -- a.bin
+    Run git lard checkout
+    cmp -s a.bin ../a || Fail "a.bin not restored"
+}
+
+if [ $# -eq 0 ]; then
+    set -- $(sed -n 's/^Test_\([a-z0-9_]*\)()$/\1/p' "$0")
+fi
+
+rc=0
+for name in "$@"; do
+    mkdir -p "$WORK/$name"
+    if out=$(cd "$WORK/$name" && "Test_$name" 2>&1); then
+        echo "ok $name"
+    else
+        echo "FAIL $name"
+        echo "$out" | sed 's/^/    /'
+        rc=1
+    fi
+done
+exit $rc
@@ -0,0 +1,64 @@
+// Sparse files: zero detection, writes leaving holes and data extents of the result.
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#include "Sparse.hpp"
+
+#include "Check.hpp"
+
+int main()
+{
+    TempDir dir;
+
+    std::vector<char> zeros( 3 * Sparse::BlockSize );
+    CHECK( Sparse::IsZero( zeros.data(), 0 ) );
+    CHECK( Sparse::IsZero( zeros.data(), zeros.size() ) );
+    zeros.back() = 1;
+    CHECK( !Sparse::IsZero( zeros.data(), zeros.size() ) );
+    zeros.back() = 0;
+    zeros.front() = 1;
+    CHECK( !Sparse::IsZero( zeros.data(), zeros.size() ) );
+
+    // Data, two zero blocks and a data tail, written at an unaligned offset.
+    enum { Offset = 100 };
+    std::vector<char> data( 4 * Sparse::BlockSize + 1000 );
+    for( size_t i=0; i<Sparse::BlockSize; i++ ) data[i] = char( i * 7 + 1 );
+    for( size_t i=4*Sparse::BlockSize; i<data.size(); i++ ) data[i] = char( i );
+    const uint64_t size = Offset + data.size();
+
+    const auto fn = dir / "file";
+    const auto fd = open( fn.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666 );
+    CHECK( fd >= 0 );
+    const auto saved = Sparse::Saved();
+    CHECK( Sparse::Write( fd, data.data(), Offset, data.size() ) );
+    CHECK( ftruncate( fd, size ) == 0 );
+    // Blocks fully inside the zero range are skipped, aligned to the file offset.
+    CHECK( Sparse::Saved() - saved == 2 * Sparse::BlockSize );
+
+    std::vector<char> read( size );
+    CHECK( pread( fd, read.data(), size, 0 ) == (ssize_t)size );
+    CHECK( Sparse::IsZero( read.data(), Offset ) );
+    CHECK( memcmp( read.data() + Offset, data.data(), data.size() ) == 0 );
+
+    // Extents cover all data, in order, whether or not the filesystem supports holes.
+    const auto extents = Sparse::DataExtents( fd, size );
+    CHECK( !extents.empty() );
+    CHECK( Sparse::DataSize( extents ) <= size );
+    uint64_t pos = 0;
+    for( auto& v : extents )
+    {
+        CHECK( v.offset >= pos && v.size > 0 && v.offset + v.size <= size );
+        CHECK( Sparse::IsZero( read.data() + pos, v.offset - pos ) );
+        pos = v.offset + v.size;
+    }
+    CHECK( Sparse::IsZero( read.data() + pos, size - pos ) );
+    CHECK( lseek( fd, 0, SEEK_CUR ) == 0 );
+    close( fd );
+
+    CHECK( Sparse::DataExtents( -1, 0 ).empty() );
+
+    return CheckResult( "sparse" );
+}